@@ -27,7 +27,13 @@
 
 #define ID_SIZE 8	// Number of bytes in printerid; 8.
 #define UUID_SIZE 16	// Number of bytes in uuid; 16.
-#define PROTOCOL_VERSION 2
+#define PROTOCOL_VERSION 3
+// Optional protocol features, negotiated in BEGIN.
+#define CAP_SEGMENT 1	// Fragments can be described as polynomials with CMD_SEGMENT.
+#define CAP_MULTI 2	// Several motors can be filled with one CMD_MULTI packet.
+#define CAPABILITIES (CAP_SEGMENT | CAP_MULTI)
+// Largest packet the host may send, excluding checksums.  Three of them must fit in the serial buffer.
+#define MAX_PACKET_LEN (SERIAL_BUFFER_SIZE / 4 * 3 / 4)
 
 #define ADC_INTERVAL 1000	// Delay 1 ms between ADC measurements.
 
@@ -61,7 +67,7 @@
 } while (0)
 
 // BEGIN reply is the longest command that doesn't depend on NUM_MOTORS.
-#define MAX_REPLY_LEN ((4 + 4 * NUM_MOTORS) > 11 + UUID_SIZE ? (4 + 4 * NUM_MOTORS) : 11 + UUID_SIZE)
+#define MAX_REPLY_LEN ((4 + 4 * NUM_MOTORS) > 14 + UUID_SIZE ? (4 + 4 * NUM_MOTORS) : 14 + UUID_SIZE)
 #define REPLY_BUFFER_SIZE (MAX_REPLY_LEN + (MAX_REPLY_LEN + 2) / 3)
 
 #define SERIAL_BUFFER_SIZE (1 << SERIAL_SIZE_BITS)
@@ -91,6 +97,7 @@ EXTERN uint8_t uuid[UUID_SIZE];
 EXTERN int16_t command_end;
 EXTERN bool had_data;
 EXTERN uint8_t reply[MAX_REPLY_LEN], adcreply[6];
+EXTERN uint8_t capabilities;		// CAP_* bits that were negotiated with the host.
 EXTERN uint8_t ping;			// bitmask of waiting ping replies.
 EXTERN uint8_t out_busy;
 EXTERN uint8_t reply_ready, adcreply_ready;
@@ -212,7 +219,7 @@ EXTERN Pin_t pin[NUM_DIGITAL_PINS];
 
 enum Command {
 	// from host
-	CMD_BEGIN = 0x00,	// 0
+	CMD_BEGIN = 0x00,	// 1:packetlen, 8:printerid, [1:capabilities]
 	CMD_PING,	// 1:code
 	CMD_SET_UUID,	// 16: UUID
 	CMD_SETUP,	// 1:active_motors, 4:us/sample, 1:led_pin, 1:stop_pin 1:probe_pin 1:pin_flags 2:timeout
@@ -232,12 +239,17 @@ enum Command {
 	CMD_GETPIN,	// 1:pin
 	CMD_SPI,	// 1:size, size: data.
 	CMD_PINNAME,	// 1:pin (0-127: digital, 128-255: analog)
+	CMD_REPEAT,	// 1:which, 1:age (fill from the fragment this many places back)
+	CMD_REPEAT_SINGLE,// 1:which, 1:age
+	CMD_SEGMENT,	// 1:which, 2:start, 4:v, 4:a (all 16.16 fixed point steps; see packet.cpp)
+	CMD_SEGMENT_SINGLE,// 1:which, 2:start, 4:v, 4:a
+	CMD_MULTI,	// 2:packetlen, {MOVE, REPEAT or SEGMENT command, without checksums}*
 };
 
 enum RCommand {
 	// to host
 		// responses to host requests; only one active at a time.
-	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment
+	CMD_READY = 0x10,	// 1:packetlen, 4:version, 1:num_dpins, 1:num_adc, 1:num_motors, 1:fragments/motor, 1:bytes/fragment, 16:uuid, 1:capabilities, 2:max_packetlen
 	CMD_PONG,	// 1:code
 	CMD_HOMED,	// {4:motor_pos}*
 	CMD_PIN,	// 1:state
@@ -298,6 +310,16 @@ static inline int16_t minpacketlen() {
 		return 2;
 	case CMD_PINNAME:
 		return 2;
+	case CMD_REPEAT:
+		return 3;
+	case CMD_REPEAT_SINGLE:
+		return 3;
+	case CMD_SEGMENT:
+		return 12;
+	case CMD_SEGMENT_SINGLE:
+		return 12;
+	case CMD_MULTI:
+		return 3;
 	default:
 		debug("invalid command passed to minpacketlen: %x", command(0));
 		return 1;
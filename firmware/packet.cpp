@@ -34,6 +34,86 @@ static uint32_t read_32(int pos) {
 	return ret;
 }
 
+// Fill the buffer for one motor from a MOVE, REPEAT or SEGMENT command at pos in the packet. {{{
+static int16_t fill_len(int16_t pos) {
+	switch (command(pos) & 0x1f) {
+	case CMD_REPEAT:
+	case CMD_REPEAT_SINGLE:
+		return 3;
+	case CMD_SEGMENT:
+	case CMD_SEGMENT_SINGLE:
+		return 12;
+	default:
+		return 2 + last_len;
+	}
+}
+
+static bool fill_motor(int16_t pos) {
+	uint8_t cmd = command(pos) & 0x1f;
+	uint8_t m = command(pos + 1);
+	if (m >= NUM_MOTORS) {
+		debug("invalid buffer %d to fill", m);
+		return false;
+	}
+	if (*reinterpret_cast <volatile uint16_t *>(&buffer[last_fragment][m][0]) != uint16_t(0x8000)) {
+		debug("duplicate buffer %d to fill", m);
+		return false;
+	}
+	if (cmd == CMD_REPEAT || cmd == CMD_REPEAT_SINGLE) {
+		// Copy the samples from an earlier fragment; they are still in the buffer, because only last_fragment is ever overwritten.
+		uint8_t age = command(pos + 2);
+		uint8_t src = (last_fragment - age) & FRAGMENTS_PER_MOTOR_MASK;
+		if (age == 0 || age > FRAGMENTS_PER_MOTOR_MASK || settings[src].len != last_len || *reinterpret_cast <volatile uint16_t *>(&buffer[src][m][0]) == uint16_t(0x8000)) {
+			debug("invalid fragment %d to repeat for %d", age, m);
+			return false;
+		}
+		for (uint8_t b = 0; b < last_len; ++b)
+			buffer[last_fragment][m][b] = buffer[src][m][b];
+	}
+	else if (cmd == CMD_SEGMENT || cmd == CMD_SEGMENT_SINGLE) {
+		// Integrate the polynomial into samples here, so the step ISR doesn't need to know about it.
+		// Position after sample k is start + k * v + a * k * (k - 1) / 2; each sample gets the change in its integer part.
+		// p holds only the fraction between samples, but p + v can still exceed 32 bits.
+		int64_t p = read_16(pos + 2);
+		int32_t v = read_32(pos + 4);
+		int32_t a = read_32(pos + 8);
+		for (uint8_t b = 0; b < last_len; b += 2) {
+			p += v;
+			int16_t steps = p >> 16;
+			p &= 0xffff;
+			v += a;
+			*reinterpret_cast <volatile int16_t *>(&buffer[last_fragment][m][b]) = steps;
+		}
+	}
+	else if (cmd == CMD_MOVE || cmd == CMD_MOVE_SINGLE) {
+		for (uint8_t b = 0; b < last_len; ++b)
+			buffer[last_fragment][m][b] = static_cast <uint8_t>(command(pos + 2 + b));
+	}
+	else {
+		debug("invalid fill command %x", cmd);
+		return false;
+	}
+	if (cmd == CMD_MOVE || cmd == CMD_REPEAT || cmd == CMD_SEGMENT) {
+		for (uint8_t f = 0; f < active_motors; ++f) {
+			if ((motor[f].follow & 0x7f) == m) {
+				for (uint8_t b = 0; b < last_len; b += 2) {
+					int16_t value = *reinterpret_cast <volatile int16_t *>(&buffer[last_fragment][m][b]);
+					if (motor[f].follow & 0x80)
+						value = -value;
+					*reinterpret_cast <volatile int16_t *>(&buffer[last_fragment][f][b]) = value;
+				}
+			}
+		}
+	}
+	filling -= 1;
+	if (filling == 0) {
+		//debug("filled %d; current %d notified %d", last_fragment, current_fragment, notified_current_fragment);
+		last_fragment = (last_fragment + 1) & FRAGMENTS_PER_MOTOR_MASK;
+	}
+	return true;
+}
+// }}}
+
 void packet()
 {
 	last_active = seconds();
@@ -46,6 +126,8 @@ void packet()
 		arch_watchdog_enable();
 		for (uint8_t i = 0; i < ID_SIZE; ++i)
 			printerid[1 + i] = command(2 + i);
+		// Older hosts don't send capabilities; don't use any extensions with them.
+		capabilities = command(1) > 2 + ID_SIZE ? command(2 + ID_SIZE) & CAPABILITIES : 0;
 		// Because this is a new connection: reset active_motors and all ADC pins.
 		active_motors = 0;
 		for (uint8_t a = 0; a < NUM_ANALOG_INPUTS; ++a)
@@ -55,7 +137,7 @@ void packet()
 		homers = 0;
 		home_step_time = 0;
 		reply[0] = CMD_READY;
-		reply[1] = 27;
+		reply[1] = 14 + UUID_SIZE;
 		*reinterpret_cast <uint32_t *>(&reply[2]) = PROTOCOL_VERSION;
 		reply[6] = NUM_DIGITAL_PINS;
 		reply[7] = NUM_ANALOG_INPUTS;
@@ -66,7 +148,10 @@ void packet()
 			BUFFER_CHECK(reply, 11 + i);
 			reply[11 + i] = uuid[i];
 		}
-		reply_ready = 11 + UUID_SIZE;
+		reply[11 + UUID_SIZE] = capabilities;
+		reply[12 + UUID_SIZE] = MAX_PACKET_LEN & 0xff;
+		reply[13 + UUID_SIZE] = (MAX_PACKET_LEN >> 8) & 0xff;
+		reply_ready = 14 + UUID_SIZE;
 		write_ack();
 		return;
 	}
@@ -426,14 +511,12 @@ void packet()
 	}
 	case CMD_MOVE:
 	case CMD_MOVE_SINGLE:
+	case CMD_REPEAT:
+	case CMD_REPEAT_SINGLE:
+	case CMD_SEGMENT:
+	case CMD_SEGMENT_SINGLE:
 	{
-		cmddebug("CMD_MOVE(_SINGLE)");
-		uint8_t m = command(1);
-		if (m >= NUM_MOTORS) {
-			debug("invalid buffer %d to fill", m);
-			write_stall();
-			return;
-		}
+		cmddebug("CMD_MOVE(_SINGLE), CMD_REPEAT(_SINGLE) or CMD_SEGMENT(_SINGLE)");
 		if (stopping >= 0) {
 			//debug("ignoring move while stopping");
 			write_ack();
@@ -444,29 +527,42 @@ void packet()
 			write_stall();
 			return;
 		}
-		if (*reinterpret_cast <volatile uint16_t *>(&buffer[last_fragment][m][0]) != uint16_t(0x8000)) {
-			debug("duplicate buffer %d to fill", m);
+		if (!fill_motor(0)) {
 			write_stall();
 			return;
 		}
-		for (uint8_t b = 0; b < last_len; ++b)
-			buffer[last_fragment][m][b] = static_cast <uint8_t>(command(2 + b));
-		if (command(0) != CMD_MOVE_SINGLE) {
-			for (uint8_t f = 0; f < active_motors; ++f) {
-				if ((motor[f].follow & 0x7f) == m) {
-					for (uint8_t b = 0; b < last_len; b += 2) {
-						int16_t value = *reinterpret_cast <volatile int16_t *>(&buffer[last_fragment][m][b]);
-						if (motor[f].follow & 0x80)
-							value = -value;
-						*reinterpret_cast <volatile int16_t *>(&buffer[last_fragment][f][b]) = value;
-					}
-				}
-			}
+		write_ack();
+		return;
+	}
+	case CMD_MULTI:
+	{
+		cmddebug("CMD_MULTI");
+		if (stopping >= 0) {
+			//debug("ignoring multi while stopping");
+			write_ack();
+			return;
 		}
-		filling -= 1;
-		if (filling == 0) {
-			//debug("filled %d; current %d notified %d", last_fragment, current_fragment, notified_current_fragment);
-			last_fragment = (last_fragment + 1) & FRAGMENTS_PER_MOTOR_MASK;
+		int16_t len = read_16(1);
+		if (len < 3 || len > MAX_PACKET_LEN) {
+			debug("invalid MULTI length %d", len);
+			write_stall();
+			return;
+		}
+		for (int16_t pos = 3; pos < len; pos += fill_len(pos)) {
+			if (filling == 0) {
+				debug("MULTI has more data than motors");
+				write_stall();
+				return;
+			}
+			if (pos + fill_len(pos) > len) {
+				debug("MULTI record at %d does not fit in %d", pos, len);
+				write_stall();
+				return;
+			}
+			if (!fill_motor(pos)) {
+				write_stall();
+				return;
+			}
 		}
 		write_ack();
 		return;
@@ -70,6 +70,11 @@ static inline int16_t fullpacketlen() { // {{{
 	else if ((command(0) & 0x1f) == CMD_MOVE || (command(0) & 0x1f) == CMD_MOVE_SINGLE) {
 		return 2 + last_len;
 	}
+	else if ((command(0) & 0x1f) == CMD_MULTI) {
+		// Never wait for more than fits in the buffer; packet() rejects a longer length.
+		uint16_t len = command(1) | (command(2) << 8);
+		return len > MAX_PACKET_LEN ? MAX_PACKET_LEN : len;
+	}
 	else if ((command(0) & 0x1f) == CMD_SPI) {
 		return 2 + ((command(1) + 7) >> 3);
 	}
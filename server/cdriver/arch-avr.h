@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <math.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -42,10 +43,17 @@
 #define SERIAL
 #define ADCBITS 10
 #define DATA_TYPE int16_t
-#define ARCH_MOTOR DATA_TYPE *avr_data;
+#define ARCH_MOTOR DATA_TYPE *avr_data; DATA_TYPE *avr_sent; int avr_sent_len;
 #define ARCH_SPACE
-#define ARCH_NEW_MOTOR(s, m, base) base[m]->avr_data = new DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(DATA_TYPE)]
-#define DATA_DELETE(s, m) delete[] (spaces[s].motor[m]->avr_data)
+#define ARCH_NEW_MOTOR(s, m, base) do { \
+	base[m]->avr_data = new DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(DATA_TYPE)]; \
+	base[m]->avr_sent = new DATA_TYPE[BYTES_PER_FRAGMENT / sizeof(DATA_TYPE)]; \
+	base[m]->avr_sent_len = -1; \
+} while (0)
+#define DATA_DELETE(s, m) do { \
+	delete[] (spaces[s].motor[m]->avr_data); \
+	delete[] (spaces[s].motor[m]->avr_sent); \
+} while (0)
 #define DATA_CLEAR(s, m) memset((spaces[s].motor[m]->avr_data), 0, BYTES_PER_FRAGMENT)
 #define DATA_SET(s, m, v) spaces[s].motor[m]->avr_data[current_fragment_pos] = v;
 #define SAMPLES_PER_FRAGMENT (BYTES_PER_FRAGMENT / sizeof(DATA_TYPE))
@@ -85,6 +93,17 @@ enum HWCommands { // {{{
 	HWC_GETPIN,	// 10
 	HWC_SPI,	// 11
 	HWC_PINNAME,	// 12
+	HWC_REPEAT,	// 13
+	HWC_REPEAT_SINGLE,// 14
+	HWC_SEGMENT,	// 15
+	HWC_SEGMENT_SINGLE,// 16
+	HWC_MULTI,	// 17
+};
+
+// Optional protocol features, negotiated in BEGIN.
+enum HWCapabilities {
+	HWC_CAP_SEGMENT = 1,
+	HWC_CAP_MULTI = 2,
 };
 
 enum HWResponses {
@@ -153,6 +172,7 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor);
 void arch_do_discard();
 void arch_discard();
 void arch_send_spi(int len, uint8_t *data);
+void avr_forget_fragments();
 void START_DEBUG();
 void DO_DEBUG(char c);
 void END_DEBUG();
@@ -187,7 +207,7 @@ struct Avr_pin_t { // {{{
 // Declarations of static variables; extern because this is a header file. {{{
 EXTERN AVRSerial avr_serial;
 EXTERN uint8_t avr_pong;
-EXTERN char avr_buffer[256];
+EXTERN char avr_buffer[FULL_MAX_PACKET_SIZE];
 EXTERN int avr_limiter_space;
 EXTERN int avr_limiter_motor;
 EXTERN bool avr_running;
@@ -207,6 +227,11 @@ EXTERN bool avr_stop_fake;
 EXTERN void (*avr_cb)();
 EXTERN int *avr_pin_name_len;
 EXTERN char **avr_pin_name;
+EXTERN uint8_t avr_capabilities;
+EXTERN int avr_max_packet;
+EXTERN char *avr_stage;		// Fill commands for all motors of the fragment that is being sent.
+EXTERN int *avr_stage_pos;
+EXTERN int *avr_stage_packet_end;
 // }}}
 
 #define avr_write_ack(reason) do { \
@@ -268,7 +293,7 @@ void avr_send() { // {{{
 	//debug("avr_send");
 	while (out_busy >= 3) {
 		//debug("avr send");
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
 	serial_cb[out_busy] = avr_cb;
@@ -729,8 +754,8 @@ void arch_reset() { // {{{
 	int32_t before = millis();
 	while (avr_pong != 7 && millis() - before < 2000) {
 		//debug("avr pongwait %d", avr_pong);
-		pollfds[2].revents = 0;
-		poll(&pollfds[2], 1, 1);
+		pollfds[POLL_ARCH].revents = 0;
+		poll(&pollfds[POLL_ARCH], 1, 1);
 		serial(1);
 	}
 	if (avr_pong != 7) {
@@ -789,6 +814,8 @@ void arch_motor_change(uint8_t s, uint8_t sm) { // {{{
 void arch_change(bool motors) { // {{{
 	int old_active_motors = avr_active_motors;
 	if (motors) {
+		// Motor numbers may have changed; don't refer to old fragments.
+		avr_forget_fragments();
 		avr_active_motors = 0;
 		for (uint8_t s = 0; s < NUM_SPACES; ++s) {
 			avr_active_motors += spaces[s].num_motors;
@@ -899,6 +926,14 @@ static void avr_setup_end4() { // {{{
 	avr_setup_end3();
 } // }}}
 
+void avr_forget_fragments() { // {{{
+	// The firmware buffer no longer matches what was sent; the next fragment must be sent in full.
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		for (int m = 0; m < spaces[s].num_motors; ++m)
+			spaces[s].motor[m]->avr_sent_len = -1;
+	}
+} // }}}
+
 static void avr_setup_end3() { // {{{
 	if (avr_next_pin_name >= NUM_PINS) {
 		setup_end();
@@ -924,6 +959,11 @@ void avr_setup_end2() { // {{{
 	//id[0][:8] + '-' + id[0][8:12] + '-' + id[0][12:16] + '-' + id[0][16:20] + '-' + id[0][20:32]
 	for (int i = 0; i < UUID_SIZE; ++i)
 		uuid[i] = command[1][11 + i];
+	// Firmware that doesn't know about capabilities sends a shorter reply.
+	avr_capabilities = command[1][1] > 11 + UUID_SIZE ? command[1][11 + UUID_SIZE] : 0;
+	avr_max_packet = command[1][1] > 13 + UUID_SIZE ? command[1][12 + UUID_SIZE] | command[1][13 + UUID_SIZE] << 8 : 0;
+	if (avr_max_packet > MAX_PACKET_SIZE - 1)
+		avr_max_packet = MAX_PACKET_SIZE - 1;
 	avr_write_ack("setup");
 	avr_control_queue = new uint8_t[NUM_DIGITAL_PINS * 3];
 	avr_in_control_queue = new bool[NUM_DIGITAL_PINS];
@@ -939,9 +979,13 @@ void avr_setup_end2() { // {{{
 	avr_adc_id = new int[NUM_ANALOG_INPUTS];
 	for (int i = 0; i < NUM_ANALOG_INPUTS; ++i)
 		avr_adc_id[i] = ~0;
+	avr_stage = new char[NUM_MOTORS * (2 + BYTES_PER_FRAGMENT)];
+	avr_stage_pos = new int[NUM_MOTORS + 1];
+	avr_stage_packet_end = new int[NUM_MOTORS + 1];
 	avr_pos_offset = new double[NUM_MOTORS];
 	for (int m = 0; m < NUM_MOTORS; ++m)
 		avr_pos_offset[m] = 0;
+	avr_forget_fragments();
 	avr_next_pin_name = 0;
 	avr_pin_name_len = new int[NUM_PINS];
 	avr_pin_name = new char *[NUM_PINS];
@@ -951,11 +995,12 @@ void avr_setup_end2() { // {{{
 void arch_setup_end(char const *run_id) { // {{{
 	// Get constants.
 	avr_buffer[0] = HWC_BEGIN;
-	avr_buffer[1] = 10;
+	avr_buffer[1] = 11;
 	for (int i = 0; i < 8; ++i)
 		avr_buffer[2 + i] = run_id[i];
+	avr_buffer[10] = HWC_CAP_SEGMENT | HWC_CAP_MULTI;
 	wait_for_reply[expected_replies++] = avr_setup_end2;
-	prepare_packet(avr_buffer, 10);
+	prepare_packet(avr_buffer, 11);
 	avr_send();
 } // }}}
 
@@ -977,7 +1022,7 @@ void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin, bo
 	try_send_control();
 	while (out_busy >= 3) {
 		//debug("avr send");
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 		try_send_control();
 	}
@@ -1093,6 +1138,7 @@ void avr_stop2() { // {{{
 	current_fragment = running_fragment;
 	current_fragment_pos = 0;
 	num_active_motors = 0;
+	avr_forget_fragments();
 	host_block = false;
 	avr_write_ack("stop");
 	serial(0);	// Handle any data that was refused before.
@@ -1110,58 +1156,232 @@ static void avr_sent_fragment() { // {{{
 	}
 } // }}}
 
+static int64_t avr_segment_spread(int64_t const *lower, int n, int64_t v) { // {{{
+	// Difference between the highest and lowest value of lower[k] - k * v.
+	int64_t lo = 0, hi = 0;
+	for (int k = 1; k <= n; ++k) {
+		int64_t value = lower[k] - k * v;
+		if (value < lo)
+			lo = value;
+		if (value > hi)
+			hi = value;
+	}
+	return hi - lo;
+} // }}}
+
+static bool avr_try_segment(DATA_TYPE const *samples, int n, int64_t a, int32_t &start, int32_t &v) { // {{{
+	// Find start and v so the firmware's integration with acceleration a reproduces samples exactly.
+	// Position in 1/65536 steps after k samples is start + k * v + a * k * (k - 1) / 2; its integer part must be the sum of the first k samples.
+	int64_t lower[128];	// n < 128, because BYTES_PER_FRAGMENT is 8 bit.
+	int64_t pos = 0;
+	for (int k = 0; k <= n; ++k) {
+		lower[k] = (pos << 16) - a * k * (k - 1) / 2;
+		if (k < n)
+			pos += samples[k];
+	}
+	// With v fixed, start must be in [max_k(lower[k] - k * v), min_k(lower[k] - k * v) + 0xffff].
+	// The spread of lower[k] - k * v is convex in v, so its minimum is found with a binary search on its slope.
+	// The first and last position alone limit v to a window of about 0x20000 / n, so this takes O(n log(0x20000 / n)).
+	int64_t vmin = lower[n] - 0xffff, vmax = lower[n] + 0xffff;
+	vmin = vmin >= 0 ? (vmin + n - 1) / n : -(-vmin / n);
+	vmax = vmax >= 0 ? vmax / n : -((-vmax + n - 1) / n);
+	while (vmin < vmax) {
+		int64_t mid = vmin + (vmax - vmin) / 2;
+		if (avr_segment_spread(lower, n, mid + 1) < avr_segment_spread(lower, n, mid))
+			vmin = mid + 1;
+		else
+			vmax = mid;
+	}
+	// cdriver.h's min and max are for int; these values don't fit in one.
+	int64_t smin = 0, smax = 0xffff;
+	for (int k = 1; k <= n; ++k) {
+		if (lower[k] - k * vmin > smin)
+			smin = lower[k] - k * vmin;
+		if (lower[k] + 0xffff - k * vmin < smax)
+			smax = lower[k] + 0xffff - k * vmin;
+	}
+	if (smin > smax || vmin < INT32_MIN || vmin > INT32_MAX || vmin + n * a < INT32_MIN || vmin + n * a > INT32_MAX)
+		return false;
+	start = smin;
+	v = vmin;
+	return true;
+} // }}}
+
+static bool avr_check_segment(DATA_TYPE const *samples, int n, int32_t start, int32_t v, int32_t a) { // {{{
+	// Expand the segment like the firmware does and compare it with the samples.
+	int64_t p = uint16_t(start);
+	for (int k = 0; k < n; ++k) {
+		p += v;
+		if ((p >> 16) != samples[k])
+			return false;
+		p &= 0xffff;
+		v += a;
+	}
+	return true;
+} // }}}
+
+static bool avr_fit_segment(DATA_TYPE const *samples, int n, int32_t &start, int32_t &v, int32_t &a) { // {{{
+	// Least squares fit of a parabola through the centers of the steps, to get a starting point for the acceleration.
+	double s[5] = {0, 0, 0, 0, 0}, r[3] = {0, 0, 0};
+	double pos = 0;
+	for (int k = 0; k <= n; ++k) {
+		double t = k * (k - 1) / 2.;
+		double y = (pos + .5) * 65536;
+		double p = 1;
+		for (int i = 0; i < 5; ++i, p *= k)
+			s[i] += p;
+		r[0] += y;
+		r[1] += y * k;
+		r[2] += y * t;
+		if (k < n)
+			pos += samples[k];
+	}
+	// Sums over 1, k, t, k*t, t*t, with t = (k^2 - k) / 2.
+	double m[3][3] = {
+		{s[0], s[1], (s[2] - s[1]) / 2},
+		{s[1], s[2], (s[3] - s[2]) / 2},
+		{(s[2] - s[1]) / 2, (s[3] - s[2]) / 2, (s[4] - 2 * s[3] + s[2]) / 4}
+	};
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if (fabs(det) < 1e-9)
+		return false;
+	double a_est = (m[0][0] * (m[1][1] * r[2] - r[1] * m[2][1]) - m[0][1] * (m[1][0] * r[2] - r[1] * m[2][0]) + r[0] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])) / det;
+	if (fabs(a_est) > INT32_MAX)
+		return false;
+	int64_t base = llround(a_est);
+	int const offsets[] = {0, -1, 1, -16, 16, -256, 256};
+	for (unsigned i = 0; i < sizeof(offsets) / sizeof(*offsets); ++i) {
+		if (avr_try_segment(samples, n, base + offsets[i], start, v)) {
+			a = base + offsets[i];
+			return true;
+		}
+	}
+	return false;
+} // }}}
+
+static int avr_stage_motor(char *target, Motor &mtr, int index, int cfp) { // {{{
+	// Write the command that fills the fragment for one motor to target; return its length.
+	bool same = mtr.avr_sent_len == cfp;
+	for (int i = 0; i < cfp; ++i) {
+		DATA_TYPE value = (mtr.dir_pin.inverted() ? -1 : 1) * mtr.avr_data[i];
+		if (same && mtr.avr_sent[i] != value)
+			same = false;
+		mtr.avr_sent[i] = value;
+	}
+	mtr.avr_sent_len = cfp;
+	target[1] = index;
+	int32_t start, v, a;
+	if (same) {
+		// Identical to what this motor got in the previous fragment; let the firmware copy it.
+		target[0] = settings.single ? HWC_REPEAT_SINGLE : HWC_REPEAT;
+		target[2] = 1;
+		return 3;
+	}
+	if (avr_capabilities & HWC_CAP_SEGMENT && 2 + 2 * cfp > 12 && avr_fit_segment(mtr.avr_sent, cfp, start, v, a) && avr_check_segment(mtr.avr_sent, cfp, start, v, a)) {
+		// The samples can be described by a polynomial; send that instead.
+		target[0] = settings.single ? HWC_SEGMENT_SINGLE : HWC_SEGMENT;
+		target[2] = start & 0xff;
+		target[3] = (start >> 8) & 0xff;
+		for (int i = 0; i < 4; ++i) {
+			target[4 + i] = (v >> (8 * i)) & 0xff;
+			target[8 + i] = (a >> (8 * i)) & 0xff;
+		}
+		return 12;
+	}
+	target[0] = settings.single ? HWC_MOVE_SINGLE : HWC_MOVE;
+	for (int i = 0; i < cfp; ++i) {
+		target[2 + 2 * i] = mtr.avr_sent[i] & 0xff;
+		target[2 + 2 * i + 1] = (mtr.avr_sent[i] >> 8) & 0xff;
+	}
+	return 2 + 2 * cfp;
+} // }}}
+
 bool arch_send_fragment() { // {{{
 	if (host_block || stopping || discard_pending || stop_pending) {
 		//debug("not sending arch frag %d %d %d %d", host_block, stopping, discard_pending, stop_pending);
 		return false;
 	}
 	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
 	if (stop_pending || discard_pending)
 		return false;
+	// Prepare the data for all motors first, so the number of packets is known.
+	int cfp = current_fragment_pos;
+	int num_records = 0;
+	avr_stage_pos[0] = 0;
+	int mi = 0;
+	for (int s = 0; s < NUM_SPACES; mi += spaces[s++].num_motors) {
+		for (uint8_t m = 0; m < spaces[s].num_motors; ++m) {
+			Motor &mtr = *spaces[s].motor[m];
+			if (!mtr.active) {
+				// The firmware fills this slot with a sentinel, so it cannot be repeated later.
+				mtr.avr_sent_len = -1;
+				continue;
+			}
+			cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
+			//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
+			avr_stage_pos[num_records + 1] = avr_stage_pos[num_records] + avr_stage_motor(&avr_stage[avr_stage_pos[num_records]], mtr, mi + m, cfp);
+			num_records += 1;
+		}
+	}
+	// Group the records into packets.  Without CMD_MULTI support, every record is a packet.
+	int num_packets = 0;
+	int *packet_end = avr_stage_packet_end;
+	packet_end[0] = 0;
+	for (int r = 0; r < num_records; ++r) {
+		// Append the record to the last packet if it fits, otherwise start a new packet.
+		if (avr_capabilities & HWC_CAP_MULTI && num_packets > 0 && 3 + avr_stage_pos[r + 1] - avr_stage_pos[packet_end[num_packets - 1]] <= avr_max_packet)
+			packet_end[num_packets] = r + 1;
+		else
+			packet_end[++num_packets] = r + 1;
+	}
 	avr_buffer[0] = settings.probing ? HWC_START_PROBE : HWC_START_MOVE;
 	//debug("send fragment current-fragment-pos=%d current-fragment=%d active-moters=%d running=%d num-running=0x%x", current_fragment_pos, current_fragment, num_active_motors, running_fragment, (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER);
 	avr_buffer[1] = current_fragment_pos * 2;
 	avr_buffer[2] = num_active_motors;
-	sending_fragment = num_active_motors + 1;
+	sending_fragment = num_packets + 1;
+	bool complete = false;
 	if (prepare_packet(avr_buffer, 3)) {
 		transmitting_fragment = true;
 		avr_cb = &avr_sent_fragment;
 		avr_send();
-		int mi = 0;
 		avr_filling = true;
-		int cfp = current_fragment_pos;
-		for (int s = 0; !host_block && !stopping && !discard_pending && !stop_pending && s < NUM_SPACES; mi += spaces[s++].num_motors) {
-			for (uint8_t m = 0; !host_block && !stopping && !discard_pending && !stop_pending && m < spaces[s].num_motors; ++m) {
-				if (!spaces[s].motor[m]->active)
-					continue;
-				cpdebug(s, m, "sending %d %d", current_fragment, current_fragment_pos);
-				//debug("sending %d %d cf %d cp 0x%x", s, m, current_fragment, current_fragment_pos);
-				while (out_busy >= 3) {
-					poll(&pollfds[2], 1, -1);
-					serial(1);
-				}
-				if (stop_pending || discard_pending)
-					break;
-				avr_buffer[0] = settings.single ? HWC_MOVE_SINGLE : HWC_MOVE;
-				avr_buffer[1] = mi + m;
-				for (int i = 0; i < cfp; ++i) {
-					int value = (spaces[s].motor[m]->dir_pin.inverted() ? -1 : 1) * spaces[s].motor[m]->avr_data[i];
-					avr_buffer[2 + 2 * i] = value & 0xff;
-					avr_buffer[2 + 2 * i + 1] = (value >> 8) & 0xff;
-				}
-				if (prepare_packet(avr_buffer, 2 + 2 * cfp)) {
-					avr_cb = &avr_sent_fragment;
-					avr_send();
-				}
-				else
-					break;
+		int p;
+		for (p = 1; !host_block && !stopping && !discard_pending && !stop_pending && p <= num_packets; ++p) {
+			while (out_busy >= 3) {
+				poll(&pollfds[POLL_ARCH], 1, -1);
+				serial(1);
+			}
+			if (stop_pending || discard_pending)
+				break;
+			int first = avr_stage_pos[packet_end[p - 1]];
+			int len = avr_stage_pos[packet_end[p]] - first;
+			if (packet_end[p] - packet_end[p - 1] == 1) {
+				memcpy(avr_buffer, &avr_stage[first], len);
+			}
+			else {
+				avr_buffer[0] = HWC_MULTI;
+				avr_buffer[1] = (len + 3) & 0xff;
+				avr_buffer[2] = ((len + 3) >> 8) & 0xff;
+				memcpy(&avr_buffer[3], &avr_stage[first], len);
+				len += 3;
+			}
+			if (prepare_packet(avr_buffer, len)) {
+				avr_cb = &avr_sent_fragment;
+				avr_send();
 			}
+			else
+				break;
 		}
+		complete = p > num_packets;
 		transmitting_fragment = false;
 	}
+	if (!complete) {
+		// The firmware did not get all records, so avr_sent may not match its buffer; don't let the next fragment repeat it.
+		avr_forget_fragments();
+	}
 	avr_filling = false;
 	return !host_block && !stopping && !discard_pending && !stop_pending;
 } // }}}
@@ -1184,7 +1404,7 @@ void arch_start_move(int extra) { // {{{
 	}
 	//debug("start move %d %d %d %d", current_fragment, running_fragment, sending_fragment, extra);
 	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
 	start_pending = false;
@@ -1200,8 +1420,9 @@ bool arch_running() { // {{{
 
 void arch_home() { // {{{
 	avr_homing = true;
+	avr_forget_fragments();
 	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
 	avr_buffer[0] = HWC_HOME;
@@ -1244,9 +1465,10 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 	if (len <= 0)
 		return max;
 	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
+	avr_forget_fragments();
 	avr_buffer[0] = HWC_START_MOVE;
 	avr_buffer[1] = len;
 	avr_buffer[2] = NUM_MOTORS;
@@ -1260,7 +1482,7 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 	avr_filling = true;
 	for (int m = 0; m < NUM_MOTORS; ++m) {
 		while (out_busy >= 3) {
-			poll(&pollfds[2], 1, -1);
+			poll(&pollfds[POLL_ARCH], 1, -1);
 			serial(1);
 		}
 		avr_buffer[0] = HWC_MOVE_SINGLE;
@@ -1281,12 +1503,13 @@ off_t arch_send_audio(uint8_t *map, off_t pos, off_t max, int motor) { // {{{
 void arch_do_discard() { // {{{
 	int cbs = 0;
 	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
 	if (!discard_pending)
 		return;
 	discard_pending = false;
+	avr_forget_fragments();
 	int fragments = (current_fragment - running_fragment + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER;
 	if (fragments <= 2)
 		return;
@@ -1318,7 +1541,7 @@ void arch_discard() { // {{{
 
 void arch_send_spi(int bits, uint8_t *data) { // {{{
 	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
 	avr_buffer[0] = HWC_SPI;
@@ -1358,6 +1581,9 @@ void AVRSerial::begin(char const *port, int baud) { // {{{
 		pid_t pid = fork();
 		if (!pid) {
 			// Child.
+			sigset_t none;
+			sigemptyset(&none);
+			sigprocmask(SIG_SETMASK, &none, NULL);
 			close(pipes[0]);
 			dup2(pipes[1], 0);
 			dup2(pipes[1], 1);
@@ -1372,9 +1598,9 @@ void AVRSerial::begin(char const *port, int baud) { // {{{
 	else {
 		fd = open(port, O_RDWR);
 	}
-	pollfds[2].fd = fd;
-	pollfds[2].events = POLLIN | POLLPRI;
-	pollfds[2].revents = 0;
+	pollfds[POLL_ARCH].fd = fd;
+	pollfds[POLL_ARCH].events = POLLIN | POLLPRI;
+	pollfds[POLL_ARCH].revents = 0;
 	start = 0;
 	end_ = 0;
 	fcntl(fd, F_SETFL, O_NONBLOCK);
@@ -1406,11 +1632,11 @@ void AVRSerial::refill() { // {{{
 			debug("read returned error: %s", strerror(errno));
 		end_ = 0;
 	}
-	if (end_ == 0 && pollfds[2].revents) {
+	if (end_ == 0 && pollfds[POLL_ARCH].revents) {
 		debug("EOF detected on serial port; waiting for reconnect.");
 		disconnect(true);
 	}
-	pollfds[2].revents = 0;
+	pollfds[POLL_ARCH].revents = 0;
 } // }}}
 
 int AVRSerial::read() { // {{{
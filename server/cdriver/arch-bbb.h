@@ -50,14 +50,26 @@
 #define NUM_DIGITAL_PINS (NUM_GPIO_PINS + 16)
 #define NUM_PINS (NUM_DIGITAL_PINS + NUM_ANALOG_INPUTS)
 #define ADCBITS 12
-#define FRAGMENTS_PER_BUFFER 8
+#ifndef BBB_FRAGMENTS
+#define BBB_FRAGMENTS 128	// Fragments in the sample ring; must be a power of 2.  Fewer are used if the DDR pool is too small.
+#endif
+#define BBB_MIN_FRAGMENTS 8
+#define FRAGMENTS_PER_BUFFER bbb_fragments
 #define SAMPLES_PER_FRAGMENT 256
+#define BBB_STEP_PLANES 3	// Bits of the step count in a sample.
+#define BBB_MAX_STEPS ((1 << BBB_STEP_PLANES) - 1)
+#define ARCH_MAX_STEPS BBB_MAX_STEPS	// check_distance slows moves down to stay below this.
 #define BBB_PRU_FRAGMENT_MASK (FRAGMENTS_PER_BUFFER - 1)
+#define BBB_PWM_PERIOD 1000	// Pins with a duty below 1 are switched on for part of every period.  [ms]
+#define BBB_ADC_INTERVAL_NS 10000000	// Time between samples of the analog inputs.
+#define BBB_ADC_OVERSAMPLE 8	// Number of samples per reading; the lowest and highest are dropped, the rest is averaged.
+#define BBB_LIMIT_INTERVAL 10	// Time between checks of the limit switches while moving.  [ms]
+#define BBB_PRU_EVENT PRU0_ARM_INTERRUPT	// Must match PRU_ARM_INTERRUPT in bbb_pru.asm.
 
 #define ARCH_MOTOR int bbb_id;
 #define ARCH_SPACE int bbb_id, bbb_m0;
 
-#define DATA_CLEAR(s, m) do {} while (0)
+#define DATA_CLEAR(s, m) bbb_data_clear(s, m)
 #define ARCH_NEW_MOTOR(s, m, base) do {} while (0)
 #define DATA_DELETE(s, m) do {} while (0)
 // }}}
@@ -101,20 +113,31 @@ struct bbb_Gpio { // {{{
 
 struct bbb_Temp { // {{{
 	int id;
-	FILE *file;	// For reading the ADC.
+	int fd;		// For reading the ADC; kept open and read with pread.
 	bool active;
 	int power_pin, fan_pin;
 	bool power_inverted, fan_inverted;
 	int power_target, fan_target;
+	int sample[BBB_ADC_OVERSAMPLE];
+	int num_samples;
 }; // }}}
 
+// Control block in PRU data RAM.  The samples are in a ring in DDR memory, at buffer.
+// Every field is written by only one side, except state; they are aligned, so reads and writes are atomic.
 struct bbb_Pru { // {{{
-	volatile uint16_t base, dirs;
-	// These must be bytes, because read and write must be atomic.
-	volatile uint8_t current_sample, current_fragment, next_fragment, state;
-	volatile uint16_t buffer[FRAGMENTS_PER_BUFFER][SAMPLES_PER_FRAGMENT][2];
+	volatile uint16_t base, dirs;		// Written by cpu.
+	volatile uint16_t current_fragment;	// Written by pru.
+	volatile uint8_t current_sample;	// Written by pru.
+	volatile uint8_t state;
+	volatile uint16_t next_fragment;	// Written by cpu.
+	volatile uint16_t fragment_mask;	// Number of fragments - 1; set before the pru is started.
+	volatile uint32_t buffer;		// Physical address of the ring; set before the pru is started.
 } __attribute__ ((packed)); // }}}
 
+// A sample is a mask of dir pins which are toggled from base, followed by a mask for every bit of the step counts.
+// The pru spreads the steps over BBB_MAX_STEPS slots: bit 2 uses slots 0, 2, 4 and 6, bit 1 uses 1 and 5, bit 0 uses 3.
+typedef volatile uint16_t bbb_Fragment[SAMPLES_PER_FRAGMENT][1 + BBB_STEP_PLANES];
+
 // Function declarations. {{{
 void SET_OUTPUT(Pin_t _pin);
 void SET_INPUT(Pin_t _pin);
@@ -142,8 +165,12 @@ void arch_discard();
 void arch_send_spi(int bits, uint8_t *data);
 off_t arch_send_audio(uint8_t *data, off_t sample, off_t num_records, int motor);
 void DATA_SET(int s, int m, int value);
+void bbb_data_clear(int s, int m);
+static inline double arch_round_pos(int s, int m, double pos) { return round(pos); }
 // }}}
 
+EXTERN int bbb_fragments;
+
 #ifdef DEFINE_VARIABLES
 // Variables. {{{
 #if PRU == 0
@@ -158,15 +185,17 @@ static char const *bbb_apin_name[8] = {"P9_39", "P9_40", "P9_37", "P9_38", "P9_3
 static volatile bbb_Gpio *bbb_gpio[4];
 enum BBB_State { MUX_DISABLED, MUX_INPUT, MUX_OUTPUT, MUX_PRU };
 static int bbb_devmem;
-static int bbb_active_temp;
 static bbb_Temp bbb_temp[NUM_ANALOG_INPUTS];
 static bbb_Pru *bbb_pru;
+static bbb_Fragment *bbb_buffer;
 #define USABLE(x) (x)
 #define HDMI(x) (x)
 #define FLASH(x) ""
 #define INTERNAL ""
 #define UNUSABLE ""
 static int bbb_gpio_state[NUM_GPIO_PINS];
+static double bbb_duty[NUM_GPIO_PINS];
+static bool bbb_pin_on[NUM_GPIO_PINS], bbb_pin_inverted[NUM_GPIO_PINS];	// Requested state of outputs, for time-proportional switching.
 static std::string bbb_muxpath[NUM_GPIO_PINS];
 static char const *bbb_muxname[NUM_GPIO_PINS] = {
 	UNUSABLE, UNUSABLE, USABLE("P9_22"), USABLE("P9_21"), USABLE("P9_18"), USABLE("P9_17"), INTERNAL, USABLE("P9_42"),
@@ -243,6 +272,8 @@ void SET_INPUT_NOPULLUP(Pin_t _pin) {
 void SET(Pin_t _pin) {
 	SET_OUTPUT(_pin);
 	if (_pin.valid() && _pin.pin < NUM_GPIO_PINS) {
+		bbb_pin_on[_pin.pin] = true;
+		bbb_pin_inverted[_pin.pin] = _pin.inverted();
 		if (_pin.inverted())
 			RAWRESET(_pin.pin);
 		else
@@ -253,6 +284,7 @@ void SET(Pin_t _pin) {
 void RESET(Pin_t _pin) {
 	SET_OUTPUT(_pin);
 	if (_pin.valid() && _pin.pin < NUM_GPIO_PINS) {
+		bbb_pin_on[_pin.pin] = false;
 		if (_pin.inverted())
 			RAWSET(_pin.pin);
 		else
@@ -309,17 +341,32 @@ void arch_setup_start(char const *port) {
 		char num[2] = "0";
 		num[0] += i;
 		name = base + "/AIN" + num;
-		bbb_temp[i].file = fopen(name.c_str(), "r");
-		if (!bbb_temp[i].file)
+		bbb_temp[i].fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+		if (bbb_temp[i].fd < 0)
 			fprintf(stderr, "unable to open analog input %d: %s", i, strerror(errno));
 		bbb_temp[i].active = false;
+		bbb_temp[i].num_samples = 0;
 	}
+	// The inputs are sampled on their own timer, so reading them does not delay the fragment handling.
+	pollfds[POLL_ARCH].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	pollfds[POLL_ARCH].events = POLLIN | POLLPRI;
+	pollfds[POLL_ARCH].revents = 0;
+	struct itimerspec adc_timer;
+	adc_timer.it_interval.tv_sec = 0;
+	adc_timer.it_interval.tv_nsec = BBB_ADC_INTERVAL_NS;
+	adc_timer.it_value = adc_timer.it_interval;
+	timerfd_settime(pollfds[POLL_ARCH].fd, 0, &adc_timer, NULL);
 	base = find_base("/sys/devices", "ocp.");
 	for (int i = 0; i < NUM_GPIO_PINS; ++i) {
 		if (bbb_muxname[i][0] == '\0')
 			continue;
 		bbb_muxpath[i] = find_base(base, std::string(bbb_muxname[i]) + "_pinmux.") + "/state";
 	}
+	for (int i = 0; i < NUM_GPIO_PINS; ++i) {
+		bbb_duty[i] = 1;
+		bbb_pin_on[i] = false;
+		bbb_pin_inverted[i] = false;
+	}
 	bbb_devmem = open("/dev/mem", O_RDWR);
 	unsigned gpio_base[4] = { 0x44E07000, 0x4804C000, 0x481AC000, 0x481AE000 };
 	unsigned pad_control_base = 0x44e10000;
@@ -344,7 +391,6 @@ void arch_setup_start(char const *port) {
 	for (int i = 0; i < 32 * 4; ++i)
 		bbb_gpio_pad[i] = pad_offset[i] >= 0 ? &bbb_padmap[(0x800 + pad_offset[i]) / 4] : NULL;
 	*/
-	bbb_active_temp = -1;
 	tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
 	debug("pru init %d", prussdrv_init());
 	int ret = prussdrv_open(PRU_EVTOUT_0);
@@ -353,12 +399,35 @@ void arch_setup_start(char const *port) {
 		abort();
 	}
 	debug("init intc %d", prussdrv_pruintc_init(&pruss_intc_initdata));
+	// The PRU raises an event when it is done with a fragment or changes its state; arch_tick handles it.
+	pollfds[POLL_ARCH + 1].fd = prussdrv_pru_event_fd(PRU_EVTOUT_0);
+	pollfds[POLL_ARCH + 1].events = POLLIN | POLLPRI;
+	pollfds[POLL_ARCH + 1].revents = 0;
 	debug("pru mmap %d", prussdrv_map_prumem(PRU_DATARAM, (void **)&bbb_pru));
+	// The samples are in DDR memory, so the ring can hold several seconds of motion.
+	void *ring;
+	if (prussdrv_map_extmem(&ring) < 0 || !ring) {
+		debug("unable to map pru ddr memory");
+		abort();
+	}
+	bbb_fragments = BBB_FRAGMENTS;
+	while (bbb_fragments > BBB_MIN_FRAGMENTS && bbb_fragments * sizeof(bbb_Fragment) > prussdrv_extmem_size())
+		bbb_fragments /= 2;
+	if (bbb_fragments * sizeof(bbb_Fragment) > prussdrv_extmem_size()) {
+		debug("pru ddr memory is too small: %d bytes", prussdrv_extmem_size());
+		abort();
+	}
+	if (bbb_fragments != BBB_FRAGMENTS)
+		debug("pru ddr memory is too small for %d fragments; using %d", BBB_FRAGMENTS, bbb_fragments);
+	bbb_buffer = reinterpret_cast <bbb_Fragment *>(ring);
+	memset(ring, 0, bbb_fragments * sizeof(bbb_Fragment));
 	bbb_pru->base = 0;
 	bbb_pru->dirs = 0;
 	bbb_pru->current_fragment = 0;
 	bbb_pru->current_sample = 0;
 	bbb_pru->next_fragment = 0;
+	bbb_pru->fragment_mask = BBB_PRU_FRAGMENT_MASK;
+	bbb_pru->buffer = prussdrv_get_phys_addr(ring);
 	bbb_pru->state = 1;
 	debug("pru exec %d", prussdrv_exec_program(PRU, "/usr/lib/franklin/bbb_pru.bin"));
 }
@@ -371,15 +440,71 @@ void arch_setup_end(char const *run_id) {
 	setup_end();
 }
 
-static void bbb_next_adc() {
-	for (int i = 0; i < NUM_ANALOG_INPUTS; ++i) {
-		int n = (bbb_active_temp + 1 + i) % NUM_ANALOG_INPUTS;
-		if (bbb_temp[n].active) {
-			bbb_active_temp = n;
-			return;
+static void bbb_pwm() {
+	// Switch outputs with a duty below 1 which are on; heaters are switched with their adc reading instead.
+	int phase = millis() % BBB_PWM_PERIOD;
+	for (int pin = 0; pin < NUM_GPIO_PINS; ++pin) {
+		if (bbb_duty[pin] >= 1 || !bbb_pin_on[pin])
+			continue;
+		bool heater = false;
+		for (int a = 0; a < NUM_ANALOG_INPUTS; ++a) {
+			if (bbb_temp[a].active && bbb_temp[a].power_pin == pin)
+				heater = true;
 		}
+		if (heater)
+			continue;
+		if ((phase < bbb_duty[pin] * BBB_PWM_PERIOD) ^ bbb_pin_inverted[pin])
+			RAWSET(pin);
+		else
+			RAWRESET(pin);
 	}
-	bbb_active_temp = -1;
+}
+
+static void bbb_read_adc() {
+	uint64_t expirations;
+	if (read(pollfds[POLL_ARCH].fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	for (int a = 0; a < NUM_ANALOG_INPUTS; ++a) {
+		bbb_Temp &tp = bbb_temp[a];
+		if (!tp.active || tp.fd < 0)
+			continue;
+		char data[6];	// 12 bit adc: maximum 4 digits, plus newline and NUL.
+		int num = pread(tp.fd, data, sizeof(data) - 1, 0);
+		if (num <= 0) {
+			if (num < 0 && errno == EAGAIN)
+				continue;
+			debug("Error reading from adc %d: %s.", a, strerror(errno));
+			num = 1;
+			data[0] = '0';
+		}
+		data[num] = '\0';
+		tp.sample[tp.num_samples++] = atoi(data);
+		if (tp.num_samples < BBB_ADC_OVERSAMPLE)
+			continue;
+		tp.num_samples = 0;
+		int sum = 0, low = tp.sample[0], high = tp.sample[0];
+		for (int i = 0; i < BBB_ADC_OVERSAMPLE; ++i) {
+			sum += tp.sample[i];
+			low = min(low, tp.sample[i]);
+			high = max(high, tp.sample[i]);
+		}
+		int t = (sum - low - high + (BBB_ADC_OVERSAMPLE - 2) / 2) / (BBB_ADC_OVERSAMPLE - 2);
+		if (tp.power_pin >= 0) {
+			bool on = tp.power_target < t && (tp.power_pin >= NUM_GPIO_PINS || millis() % BBB_PWM_PERIOD < bbb_duty[tp.power_pin] * BBB_PWM_PERIOD);
+			if (on ^ tp.power_inverted)
+				RAWSET(tp.power_pin);
+			else
+				RAWRESET(tp.power_pin);
+		}
+		if (tp.fan_pin >= 0) {
+			if ((tp.fan_target < t) ^ tp.fan_inverted)
+				RAWSET(tp.fan_pin);
+			else
+				RAWRESET(tp.fan_pin);
+		}
+		handle_temp(tp.id, t);
+	}
+	bbb_pwm();
 }
 
 void arch_request_temp(int which) {
@@ -404,8 +529,7 @@ void arch_setup_temp(int id, int thermistor_pin, bool active, int heater_pin = ~
 	bbb_temp[thermistor_pin].fan_pin = fan_pin;
 	bbb_temp[thermistor_pin].fan_inverted = fan_inverted;
 	bbb_temp[thermistor_pin].fan_target = fan_target;
-	if (bbb_active_temp < 0)
-		bbb_next_adc();
+	bbb_temp[thermistor_pin].num_samples = 0;
 	// TODO: use hold_time.
 }
 
@@ -449,18 +573,34 @@ void arch_send_pin_name(int pin) {
 // state: 2: Doing single step; pru can set to 0; cpu can set to 4 (and expect pru to set it to 0 or 1).
 // state: 3: Free running; cpu can set to 4.
 // state: 4: cpu requested stop; pru must set to 1.
+static int bbb_pru_pin(Pin_t &pin) {
+	// Bit of a pin in the pru output, or -1 if it is not a pru pin.
+	return pin.valid() && pin.pin >= NUM_GPIO_PINS ? pin.pin - NUM_GPIO_PINS : -1;
+}
+
+static bool bbb_update_running(int cf) {
+	// Move running_fragment to the fragment that the PRU is working on.
+	if (cf == running_fragment)
+		return false;
+	int cbs = 0;
+	while (cf != running_fragment) {
+		cbs += history[running_fragment].cbs;
+		history[running_fragment].cbs = 0;
+		running_fragment = (running_fragment + 1) & BBB_PRU_FRAGMENT_MASK;
+	}
+	if (cbs)
+		send_host(CMD_MOVECB, cbs);
+	return true;
+}
+
 int arch_tick() {
-	debug("running fragment %d", running_fragment);
+	if (pollfds[POLL_ARCH + 1].revents) {
+		// Acknowledge the event before reading the state, so no change is missed.
+		prussdrv_pru_wait_event(PRU_EVTOUT_0);
+		prussdrv_pru_clear_event(PRU_EVTOUT_0, BBB_PRU_EVENT);
+	}
 	int cf = bbb_pru->current_fragment;
-	if (cf != running_fragment) {
-		int cbs = 0;
-		while (cf != running_fragment) {
-			cbs += history[running_fragment].cbs;
-			history[running_fragment].cbs = 0;
-			running_fragment = (running_fragment + 1) % FRAGMENTS_PER_BUFFER;
-		}
-		if (cbs)
-			send_host(CMD_MOVECB, cbs);
+	if (bbb_update_running(cf)) {
 		buffer_refill();
 		run_file_fill_queue();
 		if (!computing_move && run_file_finishing) {
@@ -468,43 +608,9 @@ int arch_tick() {
 			abort_run_file();
 		}
 	}
-	// Handle temps and check limit switches.
-	if (bbb_active_temp >= 0) {
-		// New temperature ready to read.
-		int a = bbb_active_temp;
-		bbb_next_adc();
-		char data[6];	// 12 bit adc: maximum 4 digits, plus newline and NUL.
-		fseek(bbb_temp[a].file, SEEK_SET, 0);
-		int num = fread(data, 1, sizeof(data), bbb_temp[a].file);
-		if (num <= 0) {
-			if (errno == EAGAIN)
-				a = -1;
-			else {
-				debug("Error reading from adc %d: %s.", a, strerror(errno));
-				data[0] = '0';
-				data[1] = '\0';
-			}
-		}
-		if (a >= 0 && bbb_temp[a].active) {
-			int t = atoi(data);
-			if (bbb_temp[a].power_pin >= 0) {
-				if ((bbb_temp[a].power_target < t) ^ bbb_temp[a].power_inverted)
-					RAWSET(bbb_temp[a].power_pin);
-				else
-					RAWRESET(bbb_temp[a].power_pin);
-			}
-			if (bbb_temp[a].fan_pin >= 0) {
-				if ((bbb_temp[a].fan_target < t) ^ bbb_temp[a].fan_inverted)
-					RAWSET(bbb_temp[a].fan_pin);
-				else
-					RAWRESET(bbb_temp[a].fan_pin);
-			}
-			handle_temp(bbb_temp[a].id, t);
-		}
-	}
-	else
-		bbb_next_adc();
-	// TODO: Pwm.
+	// Handle temps and pwm, and check limit switches.
+	if (pollfds[POLL_ARCH].revents)
+		bbb_read_adc();
 	int state = bbb_pru->state;
 	//debug("pru state: %d %d %d", state, bbb_pru->current_fragment, bbb_pru->current_sample);
 	if (state != 2 && state != 1) {
@@ -531,20 +637,40 @@ int arch_tick() {
 		}
 		for (int s = 0; s < NUM_SPACES; ++s) {
 			for (int m = 0; m < spaces[s].num_motors; ++m) {
-				if (!spaces[s].motor[m]->active || !spaces[s].motor[m]->step_pin.valid() || spaces[s].motor[m]->step_pin.pin < NUM_GPIO_PINS)
+				int step = bbb_pru_pin(spaces[s].motor[m]->step_pin);
+				if (!spaces[s].motor[m]->active || step < 0)
 					continue;
-				int pin = spaces[s].motor[m]->step_pin.pin - NUM_GPIO_PINS;
-				bool negative = bool(bbb_pru->buffer[cf][cs][0] & (1 << pin)) ^ spaces[s].motor[m]->dir_pin.inverted();
-				Pin_t *p = negative ? &spaces[s].motor[m]->limit_max_pin : &spaces[s].motor[m]->limit_min_pin;
-				if (!p->valid())
-					continue;
-				if (RAWGET(p->pin) ^ p->inverted()) {
-					// Limit hit.
-					sending_fragment = 0;
-					stopping = 2;
-					send_host(CMD_LIMIT, s, m, spaces[s].motor[m]->settings.current_pos / spaces[s].motor[m]->steps_per_unit);
-					//debug("cbs after current cleared %d after sending limit", cbs_after_current_move);
-					cbs_after_current_move = 0;
+				int dir = bbb_pru_pin(spaces[s].motor[m]->dir_pin);
+				volatile uint16_t *sample = bbb_buffer[cf][cs];
+				Pin_t *check[2] = {&spaces[s].motor[m]->limit_min_pin, &spaces[s].motor[m]->limit_max_pin};
+				if (dir >= 0) {
+					// Only check the switch in the direction of motion.
+					bool negative = !(sample[0] & (1 << dir));
+					check[negative ? 0 : 1] = NULL;
+				}
+				else {
+					// The direction is unknown; check both switches while the motor is stepping.
+					bool stepping = false;
+					for (int b = 0; b < BBB_STEP_PLANES; ++b) {
+						if (sample[1 + b] & (1 << step))
+							stepping = true;
+					}
+					if (!stepping)
+						continue;
+				}
+				for (int i = 0; i < 2; ++i) {
+					Pin_t *p = check[i];
+					if (!p || !p->valid())
+						continue;
+					if (RAWGET(p->pin) ^ p->inverted()) {
+						// Limit hit.
+						sending_fragment = 0;
+						stopping = 2;
+						send_host(CMD_LIMIT, s, m, spaces[s].motor[m]->settings.current_pos / spaces[s].motor[m]->steps_per_unit);
+						//debug("cbs after current cleared %d after sending limit", cbs_after_current_move);
+						cbs_after_current_move = 0;
+						break;
+					}
 				}
 			}
 			m0 += spaces[s].num_motors;
@@ -558,7 +684,8 @@ int arch_tick() {
 		// TODO: LED.
 		// TODO: Timeout.
 	}
-	return state == 3 ? 100 : state == 2 ? 10 : 200;
+	// Fragments are handled when the PRU reports them; only the switches need to be polled.
+	return state == 1 ? -1 : BBB_LIMIT_INTERVAL;
 }
 
 void arch_motors_change() {
@@ -609,6 +736,8 @@ void arch_stop(bool fake) {
 		break;
 	}
 	bbb_pru->state = 1;
+	// The pru has stopped, so its position can be read without a race.
+	bbb_update_running(bbb_pru->current_fragment);
 	// Update current_pos.
 	abort_move(bbb_pru->current_sample);
 	current_fragment_pos = 0;
@@ -641,22 +770,32 @@ bool arch_send_fragment() {
 }
 
 int arch_fds() {
-	return 0;
+	return 2;
 }
 
-double arch_get_duty(Pin_t _pin) { // TODO
+double arch_get_duty(Pin_t _pin) {
 	if (_pin.pin < 0 || _pin.pin >= NUM_DIGITAL_PINS) {
 		debug("invalid pin for arch_get_duty: %d (max %d)", _pin.pin, NUM_DIGITAL_PINS);
 		return 1;
 	}
-	return 1;
+	return _pin.pin < NUM_GPIO_PINS ? bbb_duty[_pin.pin] : 1;
 }
 
-void arch_set_duty(Pin_t _pin, double duty) { // TODO
+void arch_set_duty(Pin_t _pin, double duty) {
+	// Gpio pins are switched on for part of every BBB_PWM_PERIOD by bbb_pwm, or with the adc reading for heaters.
 	if (_pin.pin < 0 || _pin.pin >= NUM_DIGITAL_PINS) {
 		debug("invalid pin for arch_set_duty: %d (max %d)", _pin.pin, NUM_DIGITAL_PINS);
 		return;
 	}
+	if (_pin.pin >= NUM_GPIO_PINS) {
+		if (duty < 1)
+			debug("pru pin %d does not support a duty cycle; ignoring duty %f", _pin.pin, duty);
+		return;
+	}
+	bbb_duty[_pin.pin] = duty < 0 ? 0 : duty > 1 ? 1 : duty;
+	// Without a duty cycle, bbb_pwm no longer switches the pin; restore its requested state.
+	if (bbb_duty[_pin.pin] >= 1 && bbb_pin_on[_pin.pin])
+		SET(_pin);
 }
 
 void arch_discard() {
@@ -676,25 +815,36 @@ off_t arch_send_audio(uint8_t *data, off_t sample, off_t num_records, int motor)
 	// TODO.
 }
 
-static void bbb_set_pru(int which, int s, int m) {
-	int pin = spaces[s].motor[m]->step_pin.pin - NUM_GPIO_PINS;
-	if (spaces[s].motor[m]->step_pin.valid() && pin >= 0) {
-		bbb_pru->buffer[current_fragment][current_fragment_pos][which] |= 1 << pin;
+void bbb_data_clear(int s, int m) {
+	// Remove old steps of this motor from the current fragment; the ring is reused.
+	int step = bbb_pru_pin(spaces[s].motor[m]->step_pin);
+	int dir = bbb_pru_pin(spaces[s].motor[m]->dir_pin);
+	uint16_t mask = ~((step >= 0 ? 1 << step : 0) | (dir >= 0 ? 1 << dir : 0));
+	for (int i = 0; i < SAMPLES_PER_FRAGMENT; ++i) {
+		for (int w = 0; w < 1 + BBB_STEP_PLANES; ++w)
+			bbb_buffer[current_fragment][i][w] &= mask;
 	}
 }
 
 void DATA_SET(int s, int m, int value) {
-	int id = spaces[s].motor[m]->bbb_id;
-	if (value) {
-		if (value < -1 || value > 1) {
-			debug("invalid sample %d for %d %d", value, s, m);
-			abort();
-		}
-		// The invert flag of the dir pin is used even if the pin is invalid (which it should never be).
-		if ((value < 0) ^ spaces[s].motor[m]->dir_pin.inverted())
-			bbb_set_pru(0, s, m);
-		else
-			bbb_set_pru(1, s, m);
+	if (!value)
+		return;
+	if (value < -BBB_MAX_STEPS || value > BBB_MAX_STEPS) {
+		debug("invalid sample %d for %d %d", value, s, m);
+		abort();
+	}
+	int step = bbb_pru_pin(spaces[s].motor[m]->step_pin);
+	if (step < 0)
+		return;
+	volatile uint16_t *sample = bbb_buffer[current_fragment][current_fragment_pos];
+	// Base holds the inverted flag of the dir pin, so toggling it makes the pin active, which means positive.
+	int dir = bbb_pru_pin(spaces[s].motor[m]->dir_pin);
+	if (dir >= 0 && value > 0)
+		sample[0] |= 1 << dir;
+	int num = value < 0 ? -value : value;
+	for (int b = 0; b < BBB_STEP_PLANES; ++b) {
+		if (num & (1 << b))
+			sample[1 + b] |= 1 << step;
 	}
 }
 // }}}
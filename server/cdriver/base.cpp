@@ -28,8 +28,8 @@ void disconnect(bool notify) { // {{{
 	if (notify)
 		send_host(CMD_DISCONNECT);
 	while (arch_fds() == 0) {
-		poll(&pollfds[1], 1, -1);
-		if (pollfds[1].revents & (POLLHUP | POLLERR)) {
+		poll(&pollfds[POLL_HOST], 1, -1);
+		if (pollfds[POLL_HOST].revents & (POLLHUP | POLLERR)) {
 			debug("Hang up (or error) on command input");
 			exit(0);
 		}
@@ -77,18 +77,31 @@ int main(int argc, char **argv) { // {{{
 	int delay = 0;
 	while (true) {
 		int arch = arch_fds();
-		for (int i = 0; i < 2 + arch; ++i)
+		for (int i = 0; i < POLL_ARCH + arch; ++i)
 			pollfds[i].revents = 0;
-		poll(host_block ? &pollfds[2] : pollfds, arch + (host_block ? 0 : 2), delay);
-		if (pollfds[0].revents) {
-			timerfd_settime(pollfds[0].fd, 0, &zero, NULL);
+		// While the host is blocked, only the hardware, finished system commands and the heater control are handled.
+		int first = host_block ? POLL_SIGNAL : POLL_RUN_TIMER;
+		poll(&pollfds[first], POLL_ARCH + arch - first, delay);
+		if (pollfds[POLL_RUN_TIMER].revents) {
+			timerfd_settime(pollfds[POLL_RUN_TIMER].fd, 0, &zero, NULL);
 			//debug("gcode wait done; stop waiting (was %d)", run_file_wait);
-			if (run_file_wait)
+			if (run_file_follow)
+				run_file_follow = false;
+			else if (run_file_wait)
 				run_file_wait -= 1;
 			run_file_fill_queue();
 		}
-		if (pollfds[1].revents)
+		if (pollfds[POLL_HOST].revents)
 			serial(0);
+		if (pollfds[POLL_DOORBELL].revents)
+			ring_doorbell();
+		if (pollfds[POLL_SIGNAL].revents)
+			run_file_reap();
+		if (pollfds[POLL_PID].revents)
+			temp_control();
 		delay = arch_tick();
+		ring_drain();
+		probe_grid_tick();
+		status_update();
 	}
 } // }}}
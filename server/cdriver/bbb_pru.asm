@@ -16,9 +16,17 @@
 ; along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define TICK_US 40
+#define SAMPLE_TICKS 36	; 1 for the dir pins, 5 for every step slot.
+#define IDLE_LOOPS ((TICK_US - SAMPLE_TICKS) / 2)	; Every idle loop takes two ticks, so a sample takes TICK_US ticks.
+#define PRU_ARM_INTERRUPT 19	; PRU0_ARM_INTERRUPT from pruss_intc_mapping.h; the host waits for it on PRU_EVTOUT_0.
 	.origin 0
 	.entrypoint start
 start:
+	; Enable the OCP master port, for access to the sample ring in ddr.
+	lbco r0, c4, 4, 4
+	clr r0, r0, 4
+	sbco r0, c4, 4, 4
+
 	; Set up IEP (counter).
 	; Set increments.
 	ldi r0, 0x0111
@@ -60,7 +68,11 @@ start:
 	mov r0, 0
 	mov r1, 1
 	mov r2, 7
-	mov r5, TICK_US - 5
+	mov r5, IDLE_LOOPS
+
+	.macro notify_host
+	mov r31.b0, PRU_ARM_INTERRUPT + 16
+	.endm
 
 	.macro wait_for_tick
 	wbs r31, 30		; wait
@@ -68,24 +80,39 @@ start:
 	sbco r0, c0, 0x24, 4	; clear interrupt flag
 	.endm
 
+	; One step slot: pulse the step pins in mask, then wait for the next slot.  r9.w0 holds the dir pins.
+	.macro step_slot
+	.mparam mask
+	wait_for_tick
+	xor r30.w0, r9.w0, mask
+	wait_for_tick
+	mov r30.w0, r9.w0
+	wait_for_tick
+	wait_for_tick
+	wait_for_tick
+	.endm
+
 mainloop:
-	lbco r3, c24, 0, 8	; load current settings
+	lbco r10, c24, 0, 16	; load current settings
 
-	; r3.w0 = base
-	; r3.w1 = dirs
-	; r4.b0 = current_sample
-	; r4.b1 = current_fragment
-	; r4.b2 = next_fragment
-	; r4.b3 = state
+	; r10.w0 = base
+	; r10.w2 = dirs
+	; r11.w0 = current_fragment
+	; r11.b2 = current_sample
+	; r11.b3 = state
+	; r12.w0 = next_fragment
+	; r12.w2 = fragment_mask
+	; r13 = buffer (physical address of the sample ring in ddr)
 
 	; output base
 	wait_for_tick
-	mov r30.w0, r3.w0
+	mov r30.w0, r10.w0
 	; if 2 > state: continue
-	qbgt mainloop, r4.b3, 2
+	qbgt mainloop, r11.b3, 2
 	; if state == 4: state = 1; continue
-	qbne skip1, r4.b3, 4
+	qbne skip1, r11.b3, 4
 	sbco r1.b0, c24, 7, 1
+	notify_host
 	qba mainloop
 skip1:
 
@@ -93,44 +120,52 @@ skip1:
 	; wait for enough time to allow next tick.
 	wait_for_tick
 	qbne mainloop, r5, 0
-	mov r5, TICK_US - 5
+	mov r5, IDLE_LOOPS
 
-	; data is at buffer[fragment][sample][which] with sample array 256 elements, which array 2 elements and 2 bytes per element.
-	; So that's buffer_start + fragment * 256 * 2 * 2 + sample * 2 * 2 + which * 2; I want both which values.
-	lsl r6, r4.b1, 10
-	lsl r7, r4.b0, 2
+	; data is at buffer[fragment][sample][word] with sample array 256 elements, word array 4 elements and 2 bytes per element.
+	; So that's buffer + fragment * 256 * 4 * 2 + sample * 4 * 2; I want all words.
+	; r7.w0 = dir pins to toggle; r7.w2, r8.w0, r8.w2 = bits 0, 1 and 2 of the step count.
+	lsl r6, r11.w0, 11
+	lsl r7, r11.b2, 3
 	add r6, r6, r7
-	add r6, r6, 8	; buffer start.
-	lbco r7, c24, r6, 4
-	xor r3.w1, r3.w1, r3.w0	; Apply base to dirs
-	xor r7.w0, r7.w0, r3.w0	; Apply base to neg
-	xor r7.w1, r7.w1, r3.w1	; Apply base+dirs to pos
+	lbbo r7, r13, r6, 8
+	and r9.w0, r7.w0, r10.w2	; Only use dir pins
+	xor r9.w0, r9.w0, r10.w0	; Apply base to dirs
 
-	; do step
-	wait_for_tick
-	mov r30.w0, r7.w0
-	wait_for_tick
-	mov r30.w0, r3.w0
-	wait_for_tick
-	mov r30.w0, r3.w1
-	wait_for_tick
-	mov r30.w0, r7.w1
+	; set dir pins
 	wait_for_tick
-	mov r30.w0, r3.w1
-	; r3.w0 is sent in the next loop iteration.
+	mov r30.w0, r9.w0
+	; do steps; bit 2 uses slots 0, 2, 4 and 6, bit 1 uses 1 and 5, bit 0 uses 3, so they are evenly spaced.
+	step_slot r8.w2
+	step_slot r8.w0
+	step_slot r8.w2
+	step_slot r7.w2
+	step_slot r8.w2
+	step_slot r8.w0
+	step_slot r8.w2
+	; r10.w0 is sent in the next loop iteration.
 
 	; next sample
-	add r4.w0, r4.w0, 1
-	qbne skip2, r4.b0, 0
+	add r11.b2, r11.b2, 1
+	qbne skip2, r11.b2, 0
 	; next fragment
-	and r4.b1, r4.b1, 0x7
+	add r11.w0, r11.w0, 1
+	and r11.w0, r11.w0, r12.w2
+	sbco r11, c24, 4, 3	; store position; state is written separately.
 	; underrun
-	qbne skip2, r4.b1, r4.b2
-	mov r4.b3, 1
+	qbne skip3, r11.w0, r12.w0
+	mov r11.b3, 1
+	sbco r11.b3, c24, 7, 1
+skip3:
+	; tell the host that a fragment is done.
+	notify_host
+	qba skip4
 skip2:
-	sbco r4, c24, 4, 4
+	sbco r11, c24, 4, 3
+skip4:
 	; if state == 2: state = 0
-	qbne mainloop, r4.b3, 2
+	qbne mainloop, r11.b3, 2
 	sbco r0.b0, c24, 7, 1
+	notify_host
 	; continue
 	qba mainloop
@@ -20,6 +20,7 @@
 #define _CDRIVER_H
 
 #include "configuration.h"
+#include "runfile.h"
 #include <stdio.h>
 #include <math.h>
 #include <stdarg.h>
@@ -28,7 +29,7 @@
 #include <sys/types.h>
 #include <sys/timerfd.h>
 
-#define PROTOCOL_VERSION ((uint32_t)2)	// Required version response in BEGIN.
+#define PROTOCOL_VERSION ((uint32_t)3)	// Required version response in BEGIN.
 #define ID_SIZE 8
 #define UUID_SIZE 16
 
@@ -137,6 +138,8 @@ enum Command {
 	CMD_GETTIME,
 	CMD_SPI,
 	CMD_ADJUSTPROBE,	// 3 doubles: probe position.
+	CMD_LINES,	// n times: 1 byte: CMD_LINE, CMD_SINGLE or CMD_PROBE; followed by its data.  Reply: ACCEPTED.
+	CMD_PROBE_GRID,	// 9 doubles: x, y, w, h, sina, cosa, speed, safe_dist, z_low; 3 * 4 bytes: nx, ny, num_probes; n bytes: filename.  Reply (later): PROBE_DONE.
 	// to host
 		// responses to host requests; only one active at a time.
 	CMD_UUID = 0x40,	// 16 byte uuid.
@@ -160,10 +163,14 @@ enum Command {
 	CMD_UPDATE_TEMP,
 	CMD_UPDATE_PIN,
 	CMD_CONFIRM,
-	CMD_FILE_DONE,
+	CMD_FILE_DONE,	// 1 byte: 0 if the file is done, 1 if it was aborted because it is damaged.
 	CMD_PARKWAIT,
 		// Pin names; broadcast during setup.
 	CMD_PINNAME,
+		// Response to CMD_LINES.
+	CMD_ACCEPTED,	// 1 byte: number of accepted lines; 1 byte: queue is full.
+		// Response to CMD_PROBE_GRID.
+	CMD_PROBE_DONE,	// 1 byte: 1 if the probe file was written, 0 if probing failed, 2 if the probe did not hit anything.
 };
 
 // All temperatures are stored in Kelvin, but communicated in °C.
@@ -201,8 +208,14 @@ struct Temp {
 	double hold_time;		// Minimum time to hold value after change.
 	unsigned long last_change_time;	// millis() when value was last changed.
 	double K;			// Thermistor constant; kept in memory for performance.
+	double *adc_table;		// Temperature for every ADC value, or NULL if it must be computed.  [K]
+	double pid[3];			// Gains for heater control; bang-bang control is used if pid[0] is not positive.  [1/K, 1/(K s), s/K]
+	double pid_integral;		// Integral term of the heater duty.
+	double pid_last;		// Temperature at the previous control step, or NAN.  [K]
 	// Functions.
 	int32_t get_value();		// Get thermistor reading, or -1 if it isn't available yet.
+	double compute(int32_t adc);	// convert ADC to K without using adc_table.
+	void build_table();
 	double fromadc(int32_t adc);	// convert ADC to K.
 	int32_t toadc(double T, int32_t default_);	// convert K to ADC.
 	void load(int32_t &addr, int id);
@@ -385,6 +398,8 @@ EXTERN HostSerial host_serial;
 
 #define COMMAND_SIZE 256
 #define FULL_SERIAL_COMMAND_SIZE (COMMAND_SIZE + (COMMAND_SIZE + 2) / 3)
+#define MAX_PACKET_SIZE 0x400	// Packets to the firmware can be larger than COMMAND_SIZE if it supports it.
+#define FULL_MAX_PACKET_SIZE (MAX_PACKET_SIZE + (MAX_PACKET_SIZE + 2) / 3)
 #define HOST_COMMAND_SIZE 0x4000
 static int const FULL_COMMAND_SIZE[2] = {HOST_COMMAND_SIZE, FULL_SERIAL_COMMAND_SIZE};
 
@@ -421,7 +436,7 @@ EXTERN int cbs_after_current_move;
 EXTERN bool motors_busy;
 EXTERN int out_busy;
 EXTERN int32_t out_time;
-EXTERN char pending_packet[4][FULL_SERIAL_COMMAND_SIZE];
+EXTERN char pending_packet[4][FULL_MAX_PACKET_SIZE];
 EXTERN int pending_len[4];
 EXTERN void (*serial_cb[4])();
 EXTERN char datastore[HOST_COMMAND_SIZE];
@@ -445,7 +460,16 @@ EXTERN int current_fragment, running_fragment;
 EXTERN int current_fragment_pos;
 EXTERN int num_active_motors;
 EXTERN int hwtime_step, audio_hwtime_step;
-EXTERN struct pollfd pollfds[3];
+enum PollFd {	// Index of each file descriptor in pollfds.  The slots from POLL_SIGNAL on are also polled while host_block is set.
+	POLL_RUN_TIMER,	// Run file wait timer.
+	POLL_HOST,	// Commands from the host.
+	POLL_DOORBELL,	// Command ring doorbell.
+	POLL_SIGNAL,	// SIGCHLD from system commands in run files.
+	POLL_PID,	// Heater control timer.
+	POLL_ARCH,	// First of the fds that are returned by arch_fds().
+	POLL_NUM = POLL_ARCH + 2	// Arch uses up to 2.
+};
+EXTERN struct pollfd pollfds[POLL_NUM];
 EXTERN void (*wait_for_reply[4])();
 EXTERN int expected_replies;
 
@@ -471,6 +495,9 @@ void packet();	// A command packet has arrived; handle it.
 void settemp(int which, double target);
 void waittemp(int which, double mintemp, double maxtemp);
 void setpos(int which, int t, double f);
+int line_size(unsigned char const *data, int available);
+int queue_line(uint8_t cmd, unsigned char const *data);
+void queue_start_move();
 
 // serial.cpp
 void serial(uint8_t which);	// Handle commands from serial.
@@ -487,32 +514,22 @@ int next_move();
 void abort_move(int pos);
 
 // run.cpp
-struct Run_Record {
-	uint8_t type;
-	int32_t tool;
-	double X, Y, Z, E, f, F;
-	double time, dist;
-} __attribute__((__packed__));
-struct ProbeFile {
-	double x, y, w, h, sina, cosa;
-	unsigned long nx, ny;
-	double sample[0];
-} __attribute__((__packed__));
-void run_file(int name_len, char const *name, int probe_name_len, char const *probe_name, bool start, double sina, double cosa, int audio);
+void run_file(int name_len, char const *name, int probe_name_len, char const *probe_name, bool start, double sina, double cosa, int audio, int first_record);
 void abort_run_file();
 void run_file_fill_queue();
 void run_adjust_probe(double x, double y, double z);
+double run_file_margin();
+void run_file_reap();
 EXTERN char probe_file_name[256];
 EXTERN off_t probe_file_size;
 EXTERN ProbeFile *probe_file_map;
 EXTERN char run_file_name[256];
 EXTERN off_t run_file_size;
-EXTERN Run_Record *run_file_map;
-EXTERN int run_file_num_strings;
-EXTERN off_t run_file_first_string;
+EXTERN void *run_file_map;
 EXTERN int run_file_num_records;
 EXTERN int run_file_wait_temp;
 EXTERN int run_file_wait;
+EXTERN bool run_file_follow;	// The timer is used for checking whether the run file has grown.
 EXTERN struct itimerspec run_file_timer;
 EXTERN double run_file_refx;
 EXTERN double run_file_refy;
@@ -521,6 +538,15 @@ EXTERN double run_file_sina;
 EXTERN double run_file_cosa;
 EXTERN bool run_file_finishing;
 EXTERN int run_file_audio;
+EXTERN double run_file_horizon;	// Motion to keep in the queue while running a file [s].
+EXTERN bool probe_bicubic;	// Use bicubic instead of bilinear interpolation for probe maps.
+#define PROBE_MAX_SIZE 1000	// Maximum number of cells in each direction.
+
+// probe.cpp
+void probe_grid_start(int name_len, char const *name, double x, double y, double w, double h, double sina, double cosa, unsigned long nx, unsigned long ny, double speed, double safe_dist, double z_low, int num_probes);
+void probe_grid_tick();
+void probe_grid_limit(int s);
+void probe_grid_abort();
 
 // setup.cpp
 void setup(char const *port, char const *run_id);
@@ -537,7 +563,11 @@ double read_float(int32_t &address);
 void write_float(int32_t &address, double data);
 
 // temp.cpp
+#define TEMP_CONTROL_NS 250000000	// Interval for heater control.
+#define TEMP_PID_BAND 10		// In PID mode, the hardware switches the heater off this much above the target.  [K]
 void handle_temp(int id, int temp);
+void temp_control_update();
+void temp_control();
 
 // space.cpp
 void buffer_refill();
@@ -548,6 +578,82 @@ void send_fragment();
 void move_to_current();
 EXTERN int moving_to_current;
 
+// status.cpp
+#define STATUS_VERSION 2
+#define STATUS_MAX_AXES 8
+#define STATUS_MAX_TEMPS 8
+// Memory layout is shared with driver.py; keep it in sync when changing this.
+struct StatusPage {
+	uint32_t sequence;	// Odd while the page is being updated.
+	uint32_t version;
+	int32_t running_fragment, current_fragment;
+	int32_t queue_length;
+	int32_t num_temps;
+	double hwtime;		// [s]
+	double time;		// Estimated print time, as returned by CMD_GETTIME [s].
+	int32_t num_axes[NUM_SPACES];
+	int32_t num_motors[NUM_SPACES];
+	double axis[NUM_SPACES][STATUS_MAX_AXES];
+	double motor[NUM_SPACES][STATUS_MAX_AXES];
+	double temp[STATUS_MAX_TEMPS];
+	double run_margin;	// Queued motion of the run file, as returned by run_file_margin(); NaN if no file is running [s].
+};
+void status_setup();
+void status_update();
+void status_temp(int which, double value);
+EXTERN StatusPage *status_page;
+
+// ring.cpp
+#define RING_VERSION 1
+#define RING_SLOTS 64
+#define RING_SLOT_SIZE 512
+#define RING_WAITING (uint64_t(1) << 32)
+// Memory layout is shared with driver.py; keep it in sync when changing this.
+struct CommandRing {
+	uint32_t version;
+	uint32_t slots, slot_size;
+	uint32_t tail;		// Number of records that have been consumed; written by cdriver only.
+	// Each slot holds a CMD_LINE, CMD_SINGLE or CMD_PROBE packet without the length.
+	unsigned char slot[RING_SLOTS][RING_SLOT_SIZE];
+};
+void ring_setup();
+void ring_doorbell();
+void ring_drain();
+void ring_discard();
+int ring_pending();
+EXTERN CommandRing *command_ring;
+EXTERN uint32_t ring_head;	// Number of records announced through the doorbell.
+EXTERN bool ring_waiting;
+
+// telemetry.cpp
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_LENGTH 512	// Records per tier.
+#define TELEMETRY_TIERS 4	// Tier 0 holds every reading; every next tier combines TELEMETRY_FACTOR records of the previous one.
+#define TELEMETRY_FACTOR 10
+// Memory layout is shared with driver.py; keep it in sync when changing this.
+struct TelemetryRecord {
+	double time;		// Start of the interval, as returned by gettimeofday.  [s]
+	double adc;		// Mean reading.  [adccounts]
+	double min, max, mean;	// [K]
+	double duty;		// Mean heater duty; 0 while the heater is off.
+};
+struct TelemetryTemp {
+	uint32_t sequence;	// Odd while this sensor is being updated.
+	uint32_t reserved;
+	uint64_t count[TELEMETRY_TIERS];	// Records written to each tier; the newest is at (count - 1) % TELEMETRY_LENGTH.
+	TelemetryRecord record[TELEMETRY_TIERS][TELEMETRY_LENGTH];
+};
+struct TelemetryPage {
+	uint32_t version;
+	uint32_t num_temps;
+	uint32_t length, tiers, factor;
+	uint32_t reserved;
+	TelemetryTemp temp[STATUS_MAX_TEMPS];
+};
+void telemetry_setup();
+void telemetry_temp(int which, int32_t adc, double value, double duty);
+EXTERN TelemetryPage *telemetry_page;
+
 // globals.cpp
 bool globals_load(int32_t &address);
 void globals_save(int32_t &address);
@@ -0,0 +1,112 @@
+/* franklin-gcode.cpp - command line g-code compiler for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gcode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Usage: franklin-gcode [-c] [-j threads] [-d arc_tolerance] num_temps num_extruders park allow_system infile outfile
+// park is a string of 0 and 1, one for each axis of space 0.
+// With -c, the run file uses the compact encoding.
+// By default, one thread per core is used, and consecutive lines are replaced by an arc if it is within .1 of all points.
+// The result is written to standard output as JSON: {"errors": [...], "bbox": [...] or null}
+
+static void print_string(std::string const &s) {
+	putchar('"');
+	for (size_t i = 0; i < s.size(); ++i) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void print_double(double value) {
+	// Python's json module accepts these non-standard values.
+	if (isnan(value))
+		printf("NaN");
+	else if (isinf(value))
+		printf(value < 0 ? "-Infinity" : "Infinity");
+	else
+		printf("%.17g", value);
+}
+
+int main(int argc, char **argv) {
+	char const *program = argv[0];
+	GcodeSettings settings;
+	settings.threads = 0;
+	settings.arc_tolerance = .1;
+	settings.compact = false;
+	while (argc > 1 && argv[1][0] == '-') {
+		std::string option(argv[1]);
+		if (option == "-c") {
+			settings.compact = true;
+			argv += 1;
+			argc -= 1;
+			continue;
+		}
+		if (argc < 3)
+			break;
+		if (option == "-j")
+			settings.threads = atoi(argv[2]);
+		else if (option == "-d")
+			settings.arc_tolerance = strtod(argv[2], NULL);
+		else
+			break;
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 7) {
+		fprintf(stderr, "Usage: %s [-c] [-j threads] [-d arc_tolerance] num_temps num_extruders park allow_system infile outfile\n", program);
+		return 1;
+	}
+	settings.num_temps = atoi(argv[1]);
+	settings.num_extruders = atoi(argv[2]);
+	for (int a = 0; a < 6; ++a)
+		settings.park[a] = false;
+	for (int a = 0; a < 6 && argv[3][a] != '\0'; ++a)
+		settings.park[a] = argv[3][a] == '1';
+	settings.allow_system = argv[4];
+	GcodeResult result;
+	bool ok = gcode_compile(argv[5], argv[6], settings, result);
+	printf("{\"errors\": [");
+	for (size_t i = 0; i < result.errors.size(); ++i) {
+		if (i > 0)
+			printf(", ");
+		print_string(result.errors[i]);
+	}
+	printf("], \"bbox\": ");
+	if (ok && result.have_bbox) {
+		putchar('[');
+		for (int i = 0; i < 8; ++i) {
+			if (i > 0)
+				printf(", ");
+			print_double(result.bbox[i]);
+		}
+		putchar(']');
+	}
+	else
+		printf("null");
+	printf("}\n");
+	return ok ? 0 : 1;
+}
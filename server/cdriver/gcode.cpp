@@ -0,0 +1,1442 @@
+/* gcode.cpp - g-code to run file compiler for Franklin
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gcode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <map>
+#include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+// Parsing is done in two stages: tokenizing a line does not depend on anything before it, so it is done in parallel.
+// Applying the tokens does depend on the state (modes, position, pending arcs), so it must be done in order.
+// All arithmetic is written in the same order as in driver.py, and must be compiled without contraction, so the results are identical.
+
+#define C0 273.15	// Conversion between K and °C
+#define COMMIT_RECORDS 4096	// Number of records after which the header is updated.
+
+// Tokenizer. {{{
+struct GcodeWord {
+	uint32_t letter;	// First code point of the word.
+	bool is_short;		// There is nothing after the letter.
+	bool is_int;		// Python's int() accepts the rest of the word.
+	bool is_float;		// Python's float() accepts the rest of the word.
+	long long ival;
+	double fval;
+};
+
+struct GcodeLine {
+	enum { NORMAL, INVALID, UNTERMINATED, SYSTEM, SYSTEM_BACKGROUND } type;
+	bool numbered;		// Line started with an N word; lineno is set from it.
+	long index;		// Line index in the file, starting at 0; set when the line is applied.
+	long long lineno;	// Line number for messages.
+	char const *orig;	// Line for messages, without line ending.
+	size_t orig_len;
+	bool newline;		// Line was terminated by a line ending.
+	bool have_message;
+	std::string message;	// Message for MSG comments, command for SYSTEM comments.
+	std::vector <GcodeWord> words;
+};
+
+static bool is_space(unsigned char c) { // {{{
+	// What Python considers whitespace in the ASCII range.
+	return c == ' ' || (c >= '\t' && c <= '\r') || (c >= 0x1c && c <= 0x1f);
+} // }}}
+
+static void strip(char const *&b, char const *&e) { // {{{
+	while (b < e && is_space(*b))
+		++b;
+	while (e > b && is_space(e[-1]))
+		--e;
+} // }}}
+
+static std::string strip(std::string const &s) { // {{{
+	char const *b = s.data(), *e = b + s.size();
+	strip(b, e);
+	return std::string(b, e);
+} // }}}
+
+static uint32_t code_point(char const *&p, char const *e) { // {{{
+	unsigned char c = *p++;
+	int extra;
+	uint32_t ret;
+	if (c < 0xc0) {
+		return c;
+	}
+	else if (c < 0xe0) {
+		extra = 1;
+		ret = c & 0x1f;
+	}
+	else if (c < 0xf0) {
+		extra = 2;
+		ret = c & 0xf;
+	}
+	else {
+		extra = 3;
+		ret = c & 0x7;
+	}
+	for (int i = 0; i < extra && p < e && (*p & 0xc0) == 0x80; ++i)
+		ret = (ret << 6) | (*p++ & 0x3f);
+	return ret;
+} // }}}
+
+static std::string utf8(uint32_t c) { // {{{
+	std::string ret;
+	if (c < 0x80)
+		ret += char(c);
+	else if (c < 0x800) {
+		ret += char(0xc0 | (c >> 6));
+		ret += char(0x80 | (c & 0x3f));
+	}
+	else if (c < 0x10000) {
+		ret += char(0xe0 | (c >> 12));
+		ret += char(0x80 | ((c >> 6) & 0x3f));
+		ret += char(0x80 | (c & 0x3f));
+	}
+	else {
+		ret += char(0xf0 | (c >> 18));
+		ret += char(0x80 | ((c >> 12) & 0x3f));
+		ret += char(0x80 | ((c >> 6) & 0x3f));
+		ret += char(0x80 | (c & 0x3f));
+	}
+	return ret;
+} // }}}
+
+static char const *digits(char const *p, char const *e, std::string &clean) { // {{{
+	// Parse digits with single underscores between them, like Python does.  Returns NULL if there are no digits or an underscore is misplaced.
+	if (p >= e || *p < '0' || *p > '9')
+		return NULL;
+	while (true) {
+		clean += *p++;
+		if (p < e && *p == '_') {
+			++p;
+			if (p >= e || *p < '0' || *p > '9')
+				return NULL;
+			continue;
+		}
+		if (p >= e || *p < '0' || *p > '9')
+			return p;
+	}
+} // }}}
+
+static bool parse_int(char const *p, char const *e, long long &value) { // {{{
+	std::string clean;
+	if (p < e && (*p == '+' || *p == '-'))
+		clean += *p++;
+	if (digits(p, e, clean) != e)
+		return false;
+	errno = 0;
+	value = strtoll(clean.c_str(), NULL, 10);
+	// Python would accept larger numbers, but they aren't valid g-code anyway.
+	return errno == 0;
+} // }}}
+
+static bool parse_float(char const *p, char const *e, double &value) { // {{{
+	std::string clean;
+	if (p < e && (*p == '+' || *p == '-'))
+		clean += *p++;
+	size_t len = e - p;
+	if ((len == 3 && strncasecmp(p, "inf", 3) == 0) || (len == 8 && strncasecmp(p, "infinity", 8) == 0) || (len == 3 && strncasecmp(p, "nan", 3) == 0)) {
+		clean += std::string(p, e);
+		value = strtod(clean.c_str(), NULL);
+		return true;
+	}
+	char const *q = digits(p, e, clean);
+	if (q)
+		p = q;
+	if (p < e && *p == '.') {
+		clean += *p++;
+		char const *f = digits(p, e, clean);
+		if (f)
+			p = f;
+		else if (!q)
+			return false;
+	}
+	else if (!q)
+		return false;
+	if (p < e && (*p == 'e' || *p == 'E')) {
+		clean += *p++;
+		if (p < e && (*p == '+' || *p == '-'))
+			clean += *p++;
+		p = digits(p, e, clean);
+		if (!p)
+			return false;
+	}
+	if (p != e)
+		return false;
+	value = strtod(clean.c_str(), NULL);
+	return true;
+} // }}}
+
+static void split(char const *p, char const *e, std::vector <GcodeWord> &words) { // {{{
+	while (true) {
+		while (p < e && is_space(*p))
+			++p;
+		if (p >= e)
+			return;
+		char const *b = p;
+		while (p < e && !is_space(*p))
+			++p;
+		GcodeWord w;
+		w.letter = code_point(b, p);
+		w.is_short = b == p;
+		w.is_int = parse_int(b, p, w.ival);
+		w.is_float = parse_float(b, p, w.fval);
+		words.push_back(w);
+	}
+} // }}}
+
+static bool parse_lineno(char const *&p, char const *e, long long &lineno) { // {{{
+	// Match N(\d+)\s+; on success, p points to the first non-space after it.
+	char const *n = p + 1;
+	char const *d = n;
+	while (d < e && *d >= '0' && *d <= '9')
+		++d;
+	if (d == n || d >= e || !is_space(*d))
+		return false;
+	lineno = strtoll(n, NULL, 10);
+	while (d < e && is_space(*d))
+		++d;
+	p = d;
+	return true;
+} // }}}
+
+static void tokenize(char const *b, char const *e, GcodeLine &line) { // {{{
+	line.type = GcodeLine::NORMAL;
+	line.numbered = false;
+	line.have_message = false;
+	line.words.clear();
+	strip(b, e);
+	if (b < e && *b == 'N') {
+		if (!parse_lineno(b, e, line.lineno)) {
+			line.type = GcodeLine::INVALID;
+			return;
+		}
+		line.numbered = true;
+		// Remove a checksum if there is one: the first * which is followed by only digits.
+		for (char const *star = b; (star = static_cast <char const *>(memchr(star, '*', e - star))); ++star) {
+			char const *d = star + 1;
+			while (d < e && *d >= '0' && *d <= '9')
+				++d;
+			if (d > star + 1 && d == e) {
+				e = star;
+				break;
+			}
+		}
+	}
+	if (!memchr(b, '(', e - b) && !memchr(b, ';', e - b)) {
+		split(b, e, line.words);
+		return;
+	}
+	// Handle comments the way driver.py does; the last comment on the line is used.
+	std::string text(b, e);
+	std::string comment;
+	size_t pos;
+	while ((pos = text.find('(')) != std::string::npos) {
+		size_t end = text.find(')', pos);
+		if (end == std::string::npos) {
+			line.type = GcodeLine::UNTERMINATED;
+			return;
+		}
+		comment = strip(text.substr(pos + 1, end - pos - 1));
+		text = text.substr(0, pos) + " " + strip(text.substr(end + 1));
+	}
+	if ((pos = text.find(';')) != std::string::npos) {
+		comment = strip(text.substr(pos + 1));
+		text = strip(text.substr(0, pos));
+	}
+	if (comment.size() >= 4 && strncasecmp(comment.c_str(), "MSG,", 4) == 0) {
+		line.have_message = true;
+		line.message = strip(comment.substr(4));
+	}
+	else if (comment.compare(0, 7, "SYSTEM:") == 0) {
+		line.type = GcodeLine::SYSTEM;
+		line.message = comment.substr(7);
+		return;
+	}
+	else if (comment.compare(0, 8, "SYSTEM&:") == 0) {
+		line.type = GcodeLine::SYSTEM_BACKGROUND;
+		line.message = comment.substr(8);
+		return;
+	}
+	split(text.data(), text.data() + text.size(), line.words);
+} // }}}
+// }}}
+
+// Python style representation, for error messages. {{{
+static std::string orig(GcodeLine const &line) { // {{{
+	// The line as driver.py would show it in messages.
+	return std::string(line.orig, line.orig_len) + (line.newline ? "\n" : "");
+} // }}}
+
+static bool in(uint32_t c, char const *set) { // {{{
+	return c != 0 && c < 0x80 && strchr(set, c);
+} // }}}
+
+static std::string repr(double value) { // {{{
+	if (isnan(value))
+		return "nan";
+	if (isinf(value))
+		return value < 0 ? "-inf" : "inf";
+	// Find the shortest representation which reads back as the same value.
+	char buffer[32];
+	for (int precision = 1; precision <= 17; ++precision) {
+		snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+		if (strtod(buffer, NULL) == value)
+			break;
+	}
+	std::string ret;
+	char const *p = buffer;
+	if (*p == '-') {
+		ret += '-';
+		++p;
+	}
+	std::string d;
+	for (; *p != 'e'; ++p) {
+		if (*p != '.')
+			d += *p;
+	}
+	int exp = atoi(p + 1);
+	while (d.size() > 1 && d[d.size() - 1] == '0')
+		d.erase(d.size() - 1);
+	int decpt = exp + 1;
+	if (decpt > -4 && decpt <= 16) {
+		if (decpt <= 0)
+			ret += "0." + std::string(-decpt, '0') + d;
+		else if (decpt >= int(d.size()))
+			ret += d + std::string(decpt - d.size(), '0') + ".0";
+		else
+			ret += d.substr(0, decpt) + "." + d.substr(decpt);
+	}
+	else {
+		ret += d.substr(0, 1);
+		if (d.size() > 1)
+			ret += "." + d.substr(1);
+		snprintf(buffer, sizeof(buffer), "e%c%02d", exp < 0 ? '-' : '+', abs(exp));
+		ret += buffer;
+	}
+	return ret;
+} // }}}
+
+static std::string repr(uint32_t letter) { // {{{
+	if (letter == '\'')
+		return "\"'\"";
+	if (letter == '\\')
+		return "'\\\\'";
+	if (letter < 0x20 || letter == 0x7f) {
+		char buffer[8];
+		snprintf(buffer, sizeof(buffer), "'\\x%02x'", letter);
+		return buffer;
+	}
+	return "'" + utf8(letter) + "'";
+} // }}}
+// }}}
+
+// Compiler state. {{{
+struct Nums {
+	int32_t tool;
+	double v[6];	// X, Y, Z, E, f, F
+	Nums(int32_t t = 0, double x = 0, double y = 0, double z = 0, double e = 0, double f = 0, double F = 0) : tool(t) {
+		v[0] = x;
+		v[1] = y;
+		v[2] = z;
+		v[3] = e;
+		v[4] = f;
+		v[5] = F;
+	}
+};
+
+struct Args {
+	// Arguments of a command, in order of first appearance like a Python dict.
+	std::vector <std::pair <uint32_t, double> > items;
+	void clear() { items.clear(); }
+	void set(uint32_t letter, double value) {
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (items[i].first == letter) {
+				items[i].second = value;
+				return;
+			}
+		}
+		items.push_back(std::make_pair(letter, value));
+	}
+	bool get(uint32_t letter, double &value) const {
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (items[i].first == letter) {
+				value = items[i].second;
+				return true;
+			}
+		}
+		return false;
+	}
+	bool has(uint32_t letter) const {
+		double dummy;
+		return get(letter, dummy);
+	}
+	std::string repr() const {
+		std::string ret = "{";
+		for (size_t i = 0; i < items.size(); ++i) {
+			if (i > 0)
+				ret += ", ";
+			ret += ::repr(items[i].first) + ": " + ::repr(items[i].second);
+		}
+		return ret + "}";
+	}
+};
+
+struct Compiler {
+	GcodeSettings const &settings;
+	GcodeResult &result;
+	FILE *dst;
+	std::regex allow_system;
+	bool allow_system_valid;
+	bool have_mode;
+	uint32_t mode_letter;
+	long long mode_num;
+	bool have_message;
+	std::string message;
+	bool bbox_set[6];
+	double bbox[6];
+	std::vector <std::string> strings;
+	std::map <std::string, int> string_index;
+	double unit;
+	int arc_normal[3];
+	bool rel, erel;
+	double pos0[6];
+	std::vector <double> pos1;
+	double pos2;
+	double time_dist[2];
+	std::vector <Nums> pending;
+	double arc_ctr[3], arc_r, arc_diff, arc_a0, arc_da;
+	bool tool_changed;
+	int32_t current_extruder;
+	double r, z;	// These persist between G81 commands.
+	uint32_t num_records;	// Records which have been generated.
+	uint32_t written;	// Records written to dst; with compact encoding, the open block is not included.
+	uint32_t committed;	// Records announced in the header.
+	// Open block for compact encoding.
+	std::vector <char> block;
+	uint32_t block_records;
+	double field[2][RUN_FIELDS];	// Previous and second to previous values.
+	uint64_t offset;	// Bytes written to dst.
+	uint32_t crc;		// Checksum of everything after the header.
+	int last_type;
+	uint32_t next_snapshot;
+	std::vector <char> index;
+	// State after the records which have been written, for the index.
+	int32_t state_tool;
+	double state_pos[3];
+	std::vector <double> state_e;
+	std::vector <double> state_temp;
+	Compiler(GcodeSettings const &s, GcodeResult &res, FILE *d);
+	void error(char const *fmt, ...) __attribute__((format(printf, 2, 3)));
+	double &extruder(long i);
+	int add_string(std::string const &s);
+	void output(void const *data, size_t size);
+	void encode(Run_Record const &record, std::string const *s);
+	void close_block();
+	void snapshot();
+	void write(int type, Nums const &nums);
+	bool commit();
+	void add_record(int type, Nums const &nums = Nums(), bool force = false);
+	void flush_pending();
+	void flush_arc();
+	void apply(GcodeLine const &line);
+	void command(GcodeLine const &line, uint32_t letter, long long num, Args &args, bool &reset_message);
+	bool finish();
+};
+
+Compiler::Compiler(GcodeSettings const &s, GcodeResult &res, FILE *d) : settings(s), result(res), dst(d) { // {{{
+	try {
+		allow_system = std::regex(settings.allow_system);
+		allow_system_valid = true;
+	}
+	catch (std::regex_error &) {
+		allow_system_valid = false;
+	}
+	have_mode = false;
+	have_message = false;
+	for (int i = 0; i < 6; ++i) {
+		bbox_set[i] = false;
+		bbox[i] = 0;
+		pos0[i] = NAN;
+	}
+	strings.push_back("");
+	string_index[""] = 0;
+	unit = 1;
+	arc_normal[0] = 0;
+	arc_normal[1] = 0;
+	arc_normal[2] = 1;
+	rel = false;
+	erel = false;
+	pos1.push_back(0);
+	pos1.push_back(0);
+	pos2 = INFINITY;
+	time_dist[0] = 0;
+	time_dist[1] = 0;
+	tool_changed = false;
+	current_extruder = 0;
+	r = NAN;
+	z = NAN;
+	num_records = 0;
+	written = 0;
+	committed = 0;
+	block_records = 0;
+	for (int i = 0; i < RUN_FIELDS; ++i) {
+		field[0][i] = 0;
+		field[1][i] = 0;
+	}
+	offset = sizeof(Run_Header);
+	crc = 0;
+	last_type = -1;
+	next_snapshot = 0;
+	state_tool = 0;
+	for (int i = 0; i < 3; ++i)
+		state_pos[i] = NAN;
+	state_temp.resize(settings.num_temps + 1, NAN);
+	Run_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RUN_MAGIC, sizeof(RUN_MAGIC));
+	header.version = RUN_VERSION;
+	header.num_temps = settings.num_temps;
+	header.encoding = settings.compact ? RUN_ENCODING_COMPACT : RUN_ENCODING_PLAIN;
+	fwrite(&header, sizeof(header), 1, dst);
+	fflush(dst);
+} // }}}
+
+void Compiler::error(char const *fmt, ...) { // {{{
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	std::vector <char> buffer(len + 1);
+	va_start(ap, fmt);
+	vsnprintf(&buffer[0], len + 1, fmt, ap);
+	va_end(ap);
+	result.errors.push_back(std::string(&buffer[0], len));
+} // }}}
+
+double &Compiler::extruder(long i) { // {{{
+	// Index pos[1] like Python does.
+	static double dummy;
+	if (i < 0)
+		i += pos1.size();
+	if (i < 0 || i >= long(pos1.size())) {
+		dummy = 0;
+		return dummy;
+	}
+	return pos1[i];
+} // }}}
+
+int Compiler::add_string(std::string const &s) { // {{{
+	std::map <std::string, int>::iterator i = string_index.find(s);
+	if (i != string_index.end())
+		return i->second;
+	int ret = strings.size();
+	strings.push_back(s);
+	string_index[s] = ret;
+	return ret;
+} // }}}
+
+static uint32_t crc32(uint32_t crc, void const *data, size_t size) { // {{{
+	// This is the same as zlib's crc32(), so the Python code can use that.
+	static uint32_t table[256];
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	uint8_t const *p = reinterpret_cast <uint8_t const *>(data);
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+} // }}}
+
+void Compiler::output(void const *data, size_t size) { // {{{
+	fwrite(data, 1, size, dst);
+	crc = crc32(crc, data, size);
+	offset += size;
+} // }}}
+
+static bool same(double a, double b) { // {{{
+	// Compare bits, so NaN and -0 are handled.
+	return memcmp(&a, &b, sizeof(double)) == 0;
+} // }}}
+
+static void varint(std::vector <char> &data, int64_t value) { // {{{
+	uint64_t z = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+	while (z >= 0x80) {
+		data.push_back(char(z & 0x7f) | 0x80);
+		z >>= 7;
+	}
+	data.push_back(char(z));
+} // }}}
+
+void Compiler::encode(Run_Record const &record, std::string const *s) { // {{{
+	// See runfile.h for the format.
+	double value[RUN_FIELDS] = {double(record.tool), record.X, record.Y, record.Z, record.E, record.f, record.F, record.time, record.dist};
+	size_t start = block.size();
+	block.push_back(record.type);
+	block.resize(start + 4, 0);
+	uint32_t flags = 0;
+	for (int i = 0; i < RUN_FIELDS; ++i) {
+		double prev = field[0][i];
+		int code;
+		if (same(value[i], prev))
+			code = RUN_SAME;
+		else if (same(value[i], run_predict(i, value, field)))
+			code = RUN_PREDICT;
+		else {
+			code = RUN_RAW;
+			if (i == 0) {
+				varint(block, int64_t(value[i]) - int64_t(prev));
+				code = RUN_FIXED;
+			}
+			else if (fabs(prev) < RUN_FIXED_LIMIT && fabs(value[i]) < RUN_FIXED_LIMIT) {
+				int64_t n = llround(value[i] * RUN_FIXED_SCALE);
+				int64_t p = llround(prev * RUN_FIXED_SCALE);
+				if (same(double(n) / RUN_FIXED_SCALE, value[i])) {
+					varint(block, n - p);
+					code = RUN_FIXED;
+				}
+			}
+			if (code == RUN_RAW) {
+				if (i == 0) {
+					int32_t tool = record.tool;
+					block.insert(block.end(), reinterpret_cast <char *>(&tool), reinterpret_cast <char *>(&tool) + sizeof(tool));
+				}
+				else
+					block.insert(block.end(), reinterpret_cast <char *>(&value[i]), reinterpret_cast <char *>(&value[i]) + sizeof(double));
+			}
+		}
+		flags |= code << (2 * i);
+		field[1][i] = prev;
+		field[0][i] = value[i];
+	}
+	for (int i = 0; i < 3; ++i)
+		block[start + 1 + i] = char(flags >> (8 * i));
+	if (s)
+		block.insert(block.end(), s->begin(), s->end());
+} // }}}
+
+void Compiler::close_block() { // {{{
+	if (block_records == 0)
+		return;
+	Run_Block header;
+	header.size = block.size();
+	header.num_records = block_records;
+	output(&header, sizeof(header));
+	output(block.data(), block.size());
+	written += block_records;
+	block.clear();
+	block_records = 0;
+	for (int i = 0; i < RUN_FIELDS; ++i) {
+		field[0][i] = 0;
+		field[1][i] = 0;
+	}
+} // }}}
+
+void Compiler::snapshot() { // {{{
+	std::vector <char> entry(run_snapshot_size(settings.num_temps));
+	Run_Snapshot *s = reinterpret_cast <Run_Snapshot *>(entry.data());
+	s->record = num_records;
+	s->offset = offset;
+	s->tool = state_tool;
+	s->X = state_pos[0];
+	s->Y = state_pos[1];
+	s->Z = state_pos[2];
+	s->E = state_tool >= 0 && state_tool < int(state_e.size()) ? state_e[state_tool] : 0;
+	s->time = time_dist[0];
+	s->dist = time_dist[1];
+	memcpy(s->temp, state_temp.data(), state_temp.size() * sizeof(double));
+	index.insert(index.end(), entry.begin(), entry.end());
+	next_snapshot = (num_records / RUN_INDEX_INTERVAL + 1) * RUN_INDEX_INTERVAL;
+} // }}}
+
+void Compiler::write(int type, Nums const &nums) { // {{{
+	if (settings.compact && block_records >= RUN_BLOCK_RECORDS)
+		close_block();
+	if (num_records >= next_snapshot && last_type != RUN_PRE_LINE && last_type != RUN_PRE_ARC)
+		snapshot();
+	if (type == RUN_LINE) {
+		if (nums.v[4] == INFINITY) {
+			double extra = pow(pow(nums.v[0] - nums.v[1], 2) + pow(nums.v[2] - nums.v[3], 2) + pow(nums.v[4] - nums.v[5], 2), .5);
+			if (!isnan(extra))
+				time_dist[1] += extra;
+		}
+		else {
+			double extra = 2 / (nums.v[4] + nums.v[5]);
+			if (!isnan(extra))
+				time_dist[0] += extra;
+		}
+	}
+	else if (type == RUN_WAIT)
+		time_dist[0] += nums.v[0];
+	Run_Record record;
+	record.type = type;
+	record.tool = nums.tool;
+	record.X = nums.v[0];
+	record.Y = nums.v[1];
+	record.Z = nums.v[2];
+	record.E = nums.v[3];
+	record.f = nums.v[4];
+	record.F = nums.v[5];
+	record.time = time_dist[0];
+	record.dist = time_dist[1];
+	if (type == RUN_SYSTEM || type == RUN_CONFIRM) {
+		// Store the string inline.
+		std::string const &s = strings[nums.tool];
+		record.tool = s.size();
+		int slots = run_string_records(s.size());
+		if (settings.compact) {
+			encode(record, &s);
+			block_records += 1 + slots;
+		}
+		else {
+			std::vector <char> data(slots * sizeof(Run_Record), 0);
+			memcpy(data.data(), s.data(), s.size());
+			output(&record, sizeof(record));
+			output(data.data(), data.size());
+		}
+		num_records += 1 + slots;
+	}
+	else {
+		if (settings.compact) {
+			encode(record, NULL);
+			block_records += 1;
+		}
+		else
+			output(&record, sizeof(record));
+		num_records += 1;
+	}
+	if (!settings.compact)
+		written = num_records;
+	last_type = type;
+	// Track the state for the index.
+	if (type == RUN_LINE || type == RUN_ARC) {
+		state_tool = record.tool;
+		state_pos[0] = record.X;
+		state_pos[1] = record.Y;
+		state_pos[2] = record.Z;
+	}
+	if ((type == RUN_LINE || type == RUN_ARC || type == RUN_SETPOS) && record.tool >= 0) {
+		if (record.tool >= int(state_e.size()))
+			state_e.resize(record.tool + 1, 0);
+		state_e[record.tool] = type == RUN_SETPOS ? record.X : record.E;
+	}
+	if (type == RUN_SETTEMP && record.tool >= -1 && record.tool < settings.num_temps)
+		state_temp[record.tool + 1] = record.X;
+	// Let the cdriver run what has been written so far.
+	if (written - committed >= COMMIT_RECORDS)
+		commit();
+} // }}}
+
+bool Compiler::commit() { // {{{
+	if (fflush(dst) != 0 || pwrite(fileno(dst), &written, sizeof(written), offsetof(Run_Header, num_records)) != sizeof(written))
+		return false;
+	committed = written;
+	return true;
+} // }}}
+
+static double center(Nums const &a, Nums const &b, Nums const &c, double ctr[3], double &radius, double angles[3]) { // {{{
+	// Given 3 points, determine center, radius, angles of points on circle; return deviation of polygon from circle.
+	double x0 = a.v[0], y0 = a.v[1], z0 = a.v[2];
+	double x1 = b.v[0], y1 = b.v[1];
+	double x2 = c.v[0], y2 = c.v[1];
+	double den = 2 * (-x0 * y1 - x2 * y0 + x2 * y1 + x1 * y0 + x0 * y2 - x1 * y2);
+	if (den == 0)
+		return INFINITY;
+	double xc = ((y0 - y1) * (pow(y0, 2) - pow(y2, 2) + pow(x0, 2) - pow(x2, 2)) - (y0 - y2) * (pow(x0, 2) - pow(x1, 2) + pow(y0, 2) - pow(y1, 2))) / den;
+	den = 2 * (y0 - y1);
+	if (den == 0)
+		return INFINITY;
+	double yc = (pow(x0, 2) - pow(x1, 2) + pow(y0, 2) - pow(y1, 2) - 2 * xc * (x0 - x1)) / den;
+	radius = pow(pow(xc - x0, 2) + pow(yc - y0, 2), .5);
+	Nums const *p[3] = {&a, &b, &c};
+	for (int i = 0; i < 3; ++i)
+		angles[i] = atan2(p[i]->v[1] - yc, p[i]->v[0] - xc);
+	double mid[2] = {(b.v[0] + a.v[0]) / 2, (b.v[1] + a.v[1]) / 2};
+	double amid = (angles[0] + angles[1]) / 2;
+	double cmid[2] = {cos(amid) * radius + xc, sin(amid) * radius + yc};
+	ctr[0] = xc;
+	ctr[1] = yc;
+	ctr[2] = z0;
+	return pow(cmid[0] - mid[0], 2) + pow(cmid[1] - mid[1], 2);
+} // }}}
+
+void Compiler::add_record(int type, Nums const &nums, bool force) { // {{{
+	if (!force && type == RUN_LINE) {
+		// Update bounding box.
+		for (int i = 0; i < 3; ++i) {
+			double value = nums.v[i];
+			if (isnan(value))
+				continue;
+			if (!bbox_set[2 * i] || value < bbox[2 * i]) {
+				bbox_set[2 * i] = true;
+				bbox[2 * i] = value;
+			}
+			if (!bbox_set[2 * i + 1] || value > bbox[2 * i + 1]) {
+				bbox_set[2 * i + 1] = true;
+				bbox[2 * i + 1] = value;
+			}
+		}
+		// Analyze this move in combination with pending moves.
+		if (pending.empty())
+			pending.push_back(Nums(0, pos0[0], pos0[1], pos0[2], extruder(nums.tool), pos2, pos2));
+		pending.push_back(nums);
+		if (pending.size() == 2) {
+			if (pending[0].v[2] != pending[1].v[2])
+				flush_pending();
+			return;
+		}
+		double const epsilon = settings.arc_tolerance;
+		if (pending.size() == 3) {
+			// If the points are not on a circle with equal angles, or the angle is too large, push pending[1] through to output.
+			// Otherwise, record settings.
+			double ctr[3] = {0, 0, 0}, radius = 0, angles[3];
+			double diff = center(pending[0], pending[1], pending[2], ctr, radius, angles);
+			// An error in the angle moves the point along the circle by the radius times that error; allow the same deviation as for the chords.
+			if (diff > pow(epsilon, 2) || fabs(angles[1] - angles[0] - angles[2] + angles[1]) * radius > epsilon) {
+				write(RUN_LINE, pending[1]);
+				pending.erase(pending.begin());
+				return;
+			}
+			for (int i = 0; i < 3; ++i)
+				arc_ctr[i] = ctr[i];
+			arc_r = radius;
+			arc_diff = diff;
+			arc_a0 = angles[0];
+			arc_da = (angles[2] - angles[0]) / 2;
+			return;
+		}
+		double a = arc_a0 + arc_da * (pending.size() - 1);
+		double p[2] = {arc_ctr[0] + cos(a) * arc_r, arc_ctr[1] + sin(a) * arc_r};
+		// If new point doesn't fit on circle, push pending as circle to output.
+		if (pow(p[0] - pending.back().v[0], 2) + pow(p[1] - pending.back().v[1], 2) > pow(epsilon, 2) || pending[0].v[2] != pending.back().v[2])
+			flush_arc();
+		return;
+	}
+	flush_pending();
+	write(type, nums);
+} // }}}
+
+void Compiler::flush_pending() { // {{{
+	if (pending.size() >= 3)
+		flush_arc();
+	std::vector <Nums> tmp(pending.begin() + (pending.empty() ? 0 : 1), pending.end());
+	pending.clear();
+	for (size_t i = 0; i < tmp.size(); ++i)
+		add_record(RUN_LINE, tmp[i], true);
+} // }}}
+
+void Compiler::flush_arc() { // {{{
+	Nums start = pending[0];
+	Nums end = pending[pending.size() - 2];
+	Nums tmp = pending.back();
+	pending.clear();
+	add_record(RUN_PRE_ARC, Nums(0, arc_ctr[0], arc_ctr[1], start.v[2], 0, 0, arc_da > 0 ? 1 : -1), true);
+	add_record(RUN_ARC, Nums(current_extruder, end.v[0], end.v[1], end.v[2], extruder(current_extruder), -pos2, -pos2), true);
+	pending.push_back(tmp);
+} // }}}
+
+void Compiler::apply(GcodeLine const &line) { // {{{
+	switch (line.type) {
+	case GcodeLine::INVALID:
+		// The index is used here, not the line number.
+		error("%ld:ignoring invalid gcode: %s", line.index, orig(line).c_str());
+		return;
+	case GcodeLine::UNTERMINATED:
+		// driver.py never finishes parsing such a line; skip it instead.
+		error("%lld:ignoring line with unterminated comment: %s", line.lineno, orig(line).c_str());
+		return;
+	case GcodeLine::SYSTEM:
+	case GcodeLine::SYSTEM_BACKGROUND:
+		if (!allow_system_valid || !std::regex_search(line.message, allow_system, std::regex_constants::match_continuous))
+			result.errors.push_back("Warning: system command " + line.message + " is forbidden and will not be run");
+		// X is set for commands which are not waited for.
+		add_record(RUN_SYSTEM, Nums(add_string(line.message), line.type == GcodeLine::SYSTEM_BACKGROUND));
+		return;
+	case GcodeLine::NORMAL:
+		break;
+	}
+	if (line.have_message) {
+		have_message = true;
+		message = line.message;
+	}
+	std::vector <GcodeWord> const &words = line.words;
+	size_t w = 0;
+	Args args;
+	while (w < words.size()) {
+		uint32_t letter;
+		long long num;
+		if (!have_mode || in(words[w].letter, "GMTDS")) {
+			if (words[w].is_short) {
+				error("%lld:ignoring unparsable line: %s", line.lineno, orig(line).c_str());
+				break;
+			}
+			if (!words[w].is_int) {
+				error("%lld:parse error in line: %s", line.lineno, orig(line).c_str());
+				break;
+			}
+			letter = words[w].letter;
+			num = words[w].ival;
+			++w;
+		}
+		else {
+			letter = mode_letter;
+			num = mode_num;
+		}
+		args.clear();
+		bool success = true;
+		for (; w < words.size(); ++w) {
+			if (in(words[w].letter, "GMD"))
+				break;
+			if (!words[w].is_float) {
+				error("%lld:ignoring invalid gcode: %s", line.lineno, orig(line).c_str());
+				success = false;
+				break;
+			}
+			args.set(words[w].letter, words[w].fval);
+		}
+		if (!success)
+			break;
+		if (letter == 'M' && num == 2) {
+			// Program end.
+			break;
+		}
+		bool reset_message = true;
+		command(line, letter, num, args, reset_message);
+		if (reset_message) {
+			have_message = false;
+			message.clear();
+		}
+	}
+} // }}}
+
+void Compiler::command(GcodeLine const &line, uint32_t letter, long long num, Args &args, bool &reset_message) { // {{{
+	// The structure of this function follows the if-chains in driver.py.
+	double value = 0;
+	bool G = letter == 'G', M = letter == 'M';
+	if (letter == 'T') {
+		if (num >= long(pos1.size()))
+			pos1.resize(num + 1, 0.);
+		current_extruder = num;
+		// Force update of extruder.
+		add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], pos0[2], extruder(current_extruder), INFINITY, INFINITY));
+		reset_message = false;
+		return;
+	}
+	if (G && num >= 17 && num <= 19) {
+		for (int i = 0; i < 3; ++i)
+			arc_normal[i] = i == 19 - num ? 1 : 0;
+		reset_message = false;
+		return;
+	}
+	if (G && (num == 20 || num == 21)) {
+		unit = num == 20 ? 25.4 : 1.;
+		reset_message = false;
+		return;
+	}
+	if (G && (num == 90 || num == 91)) {
+		rel = num == 91;
+		erel = num == 91;
+		reset_message = false;
+		return;
+	}
+	if (M && (num == 82 || num == 83)) {
+		erel = num == 83;
+		reset_message = false;
+		return;
+	}
+	if (M && num == 84) {
+		for (size_t e = 0; e < pos1.size(); ++e)
+			pos1[e] = 0.;
+	}
+	else if (G && num == 92) {
+		if (!args.get('E', value)) {
+			reset_message = false;
+			return;
+		}
+		value *= unit;
+		args.set('E', value);
+		extruder(current_extruder) = value;
+	}
+	else if (M && (num == 104 || num == 109 || num == 116))
+		args.set('E', args.get('T', value) ? trunc(value) : current_extruder);
+	if (M && num == 140) {
+		num = 104;
+		args.set('E', -2);
+	}
+	else if (M && num == 190) {
+		num = 109;
+		args.set('E', -2);
+	}
+	else if (M && num == 6) {
+		// Tool change: park and remember to probe.
+		letter = 'G';
+		num = 28;
+		G = true;
+		M = false;
+		tool_changed = true;
+	}
+	if (G && num == 28) {
+		if (settings.num_extruders >= 0 && settings.num_extruders > current_extruder)
+			extruder(current_extruder) = 0.;
+		add_record(RUN_PARK);
+		for (int a = 0; a < 6; ++a) {
+			if (settings.park[a])
+				pos0[a] = NAN;
+		}
+	}
+	else if (G && (num == 0 || num == 1 || num == 81)) {
+		if (num != 0) {
+			have_mode = true;
+			mode_letter = letter;
+			mode_num = num;
+		}
+		static char const *const names = "XYZABCEFR";
+		double components[9];
+		bool given[9] = {false, false, false, false, false, false, false, false, false};
+		for (size_t i = 0; i < args.items.size(); ++i) {
+			uint32_t c = args.items[i].first;
+			char const *n = in(c, names) ? strchr(names, c) : NULL;
+			if (!n) {
+				error("%lld:invalid component %s", line.lineno, utf8(c).c_str());
+				continue;
+			}
+			given[n - names] = true;
+			components[n - names] = args.items[i].second;
+		}
+		double f0 = pos2;
+		if (given[7])
+			pos2 = components[7] * unit / 60;
+		double oldpos[6];
+		for (int a = 0; a < 6; ++a)
+			oldpos[a] = pos0[a];
+		if (num != 81) {
+			if (given[6]) {
+				double &e = extruder(current_extruder);
+				double estep;
+				if (erel)
+					estep = components[6] * unit;
+				else
+					estep = components[6] * unit - e;
+				e += estep;
+			}
+		}
+		else if (given[8]) {
+			if (rel)
+				r = pos0[2] + components[8] * unit;
+			else
+				r = components[8] * unit;
+		}
+		for (int axis = 0; axis < 6; ++axis) {
+			if (!given[axis])
+				continue;
+			if (rel)
+				pos0[axis] += components[axis] * unit;
+			else
+				pos0[axis] = components[axis] * unit;
+			if (axis == 2)
+				z = pos0[2];
+		}
+		if (num != 81) {
+			double sum = 0;
+			for (int x = 0; x < 3; ++x) {
+				if (!isnan(pos0[x] - oldpos[x]))
+					sum += pow(pos0[x] - oldpos[x], 2);
+			}
+			double dist = pow(sum, .5);
+			if (dist > 0) {
+				f0 = pos2;	// Always use new value.
+				if (f0 == 0)
+					f0 = INFINITY;
+			}
+			if (isnan(dist))
+				dist = 0;
+			bool same = true;
+			for (int i = 3; i < 6; ++i) {
+				if (!((isnan(pos0[i]) && isnan(oldpos[i])) || pos0[i] == oldpos[i])) {
+					same = false;
+					break;
+				}
+			}
+			bool feed = dist > 0 && num == 1;
+			if (!same)
+				add_record(RUN_PRE_LINE, Nums(current_extruder, pos0[3], pos0[4], pos0[5], NAN, NAN, NAN));
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], pos0[2], extruder(current_extruder), feed ? f0 / dist : INFINITY, feed ? pos2 / dist : INFINITY));
+		}
+		else {
+			// If old pos is unknown, use safe distance.
+			if (isnan(oldpos[2]))
+				oldpos[2] = r;
+			// Drill cycle.
+			// Only support OLD_Z (G90) retract mode; don't support repeats(L).
+			// goto x,y
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], oldpos[2], 0, INFINITY, INFINITY));
+			// goto r
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], r, 0, INFINITY, INFINITY));
+			// goto z; this is always straight down, because the move before and after it are also vertical.
+			if (z != r) {
+				f0 = pos2 / fabs(z - r);
+				if (isnan(f0))
+					f0 = INFINITY;
+				add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], z, 0, f0, f0));
+			}
+			// retract; this is always straight up, because the move before and after it are also non-horizontal.
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], oldpos[2], 0, INFINITY, INFINITY));
+			// empty move; this makes sure the previous move is entirely vertical.
+			add_record(RUN_LINE, Nums(current_extruder, pos0[0], pos0[1], oldpos[2], 0, INFINITY, INFINITY));
+			// Set up current z position so next G81 will work.
+			pos0[2] = oldpos[2];
+		}
+	}
+	else if (G && (num == 2 || num == 3)) {
+		// Arc.
+		have_mode = true;
+		mode_letter = letter;
+		mode_num = num;
+		static char const *const names = "XYZEFIJK";
+		double components[8];
+		bool given[8] = {false, false, false, false, false, false, false, false};
+		for (size_t i = 0; i < args.items.size(); ++i) {
+			uint32_t c = args.items[i].first;
+			char const *n = in(c, names) ? strchr(names, c) : NULL;
+			if (!n) {
+				error("%lld:invalid arc component %s", line.lineno, utf8(c).c_str());
+				continue;
+			}
+			given[n - names] = true;
+			components[n - names] = args.items[i].second;
+		}
+		double f0 = pos2;
+		if (given[4])
+			pos2 = components[4] * unit / 60;
+		double oldpos[3] = {pos0[0], pos0[1], pos0[2]};
+		if (given[3]) {
+			// Note that the meaning of erel is inverted here, like it is in driver.py.
+			double &e = extruder(current_extruder);
+			double estep;
+			if (erel)
+				estep = components[3] * unit - e;
+			else
+				estep = components[3] * unit;
+			e += estep;
+		}
+		double ctr[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			if (given[axis]) {
+				if (rel)
+					pos0[axis] += components[axis] * unit;
+				else
+					pos0[axis] = components[axis] * unit;
+				if (axis == 2)
+					z = pos0[2];
+			}
+			if (given[5 + axis])
+				ctr[axis] = oldpos[axis] + components[5 + axis];
+			else
+				ctr[axis] = oldpos[axis];
+		}
+		int s = num == 2 ? -1 : 1;
+		add_record(RUN_PRE_ARC, Nums(0, ctr[0], ctr[1], ctr[2], s * arc_normal[0], s * arc_normal[1], s * arc_normal[2]));
+		add_record(RUN_ARC, Nums(current_extruder, pos0[0], pos0[1], pos0[2], extruder(current_extruder), -f0, -pos2));
+	}
+	else if (G && num == 4)
+		add_record(RUN_WAIT, Nums(0, args.get('P', value) ? value / 1000 : 0));
+	else if (G && num == 92) {
+		args.get('E', value);
+		add_record(RUN_SETPOS, Nums(current_extruder, value));
+	}
+	else if (G && num == 94) {
+		// Set feedrate to units per minute; this is always used, and it shouldn't raise an error.
+	}
+	else if (M && num == 0) {
+		add_record(RUN_CONFIRM, Nums(have_message ? add_string(message) : 0, tool_changed ? 1 : 0));
+		tool_changed = false;
+	}
+	else if (M && (num == 3 || num == 4)) {
+		// Spindle on; direction is not supported.
+		add_record(RUN_GPIO, Nums(-3, 1));
+	}
+	else if (M && num == 5)
+		add_record(RUN_GPIO, Nums(-3, 0));
+	else if (M && num == 9) {
+		// Coolant off: ignore.
+	}
+	else if (M && num == 42) {
+		double p, s;
+		if (args.get('P', p) && args.get('S', s))
+			add_record(RUN_GPIO, Nums(int32_t(p), s));
+		else
+			error("%lld:invalid M42 request (needs P and S)", line.lineno);
+	}
+	else if (M && num == 84) {
+		// Don't sleep, but set all extruder positions to 0.
+		for (size_t e = 0; e < pos1.size(); ++e)
+			add_record(RUN_SETPOS, Nums(e, 0));
+	}
+	else if (M && num == 104) {
+		double e = 0, s;
+		args.get('E', e);
+		if (e >= settings.num_temps)
+			error("ignoring M104 for invalid temp %d", int(e));
+		else if (!args.get('S', s))
+			error("ignoring M104 without S");
+		else
+			add_record(RUN_SETTEMP, Nums(int32_t(e), s + C0));
+	}
+	else if (M && (num == 106 || num == 107))
+		add_record(RUN_GPIO, Nums(-2, num == 106 ? 1 : 0));
+	else if (M && num == 109) {
+		double e = 0, s;
+		args.get('E', e);
+		if (args.get('S', s))
+			add_record(RUN_SETTEMP, Nums(int32_t(e), s + C0));
+		add_record(RUN_WAITTEMP, Nums(int32_t(e)));
+	}
+	else if (M && num == 116)
+		add_record(RUN_WAITTEMP, Nums(-2));
+	else if (letter == 'S') {
+		// Spindle speed; not supported, but shouldn't error.
+	}
+	else {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), ", %lld), ", num);
+		error("%lld:invalid gcode command %s", line.lineno, ("((" + repr(letter) + buffer + args.repr() + ")").c_str());
+	}
+} // }}}
+
+bool Compiler::finish() { // {{{
+	flush_pending();
+	result.have_bbox = bbox_set[0] && bbox_set[1] && bbox_set[2] && bbox_set[3];
+	for (int i = 0; i < 6; ++i)
+		result.bbox[i] = result.have_bbox && bbox_set[i] ? bbox[i] : 0;
+	result.bbox[6] = time_dist[0];
+	result.bbox[7] = time_dist[1];
+	close_block();
+	if (!commit())
+		return false;
+	Run_Header header;
+	memcpy(header.bbox, result.bbox, sizeof(header.bbox));
+	header.encoding = settings.compact ? RUN_ENCODING_COMPACT : RUN_ENCODING_PLAIN;
+	header.reserved = 0;
+	header.index_offset = offset;
+	header.index_size = index.size() / run_snapshot_size(settings.num_temps);
+	output(index.data(), index.size());
+	header.checksum = crc;
+	// Write bbox and everything after it.
+	size_t size = sizeof(Run_Header) - offsetof(Run_Header, bbox);
+	if (fflush(dst) != 0 || pwrite(fileno(dst), reinterpret_cast <char *>(&header) + offsetof(Run_Header, bbox), size, offsetof(Run_Header, bbox)) != ssize_t(size))
+		return false;
+	// The cdriver reads complete before num_records, so it must be written last.
+	uint32_t complete = 1;
+	return pwrite(fileno(dst), &complete, sizeof(complete), offsetof(Run_Header, complete)) == sizeof(complete);
+} // }}}
+// }}}
+
+// Parallel tokenizing. {{{
+// The input is split in chunks of CHUNK_SIZE bytes; a chunk holds the lines which start in it.
+// Worker threads tokenize chunks; the main thread applies them in order.
+// Slots are reused, so memory use does not depend on the size of the input.
+#define CHUNK_SIZE (1 << 20)
+
+struct Chunk {
+	std::vector <GcodeLine> lines;
+	size_t num_lines;
+	long id;		// Chunk which is stored in this slot.
+	bool ready;
+};
+
+struct Tokenizer {
+	char const *map;
+	size_t size;
+	long num_chunks;
+	std::vector <Chunk> slots;
+	std::mutex lock;
+	std::condition_variable changed;
+	long next;		// Next chunk to be tokenized.
+	long consumed;		// Number of chunks which have been applied.
+	bool line_start(size_t pos);
+	void tokenize_chunk(long id, Chunk &chunk);
+	void work();
+};
+
+bool Tokenizer::line_start(size_t pos) { // {{{
+	// Lines are split like Python's universal newlines do.
+	if (pos == 0 || pos >= size)
+		return true;
+	return map[pos - 1] == '\n' || (map[pos - 1] == '\r' && map[pos] != '\n');
+} // }}}
+
+void Tokenizer::tokenize_chunk(long id, Chunk &chunk) { // {{{
+	size_t start = size_t(id) * CHUNK_SIZE;
+	size_t stop = min(start + CHUNK_SIZE, size);
+	while (start < stop && !line_start(start))
+		++start;
+	chunk.num_lines = 0;
+	char const *end = map + size;
+	for (char const *p = map + start; p < map + stop; ) {
+		char const *e = p;
+		while (e < end && *e != '\n' && *e != '\r')
+			++e;
+		if (chunk.num_lines >= chunk.lines.size())
+			chunk.lines.resize(chunk.num_lines + 1);
+		GcodeLine &line = chunk.lines[chunk.num_lines++];
+		line.orig = p;
+		line.orig_len = e - p;
+		line.newline = e < end;
+		tokenize(p, e, line);
+		if (e < end && *e == '\r' && e + 1 < end && e[1] == '\n')
+			++e;
+		p = e + 1;
+	}
+} // }}}
+
+void Tokenizer::work() { // {{{
+	std::unique_lock <std::mutex> l(lock);
+	while (next < num_chunks) {
+		long id = next++;
+		Chunk &chunk = slots[id % slots.size()];
+		// Wait until the main thread is done with the chunk which was previously in this slot.
+		while (consumed + long(slots.size()) <= id)
+			changed.wait(l);
+		chunk.id = id;
+		l.unlock();
+		tokenize_chunk(id, chunk);
+		l.lock();
+		chunk.ready = true;
+		changed.notify_all();
+	}
+} // }}}
+// }}}
+
+bool gcode_compile(char const *infile, char const *outfile, GcodeSettings const &settings, GcodeResult &result) { // {{{
+	result.errors.clear();
+	result.have_bbox = false;
+	int fd = open(infile, O_RDONLY);
+	if (fd < 0) {
+		result.errors.push_back(std::string("unable to open input file: ") + strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		result.errors.push_back(std::string("unable to stat input file: ") + strerror(errno));
+		close(fd);
+		return false;
+	}
+	char const *map = NULL;
+	if (st.st_size > 0) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			result.errors.push_back(std::string("unable to map input file: ") + strerror(errno));
+			close(fd);
+			return false;
+		}
+		map = reinterpret_cast <char const *>(m);
+		madvise(m, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	FILE *dst = fopen(outfile, "wb");
+	if (!dst) {
+		result.errors.push_back(std::string("unable to open output file: ") + strerror(errno));
+		if (map)
+			munmap(const_cast <char *>(map), st.st_size);
+		return false;
+	}
+	setvbuf(dst, NULL, _IOFBF, 1 << 20);
+	Compiler compiler(settings, result, dst);
+	Tokenizer tokenizer;
+	tokenizer.map = map;
+	tokenizer.size = st.st_size;
+	tokenizer.num_chunks = (tokenizer.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	tokenizer.next = 0;
+	tokenizer.consumed = 0;
+	int threads = settings.threads > 0 ? settings.threads : std::thread::hardware_concurrency();
+	// The main thread applies the lines, so it doesn't tokenize if there are other threads.
+	int workers = min(long(threads > 1 ? threads : 0), tokenizer.num_chunks);
+	tokenizer.slots.resize(max(2 * workers, 1));
+	for (size_t s = 0; s < tokenizer.slots.size(); ++s) {
+		tokenizer.slots[s].id = -1;
+		tokenizer.slots[s].ready = false;
+	}
+	std::vector <std::thread> pool;
+	for (int t = 0; t < workers; ++t) {
+		try {
+			pool.push_back(std::thread(&Tokenizer::work, &tokenizer));
+		}
+		catch (std::system_error &) {
+			break;
+		}
+	}
+	long index = 0;
+	for (long id = 0; id < tokenizer.num_chunks; ++id) {
+		Chunk &chunk = tokenizer.slots[id % tokenizer.slots.size()];
+		if (pool.empty())
+			tokenizer.tokenize_chunk(id, chunk);
+		else {
+			std::unique_lock <std::mutex> l(tokenizer.lock);
+			while (!chunk.ready || chunk.id != id)
+				tokenizer.changed.wait(l);
+		}
+		// Line numbers depend on the chunks before this one, so they are filled in here.
+		for (size_t i = 0; i < chunk.num_lines; ++i) {
+			GcodeLine &line = chunk.lines[i];
+			line.index = index++;
+			if (!line.numbered)
+				line.lineno = line.index + 1;
+			compiler.apply(line);
+		}
+		if (!pool.empty()) {
+			std::unique_lock <std::mutex> l(tokenizer.lock);
+			chunk.ready = false;
+			tokenizer.consumed = id + 1;
+			tokenizer.changed.notify_all();
+		}
+	}
+	for (size_t t = 0; t < pool.size(); ++t)
+		pool[t].join();
+	bool ok = compiler.finish() && !ferror(dst);
+	if (fclose(dst) != 0)
+		ok = false;
+	if (!ok)
+		result.errors.push_back("unable to write output file");
+	if (map)
+		munmap(const_cast <char *>(map), st.st_size);
+	return ok;
+} // }}}
@@ -0,0 +1,47 @@
+/* gcode.h - g-code to run file compiler for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GCODE_H
+#define _GCODE_H
+
+#include "runfile.h"
+#include <string>
+#include <vector>
+
+// This is a port of Printer._gcode_parse in driver.py.  The output must be identical to what that function writes.
+
+struct GcodeSettings {
+	int num_temps;			// M104 for a higher temp is an error.
+	int num_extruders;		// Number of axes in space 1, or -1 if there is no space 1.
+	bool park[6];			// Axes of space 0 which have a park position; their position is unknown after G28.
+	std::string allow_system;	// Regular expression for allowed SYSTEM: comments.
+	int threads;			// Number of threads to use; 0 means one per core.
+	double arc_tolerance;		// Maximum distance between a fitted arc and the line segments it replaces.
+	bool compact;			// Use RUN_ENCODING_COMPACT for the output.
+};
+
+struct GcodeResult {
+	std::vector <std::string> errors;
+	bool have_bbox;			// If false, the file contains no moves and should not be queued.
+	double bbox[8];			// xmin, xmax, ymin, ymax, zmin, zmax, time, dist.
+};
+
+// Parse infile, write the run file to outfile.  Returns false if the files could not be used.
+bool gcode_compile(char const *infile, char const *outfile, GcodeSettings const &settings, GcodeResult &result);
+
+#endif
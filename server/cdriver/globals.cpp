@@ -84,6 +84,9 @@ bool globals_load(int32_t &addr)
 		feedrate = 1;
 	max_deviation = read_float(addr);
 	max_v = read_float(addr);
+	run_file_horizon = read_float(addr);
+	if (isnan(run_file_horizon) || run_file_horizon < 0)
+		run_file_horizon = 0;
 	int ce = read_8(addr);
 	targetx = read_float(addr);
 	targety = read_float(addr);
@@ -122,6 +125,7 @@ bool globals_load(int32_t &addr)
 		fclose(store_adc);
 		store_adc = NULL;
 	}
+	probe_bicubic = read_8(addr);
 	ldebug("all done");
 	if (change_hw)
 		arch_motors_change();
@@ -145,9 +149,11 @@ void globals_save(int32_t &addr)
 	write_float(addr, feedrate);
 	write_float(addr, max_deviation);
 	write_float(addr, max_v);
+	write_float(addr, run_file_horizon);
 	write_8(addr, current_extruder);
 	write_float(addr, targetx);
 	write_float(addr, targety);
 	write_float(addr, zoffset);
 	write_8(addr, store_adc != NULL);
+	write_8(addr, probe_bicubic);
 }
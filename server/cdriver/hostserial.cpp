@@ -19,9 +19,9 @@
 #include "cdriver.h"
 
 void HostSerial::begin(int baud) {
-	pollfds[1].fd = 0;
-	pollfds[1].events = POLLIN | POLLPRI;
-	pollfds[1].revents = 0;
+	pollfds[POLL_HOST].fd = 0;
+	pollfds[POLL_HOST].events = POLLIN | POLLPRI;
+	pollfds[POLL_HOST].revents = 0;
 	start = 0;
 	end = 0;
 	fcntl(0, F_SETFL, O_NONBLOCK);
@@ -50,11 +50,11 @@ void HostSerial::refill() {
 			debug("read returned error: %s", strerror(errno));
 		end = 0;
 	}
-	if (end == 0 && pollfds[1].revents) {
+	if (end == 0 && pollfds[POLL_HOST].revents) {
 		debug("EOF detected on standard input; exiting.");
 		exit(0);
 	}
-	pollfds[1].revents = 0;
+	pollfds[POLL_HOST].revents = 0;
 }
 
 int HostSerial::read() {
@@ -41,7 +41,10 @@ void settemp(int which, double target) {
 		return;
 	}
 	temps[which].target[0] = target;
-	temps[which].adctarget[0] = temps[which].toadc(target, MAXINT);
+	temps[which].adctarget[0] = temps[which].toadc(temps[which].pid[0] > 0 ? target + TEMP_PID_BAND : target, MAXINT);
+	temps[which].pid_integral = 0;
+	temps[which].pid_last = NAN;
+	temp_control_update();
 	//debug("adc target %d from %f", temps[which].adctarget[0], temps[which].target[0]);
 	if (temps[which].adctarget[0] >= MAXINT) {
 		// main loop doesn't handle it anymore, so it isn't disabled there.
@@ -140,12 +143,106 @@ static void get_cb(bool value) {
 	send_host(CMD_PIN, value ? 1 : 0);
 }
 
+int line_size(unsigned char const *data, int available) { // {{{
+	// Returns the number of bytes queue_line will use for data, or -1 if that is more than available.
+	int num = 2;
+	for (int t = 0; t < NUM_SPACES; ++t)
+		num += spaces[t].num_axes;
+	int const offset = ((num - 1) >> 3) + 1;
+	if (available < offset)
+		return -1;
+	int t = 0;
+	for (int ch = 0; ch < num; ++ch) {
+		if (data[ch >> 3] & (1 << (ch & 0x7)))
+			++t;
+	}
+	int size = offset + t * sizeof(double);
+	return size <= available ? size : -1;
+} // }}}
+
+int queue_line(uint8_t cmd, unsigned char const *data) { // {{{
+	// data points at the channel bitmask of a CMD_LINE, CMD_SINGLE or CMD_PROBE; the values follow it.
+	// Returns the number of bytes that were used.
+	int num = 2;
+	for (int t = 0; t < NUM_SPACES; ++t)
+		num += spaces[t].num_axes;
+	queue[settings.queue_end].probe = cmd == CMD_PROBE;
+	queue[settings.queue_end].single = cmd == CMD_SINGLE;
+	int const offset = ((num - 1) >> 3) + 1;	// Bytes from start of data where values are.
+	int t = 0;
+	for (int ch = 0; ch < num; ++ch)
+	{
+		if (data[ch >> 3] & (1 << (ch & 0x7)))
+		{
+			ReadFloat f;
+			for (int i = 0; i < sizeof(double); ++i)
+				f.b[i] = data[offset + i + t * sizeof(double)];
+			if (ch < 2)
+				queue[settings.queue_end].f[ch] = f.f;
+			else
+				queue[settings.queue_end].data[ch - 2] = f.f;
+			//debug("line (%d) %d %f", settings.queue_end, ch, f.f);
+			initialized = true;
+			++t;
+		}
+		else {
+			if (ch < 2)
+				queue[settings.queue_end].f[ch] = NAN;
+			else
+				queue[settings.queue_end].data[ch - 2] = NAN;
+			//debug("line %d -", ch);
+		}
+	}
+	if (!(data[0] & 0x1) || isnan(queue[settings.queue_end].f[0]))
+		queue[settings.queue_end].f[0] = INFINITY;
+	if (!(data[0] & 0x2) || isnan(queue[settings.queue_end].f[1]))
+		queue[settings.queue_end].f[1] = queue[settings.queue_end].f[0];
+	// F0 and F1 must be valid.
+	double F0 = queue[settings.queue_end].f[0];
+	double F1 = queue[settings.queue_end].f[1];
+	if (isnan(F0) || isnan(F1) || (F0 == 0 && F1 == 0))
+	{
+		debug("Invalid F0 or F1: %f %f", F0, F1);
+		abort();
+		return offset + t * sizeof(double);
+	}
+	queue[settings.queue_end].cb = true;
+	queue[settings.queue_end].arc = false;
+	settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
+	if (settings.queue_end == settings.queue_start)
+		settings.queue_full = true;
+	return offset + t * sizeof(double);
+} // }}}
+
+void queue_start_move() { // {{{
+	if (!computing_move) {
+		//debug("starting move");
+		int num_movecbs = next_move();
+		if (num_movecbs > 0) {
+			if (arch_running()) {
+				cbs_after_current_move += num_movecbs;
+				//debug("adding %d cbs after current move to %d", num_movecbs, cbs_after_current_move);
+			}
+			else {
+				send_host(CMD_MOVECB, num_movecbs);
+				//debug("sent immediate %d cbs", num_movecbs);
+			}
+		}
+		//debug("no movecbs to add (prev %d)", history[(current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER].cbs);
+		buffer_refill();
+	}
+	//else
+	//	debug("waiting with move");
+} // }}}
+
 void packet()
 {
 	// command[0][0:1] is the length not including checksum bytes.
 	// command[0][2] is the command.
 	uint8_t which;
 	int32_t addr;
+	// Moves in the command ring were sent before this packet; read the doorbell, so all of them are taken first.
+	ring_doorbell();
 	switch (command[0][2])
 	{
 #ifdef SERIAL
@@ -185,76 +282,47 @@ void packet()
 			abort();
 			return;
 		}
-		int num = 2;
-		for (int t = 0; t < NUM_SPACES; ++t)
-			num += spaces[t].num_axes;
-		queue[settings.queue_end].probe = command[0][2] == CMD_PROBE;
-		queue[settings.queue_end].single = command[0][2] == CMD_SINGLE;
-		int const offset = 3 + ((num - 1) >> 3) + 1;	// Bytes from start of command where values are.
-		int t = 0;
-		for (int ch = 0; ch < num; ++ch)
-		{
-			if (command[0][3 + (ch >> 3)] & (1 << (ch & 0x7)))
-			{
-				ReadFloat f;
-				for (int i = 0; i < sizeof(double); ++i)
-					f.b[i] = command[0][offset + i + t * sizeof(double)];
-				if (ch < 2)
-					queue[settings.queue_end].f[ch] = f.f;
-				else
-					queue[settings.queue_end].data[ch - 2] = f.f;
-				//debug("line (%d) %d %f", settings.queue_end, ch, f.f);
-				initialized = true;
-				++t;
-			}
-			else {
-				if (ch < 2)
-					queue[settings.queue_end].f[ch] = NAN;
-				else
-					queue[settings.queue_end].data[ch - 2] = NAN;
-				//debug("line %d -", ch);
-			}
-		}
-		if (!(command[0][3] & 0x1) || isnan(queue[settings.queue_end].f[0]))
-			queue[settings.queue_end].f[0] = INFINITY;
-		if (!(command[0][3] & 0x2) || isnan(queue[settings.queue_end].f[1]))
-			queue[settings.queue_end].f[1] = queue[settings.queue_end].f[0];
-		// F0 and F1 must be valid.
-		double F0 = queue[settings.queue_end].f[0];
-		double F1 = queue[settings.queue_end].f[1];
-		if (isnan(F0) || isnan(F1) || (F0 == 0 && F1 == 0))
-		{
-			debug("Invalid F0 or F1: %f %f", F0, F1);
-			abort();
-			return;
-		}
-		queue[settings.queue_end].cb = true;
-		queue[settings.queue_end].arc = false;
-		settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
-		if (settings.queue_end == settings.queue_start) {
-			settings.queue_full = true;
+		queue_line(command[0][2], &command[0][3]);
+		if (settings.queue_full)
 			serialdev[0]->write(WAIT);
-		}
 		else
 			serialdev[0]->write(OK);
-		if (!computing_move) {
-			//debug("starting move");
-			int num_movecbs = next_move();
-			if (num_movecbs > 0) {
-				if (arch_running()) {
-					cbs_after_current_move += num_movecbs;
-					//debug("adding %d cbs after current move to %d", num_movecbs, cbs_after_current_move);
-				}
-				else {
-					send_host(CMD_MOVECB, num_movecbs);
-					//debug("sent immediate %d cbs", num_movecbs);
-				}
+		queue_start_move();
+		break;
+	}
+	case CMD_LINES:	// Many lines in one packet.
+	{
+#ifdef DEBUG_CMD
+		debug("CMD_LINES");
+#endif
+		last_active = millis();
+		int len = (command[0][0] << 8) | command[0][1];
+		// Check all records before queueing any of them.
+		for (int pos = 3; pos < len; ) {
+			uint8_t type = command[0][pos];
+			if (type != CMD_LINE && type != CMD_SINGLE && type != CMD_PROBE) {
+				debug("Invalid command %x in CMD_LINES", type);
+				abort();
+				return;
 			}
-			//debug("no movecbs to add (prev %d)", history[(current_fragment - 1 + FRAGMENTS_PER_BUFFER) % FRAGMENTS_PER_BUFFER].cbs);
-			buffer_refill();
-		}
-		//else
-		//	debug("waiting with move");
+			int size = line_size(&command[0][pos + 1], len - pos - 1);
+			if (size < 0) {
+				debug("Truncated line at %d in CMD_LINES of length %d", pos, len);
+				abort();
+				return;
+			}
+			pos += 1 + size;
+		}
+		int pos = 3;
+		int accepted = 0;
+		while (pos < len && !settings.queue_full) {
+			pos += 1 + queue_line(command[0][pos], &command[0][pos + 1]);
+			++accepted;
+		}
+		// Moves which were not accepted must be sent again after CMD_CONTINUE.
+		send_host(CMD_ACCEPTED, accepted, settings.queue_full);
+		if (accepted > 0)
+			queue_start_move();
 		break;
 	}
 	case CMD_RUN_FILE: // Run commands from a file.
@@ -268,8 +336,11 @@ void packet()
 			for (int j = 0; j < 2; ++j)
 				args[j].b[i] = command[0][4 + i + j * sizeof(double)];
 		}
-		int namelen = (((command[0][0] & 0xff) << 8) | (command[0][1] & 0xff)) - 22 - command[0][21];
-		run_file(namelen, reinterpret_cast<char const *>(&command[0][22]), command[0][21], reinterpret_cast<char const *>(&command[0][22 + namelen]), command[0][3], args[0].f, args[1].f, uint8_t(command[0][20]) == 0xff ? -1 : command[0][20]);
+		ReadFloat first;
+		for (int i = 0; i < 4; ++i)
+			first.b[i] = command[0][22 + i];
+		int namelen = (((command[0][0] & 0xff) << 8) | (command[0][1] & 0xff)) - 26 - command[0][21];
+		run_file(namelen, reinterpret_cast<char const *>(&command[0][26]), command[0][21], reinterpret_cast<char const *>(&command[0][26 + namelen]), command[0][3], args[0].f, args[1].f, uint8_t(command[0][20]) == 0xff ? -1 : command[0][20], first.ui);
 		break;
 	}
 	case CMD_SLEEP:	// Enable or disable motor current
@@ -643,7 +714,7 @@ void packet()
 		debug("CMD_QUEUED");
 #endif
 		last_active = millis();
-		send_host(CMD_QUEUE, settings.queue_full ? QUEUE_LENGTH : (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH);
+		send_host(CMD_QUEUE, (settings.queue_full ? QUEUE_LENGTH : (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH) + ring_pending());
 		if (command[0][3]) {
 			if (run_file_map)
 				run_file_wait += 1;
@@ -652,9 +723,11 @@ void packet()
 				cbs_after_current_move = 0;
 			}
 			arch_stop();
+			probe_grid_abort();
 			settings.queue_start = 0;
 			settings.queue_end = 0;
 			settings.queue_full = false;
+			ring_discard();
 		}
 		return;
 	}
@@ -742,6 +815,24 @@ void packet()
 		run_adjust_probe(pos[0], pos[1], pos[2]);
 		return;
 	}
+	case CMD_PROBE_GRID:
+	{
+#ifdef DEBUG_CMD
+		debug("CMD_PROBE_GRID");
+#endif
+		last_active = millis();
+		double arg[9];
+		for (int i = 0; i < 9; ++i)
+			arg[i] = get_float(3 + i * sizeof(double));
+		ReadFloat n[3];
+		for (int i = 0; i < 3; ++i) {
+			for (int j = 0; j < 4; ++j)
+				n[i].b[j] = command[0][3 + 9 * sizeof(double) + i * 4 + j];
+		}
+		int namelen = (((command[0][0] & 0xff) << 8) | (command[0][1] & 0xff)) - (3 + 9 * sizeof(double) + 3 * 4);
+		probe_grid_start(namelen, reinterpret_cast <char const *>(&command[0][3 + 9 * sizeof(double) + 3 * 4]), arg[0], arg[1], arg[2], arg[3], arg[4], arg[5], n[0].ui, n[1].ui, arg[6], arg[7], arg[8], n[2].ui);
+		return;
+	}
 	default:
 	{
 		debug("Invalid command %x %x %x %x", command[0][0], command[0][1], command[0][2], command[0][3]);
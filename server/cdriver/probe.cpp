@@ -0,0 +1,259 @@
+/* probe.cpp - probing a bed map for Franklin
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cdriver.h"
+#include <fcntl.h>
+
+// This does the same as Printer._do_probe in driver.py, without a round trip to the host for every point.
+// Points are visited in rows, alternating direction.  Every point is probed num_probes times: probe down to z_low,
+// record the position, retract by safe_dist.  The result is the trimmed mean.  When all points are done, the map is
+// written as a ProbeFile and PROBE_DONE is sent.
+
+enum ProbePhase {
+	PROBE_IDLE,
+	PROBE_MOVE,	// Move to the point.
+	PROBE_DOWN,	// Probe down.
+	PROBE_RECORD,	// Record the result and retract.
+};
+
+static ProbePhase probe_phase = PROBE_IDLE;
+static char probe_grid_name[256];
+static ProbeFile *probe_grid;
+static double *probe_tries;
+static int probe_num, probe_num_tries;
+static unsigned long probe_ix, probe_iy;
+static double probe_z, probe_z_low, probe_speed, probe_safe_dist;
+static bool probe_hit;
+
+static bool probe_idle() { // {{{
+	return !computing_move && !sending_fragment && !transmitting_fragment && !stopping && !arch_running() && settings.queue_start == settings.queue_end && !settings.queue_full;
+} // }}}
+
+static double probe_current_z() { // {{{
+	// Same as CMD_GETPOS, but zoffset is included.
+	Space &sp = spaces[0];
+	if (isnan(sp.axis[2]->settings.source)) {
+		space_types[sp.type].reset_pos(&sp);
+		for (int a = 0; a < sp.num_axes; ++a)
+			sp.axis[a]->settings.current = sp.axis[a]->settings.source;
+	}
+	double value = sp.axis[2]->settings.current;
+	for (int s = 0; s < NUM_SPACES; ++s)
+		value = space_types[spaces[s].type].unchange0(&spaces[s], 2, value);
+	return value;
+} // }}}
+
+static void probe_queue(double x, double y, double z, double f, bool probe) { // {{{
+	MoveCommand &q = queue[settings.queue_end];
+	q.cb = false;
+	q.probe = probe;
+	q.single = false;
+	q.arc = false;
+	q.f[0] = f;
+	q.f[1] = f;
+	int num = 0;
+	for (int s = 0; s < NUM_SPACES; ++s)
+		num += spaces[s].num_axes;
+	for (int i = 0; i < num; ++i)
+		q.data[i] = NAN;
+	q.data[0] = x;
+	q.data[1] = y;
+	q.data[2] = z;
+	q.time = 0;
+	q.dist = 0;
+	settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
+	if (settings.queue_end == settings.queue_start)
+		settings.queue_full = true;
+	queue_start_move();
+} // }}}
+
+static void probe_free() { // {{{
+	probe_phase = PROBE_IDLE;
+	free(probe_grid);
+	probe_grid = NULL;
+	free(probe_tries);
+	probe_tries = NULL;
+} // }}}
+
+static void probe_finish() { // {{{
+	probe_free();
+	send_host(CMD_PROBE_DONE, 1);
+} // }}}
+
+static void probe_fail(int reason = 0) { // {{{
+	// Reason is 0 for an error or limit hit, 2 if the probe did not hit anything.
+	probe_free();
+	send_host(CMD_PROBE_DONE, reason);
+} // }}}
+
+static bool probe_write() { // {{{
+	ProbeFile *p = probe_grid;
+	int fd = open(probe_grid_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		debug("Failed to open probe file '%s': %s", probe_grid_name, strerror(errno));
+		return false;
+	}
+	// The file is used with the same target as it was probed with; only rotation is done by cdriver.
+	double x = p->cosa * p->x - p->sina * p->y + targetx;
+	double y = p->cosa * p->y + p->sina * p->x + targety;
+	ProbeFile header = *p;
+	header.x = p->cosa * x + p->sina * y;
+	header.y = p->cosa * y - p->sina * x;
+	size_t size = (p->nx + 1) * (p->ny + 1) * sizeof(double);
+	bool ok = write(fd, &header, sizeof(ProbeFile)) == sizeof(ProbeFile) && write(fd, p->sample, size) == ssize_t(size);
+	if (!ok)
+		debug("Failed to write probe file '%s'", probe_grid_name);
+	close(fd);
+	return ok;
+} // }}}
+
+void probe_grid_start(int name_len, char const *name, double x, double y, double w, double h, double sina, double cosa, unsigned long nx, unsigned long ny, double speed, double safe_dist, double z_low, int num_probes) { // {{{
+	if (probe_phase != PROBE_IDLE) {
+		debug("Probe grid requested while probing");
+		probe_fail();
+		return;
+	}
+	if (run_file_map || !motors_busy || spaces[0].num_axes < 3 || !probe_pin.valid() || !probe_idle()) {
+		debug("Probe grid requested while not ready");
+		send_host(CMD_PROBE_DONE, 0);
+		return;
+	}
+	if (name_len <= 0 || name_len >= int(sizeof(probe_grid_name)) || nx < 1 || ny < 1 || nx > PROBE_MAX_SIZE || ny > PROBE_MAX_SIZE || num_probes < 1 || !(safe_dist > 0) || !(speed > 0)) {
+		debug("Invalid probe grid request");
+		send_host(CMD_PROBE_DONE, 0);
+		return;
+	}
+	probe_grid = reinterpret_cast <ProbeFile *>(malloc(sizeof(ProbeFile) + (nx + 1) * (ny + 1) * sizeof(double)));
+	probe_tries = reinterpret_cast <double *>(malloc(num_probes * sizeof(double)));
+	if (!probe_grid || !probe_tries) {
+		debug("Out of memory for probe grid");
+		probe_fail();
+		return;
+	}
+	memcpy(probe_grid_name, name, name_len);
+	probe_grid_name[name_len] = '\0';
+	probe_grid->x = x;
+	probe_grid->y = y;
+	probe_grid->w = w;
+	probe_grid->h = h;
+	probe_grid->sina = sina;
+	probe_grid->cosa = cosa;
+	probe_grid->nx = nx;
+	probe_grid->ny = ny;
+	probe_ix = 0;
+	probe_iy = 0;
+	probe_num = num_probes;
+	probe_num_tries = 0;
+	probe_z = probe_current_z() - zoffset;
+	probe_z_low = z_low;
+	probe_speed = speed;
+	probe_safe_dist = safe_dist;
+	probe_phase = PROBE_MOVE;
+	probe_grid_tick();
+} // }}}
+
+void probe_grid_tick() { // {{{
+	if (probe_phase == PROBE_IDLE || !probe_idle())
+		return;
+	ProbeFile *p = probe_grid;
+	switch (probe_phase) {
+	case PROBE_MOVE:
+	{
+		if (probe_iy > p->ny) {
+			if (probe_write())
+				probe_finish();
+			else
+				probe_fail();
+			return;
+		}
+		double px = p->x + p->w * probe_ix / p->nx;
+		double py = p->y + p->h * probe_iy / p->ny;
+		probe_phase = PROBE_DOWN;
+		probe_queue(targetx + px * p->cosa - py * p->sina, targety + py * p->cosa + px * p->sina, NAN, INFINITY, false);
+		return;
+	}
+	case PROBE_DOWN:
+		probe_hit = false;
+		probe_phase = PROBE_RECORD;
+		probe_queue(NAN, NAN, probe_z_low, probe_z > probe_z_low ? probe_speed / (probe_z - probe_z_low) : INFINITY, true);
+		return;
+	case PROBE_RECORD:
+	{
+		if (!probe_hit) {
+			// Recording z_low would corrupt the map.
+			debug("Probe did not hit anything at point %lu, %lu; aborting probe grid", probe_ix, probe_iy);
+			probe_fail(2);
+			return;
+		}
+		double z = probe_current_z();
+		probe_tries[probe_num_tries++] = z;
+		if (probe_num_tries >= probe_num) {
+			// Trimmed mean.
+			for (int i = 1; i < probe_num; ++i) {
+				double v = probe_tries[i];
+				int j;
+				for (j = i; j > 0 && probe_tries[j - 1] > v; --j)
+					probe_tries[j] = probe_tries[j - 1];
+				probe_tries[j] = v;
+			}
+			int trash = probe_num / 3;
+			double sum = 0;
+			for (int i = trash; i < probe_num - trash; ++i)
+				sum += probe_tries[i];
+			p->sample[probe_iy * (p->nx + 1) + probe_ix] = sum / (probe_num - 2 * trash);
+			probe_num_tries = 0;
+			if (probe_iy & 1) {
+				if (probe_ix == 0)
+					probe_iy += 1;
+				else
+					probe_ix -= 1;
+			}
+			else {
+				if (probe_ix == p->nx)
+					probe_iy += 1;
+				else
+					probe_ix += 1;
+			}
+		}
+		probe_z = z - zoffset + probe_safe_dist;
+		probe_phase = PROBE_MOVE;
+		probe_queue(NAN, NAN, probe_z, INFINITY, false);
+		return;
+	}
+	default:
+		return;
+	}
+} // }}}
+
+void probe_grid_limit(int s) { // {{{
+	// Called when a limit is reported to the host; s is -1 for the probe pin.
+	if (probe_phase == PROBE_IDLE)
+		return;
+	if (s < 0 && probe_phase == PROBE_RECORD) {
+		probe_hit = true;
+		return;
+	}
+	debug("Limit hit during probe grid; aborting");
+	probe_fail();
+} // }}}
+
+void probe_grid_abort() { // {{{
+	// The host stopped the queue.
+	probe_free();
+} // }}}
@@ -0,0 +1,132 @@
+/* ring.cpp - shared memory command ring for Franklin
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cdriver.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+
+// The driver can send moves through a ring in shared memory instead of the serial protocol.
+// Moves from the ring are not acknowledged, so they don't need a round trip each.
+// The driver creates an eventfd and passes it in FRANKLIN_DOORBELL.  Writing n to it announces n new records.
+// If RING_WAITING is added to the value, the driver waits for CMD_CONTINUE, which is sent when the ring is empty.
+// Only the doorbell is used to learn about new records; this makes sure their contents are visible when they are read.
+
+void ring_setup() { // {{{
+	command_ring = NULL;
+	ring_head = 0;
+	ring_waiting = false;
+	pollfds[POLL_DOORBELL].fd = -1;
+	pollfds[POLL_DOORBELL].events = POLLIN | POLLPRI;
+	pollfds[POLL_DOORBELL].revents = 0;
+	char const *doorbell = getenv("FRANKLIN_DOORBELL");
+	if (!doorbell)
+		return;
+	int bell = atoi(doorbell);
+	char name[32];
+	snprintf(name, sizeof(name), "/franklin-ring-%d", getpid());
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		debug("unable to create command ring; using serial protocol for moves");
+		return;
+	}
+	if (ftruncate(fd, sizeof(CommandRing)) < 0) {
+		debug("unable to set size of command ring; using serial protocol for moves");
+		close(fd);
+		shm_unlink(name);
+		return;
+	}
+	void *map = mmap(NULL, sizeof(CommandRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		debug("unable to map command ring; using serial protocol for moves");
+		shm_unlink(name);
+		return;
+	}
+	fcntl(bell, F_SETFL, O_NONBLOCK);
+	command_ring = reinterpret_cast <CommandRing *>(map);
+	command_ring->slots = RING_SLOTS;
+	command_ring->slot_size = RING_SLOT_SIZE;
+	command_ring->tail = 0;
+	__atomic_store_n(&command_ring->version, RING_VERSION, __ATOMIC_RELEASE);
+	pollfds[POLL_DOORBELL].fd = bell;
+} // }}}
+
+static void ring_read_doorbell() { // {{{
+	uint64_t value;
+	if (read(pollfds[POLL_DOORBELL].fd, &value, sizeof(value)) != sizeof(value)) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			debug("unable to read doorbell: %s", strerror(errno));
+		return;
+	}
+	ring_head += uint32_t(value);
+	if (value >= RING_WAITING)
+		ring_waiting = true;
+} // }}}
+
+void ring_doorbell() { // {{{
+	if (!command_ring)
+		return;
+	ring_read_doorbell();
+	ring_drain();
+} // }}}
+
+void ring_drain() { // {{{
+	if (!command_ring || host_block)
+		return;
+	uint32_t tail = command_ring->tail;
+	bool queued = false;
+	while (tail != ring_head) {
+		// Leave one place in the queue, so a CMD_LINE from the serial protocol always fits.
+		if (settings.queue_full || (settings.queue_end + 1) % QUEUE_LENGTH == settings.queue_start)
+			break;
+		unsigned char *slot = command_ring->slot[tail % RING_SLOTS];
+		if (slot[0] == CMD_LINE || slot[0] == CMD_SINGLE || slot[0] == CMD_PROBE) {
+			queue_line(slot[0], &slot[1]);
+			queued = true;
+		}
+		else
+			debug("ignoring invalid command %x in command ring", slot[0]);
+		++tail;
+	}
+	__atomic_store_n(&command_ring->tail, tail, __ATOMIC_RELEASE);
+	if (queued) {
+		last_active = millis();
+		queue_start_move();
+	}
+	if (ring_waiting && tail == ring_head) {
+		ring_waiting = false;
+		send_host(CMD_CONTINUE, 0);
+	}
+} // }}}
+
+void ring_discard() { // {{{
+	if (!command_ring)
+		return;
+	ring_read_doorbell();
+	__atomic_store_n(&command_ring->tail, ring_head, __ATOMIC_RELEASE);
+	ring_waiting = false;
+} // }}}
+
+int ring_pending() { // {{{
+	// Number of records that are in the ring, but not yet in the queue.
+	if (!command_ring)
+		return 0;
+	ring_read_doorbell();
+	return ring_head - command_ring->tail;
+} // }}}
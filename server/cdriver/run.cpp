@@ -19,6 +19,10 @@
 #include "cdriver.h"
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <spawn.h>
+#include <fcntl.h>
 
 #if 0
 #define rundebug debug
@@ -26,26 +30,429 @@
 #define rundebug(...) do {} while(0)
 #endif
 
-static int read_num(off_t offset) {
-	int ret = 0;
-	uint8_t const *map = reinterpret_cast<uint8_t const *>(run_file_map);
-	for (int i = 0; i < 4; ++i)
-		ret |= (map[offset + i]) << (8 * i);
-	return ret;
-}
+static Run_Record run_preline;
+static Run_Record run_last;	// Last queued move, with X and Y in machine coordinates.
+
+static bool run_file_complete;
+static pid_t run_file_system;	// System command which the run file is waiting for.
+static pid_t *run_children;	// System commands which have not been reaped yet.
+static int run_num_children, run_children_size;
+#define RUN_FILE_FOLLOW_NS 20000000
+#define RUN_FILE_MIN_QUEUE 4	// Queue at least this many moves, regardless of run_file_horizon.
+#define RUN_PROBE_MAX_SPLIT 64	// Maximum number of probe grid crossings which are handled in one line.
 
-struct String {
-	int len;
-	off_t start;
+// Compact encoding; see runfile.h.  Records are decoded one block at a time.
+struct BlockEntry {
+	uint32_t first;		// Number of the first record in the block.
+	uint32_t num_records;
+	off_t offset;		// Offset of the Run_Block in the file.
 };
 
-static String *strings;
+static uint32_t run_file_encoding;
+static BlockEntry *blocks;
+static int num_blocks, blocks_size;
+static off_t blocks_end;	// Offset of the next block.
+static uint32_t blocks_records;	// Number of records in the known blocks.
+static Run_Record *block_records;
+static int block_records_size;
+static int current_block;
 
-static Run_Record run_preline;
+static bool decode_block(int b) { // {{{
+	BlockEntry &entry = blocks[b];
+	if (int(entry.num_records) > block_records_size) {
+		Run_Record *records = reinterpret_cast <Run_Record *>(realloc(block_records, entry.num_records * sizeof(Run_Record)));
+		if (!records) {
+			debug("Out of memory for decoding run file");
+			return false;
+		}
+		block_records = records;
+		block_records_size = entry.num_records;
+	}
+	Run_Block const *header = reinterpret_cast <Run_Block const *>(reinterpret_cast <char const *>(run_file_map) + entry.offset);
+	uint8_t const *p = reinterpret_cast <uint8_t const *>(&header[1]);
+	uint8_t const *end = p + header->size;
+	double field[2][RUN_FIELDS];
+	for (int i = 0; i < RUN_FIELDS; ++i) {
+		field[0][i] = 0;
+		field[1][i] = 0;
+	}
+	uint32_t r = 0;
+	while (r < entry.num_records) {
+		if (end - p < 4) {
+			debug("Invalid block %d in run file '%s'", b, run_file_name);
+			return false;
+		}
+		Run_Record &record = block_records[r++];
+		record.type = p[0];
+		uint32_t flags = p[1] | (p[2] << 8) | (p[3] << 16);
+		p += 4;
+		double value[RUN_FIELDS];
+		for (int i = 0; i < RUN_FIELDS; ++i) {
+			double prev = field[0][i];
+			switch ((flags >> (2 * i)) & 3) {
+			case RUN_SAME:
+				value[i] = prev;
+				break;
+			case RUN_PREDICT:
+				value[i] = run_predict(i, value, field);
+				break;
+			case RUN_FIXED:
+			{
+				uint64_t z = 0;
+				for (int shift = 0; ; shift += 7) {
+					if (p >= end || shift >= 64) {
+						debug("Invalid record in block %d in run file '%s'", b, run_file_name);
+						return false;
+					}
+					z |= uint64_t(*p & 0x7f) << shift;
+					if (!(*p++ & 0x80))
+						break;
+				}
+				int64_t d = int64_t(z >> 1) ^ -int64_t(z & 1);
+				value[i] = i == 0 ? prev + d : double(llround(prev * RUN_FIXED_SCALE) + d) / RUN_FIXED_SCALE;
+				break;
+			}
+			case RUN_RAW:
+				if (end - p < (i == 0 ? 4 : 8)) {
+					debug("Invalid record in block %d in run file '%s'", b, run_file_name);
+					return false;
+				}
+				if (i == 0) {
+					int32_t tool;
+					memcpy(&tool, p, sizeof(tool));
+					value[i] = tool;
+					p += sizeof(tool);
+				}
+				else {
+					memcpy(&value[i], p, sizeof(double));
+					p += sizeof(double);
+				}
+				break;
+			}
+			field[1][i] = prev;
+			field[0][i] = value[i];
+		}
+		record.tool = value[0];
+		record.X = value[1];
+		record.Y = value[2];
+		record.Z = value[3];
+		record.E = value[4];
+		record.f = value[5];
+		record.F = value[6];
+		record.time = value[7];
+		record.dist = value[8];
+		if (record.type == RUN_SYSTEM || record.type == RUN_CONFIRM) {
+			if (record.tool < 0 || end - p < record.tool) {
+				debug("Invalid string in block %d in run file '%s'", b, run_file_name);
+				return false;
+			}
+			int slots = run_string_records(record.tool);
+			if (r + slots > entry.num_records) {
+				debug("Invalid string in block %d in run file '%s'", b, run_file_name);
+				return false;
+			}
+			memset(&block_records[r], 0, slots * sizeof(Run_Record));
+			memcpy(&block_records[r], p, record.tool);
+			p += record.tool;
+			r += slots;
+		}
+	}
+	current_block = b;
+	return true;
+} // }}}
+
+static void run_file_damaged() { // {{{
+	// Stop the job and tell the host, instead of skipping the bad part.
+	debug("Run file '%s' is damaged; aborting it", run_file_name);
+	send_host(CMD_FILE_DONE, 1);
+	abort_run_file();
+} // }}}
+
+static Run_Record &run_record(int n) { // {{{
+	// If the record cannot be decoded, the run file is aborted; callers must check run_file_map.
+	if (run_file_encoding == RUN_ENCODING_PLAIN)
+		return reinterpret_cast <Run_Record *>(reinterpret_cast <char *>(run_file_map) + sizeof(Run_Header))[n];
+	if (current_block < 0 || uint32_t(n) < blocks[current_block].first || uint32_t(n) >= blocks[current_block].first + blocks[current_block].num_records) {
+		int low = 0, high = num_blocks;
+		while (high - low > 1) {
+			int mid = (low + high) / 2;
+			if (blocks[mid].first <= uint32_t(n))
+				low = mid;
+			else
+				high = mid;
+		}
+		if (!decode_block(low)) {
+			current_block = -1;
+			run_file_damaged();
+			// Return a record that does nothing; it is not used, because the file is no longer running.
+			static Run_Record invalid;
+			invalid.type = RUN_PRE_LINE;
+			invalid.tool = -1;
+			invalid.X = invalid.Y = invalid.Z = invalid.E = NAN;
+			return invalid;
+		}
+	}
+	return block_records[n - blocks[current_block].first];
+} // }}}
+
+static bool run_string_valid(int n, Run_Record const &r) {
+	// Check that the string of record n fits in the file.
+	if (r.tool >= 0 && n + 1 + run_string_records(r.tool) <= run_file_num_records)
+		return true;
+	run_file_damaged();
+	return false;
+}
+
+static char const *run_string(int n, int len) {
+	// The string of the record before n.  It is always in the same block, so this doesn't invalidate the record.
+	if (len == 0)
+		return "";
+	return reinterpret_cast <char const *>(&run_record(n));
+}
+
+static bool run_file_extend(off_t size) {
+	if (size <= run_file_size)
+		return true;
+	void *map = mremap(run_file_map, run_file_size, size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+		debug("Failed to extend map of run file '%s': %s", run_file_name, strerror(errno));
+		return false;
+	}
+	run_file_map = map;
+	run_file_size = size;
+	return true;
+}
+
+static bool run_file_update() {
+	// Pick up records which have been written since the last call.  Returns false if the mapping could not be extended.
+	Run_Header volatile *header = reinterpret_cast <Run_Header volatile *>(run_file_map);
+	bool complete = header->complete;
+	__sync_synchronize();
+	uint32_t num = header->num_records;
+	if (run_file_encoding == RUN_ENCODING_PLAIN) {
+		if (!run_file_extend(sizeof(Run_Header) + off_t(num) * sizeof(Run_Record)))
+			return false;
+	}
+	else {
+		while (blocks_records < num) {
+			if (!run_file_extend(blocks_end + sizeof(Run_Block)))
+				return false;
+			Run_Block const *block = reinterpret_cast <Run_Block const *>(reinterpret_cast <char const *>(run_file_map) + blocks_end);
+			uint32_t size = block->size;
+			uint32_t records = block->num_records;
+			if (!run_file_extend(blocks_end + sizeof(Run_Block) + size))
+				return false;
+			if (num_blocks >= blocks_size) {
+				int new_size = blocks_size > 0 ? blocks_size * 2 : 64;
+				BlockEntry *new_blocks = reinterpret_cast <BlockEntry *>(realloc(blocks, new_size * sizeof(BlockEntry)));
+				if (!new_blocks) {
+					debug("Out of memory for run file blocks");
+					return false;
+				}
+				blocks = new_blocks;
+				blocks_size = new_size;
+			}
+			blocks[num_blocks].first = blocks_records;
+			blocks[num_blocks].num_records = records;
+			blocks[num_blocks].offset = blocks_end;
+			num_blocks += 1;
+			blocks_end += sizeof(Run_Block) + size;
+			blocks_records += records;
+		}
+	}
+	run_file_num_records = num;
+	run_file_complete = complete;
+	return true;
+}
+
+static void run_gpio(Run_Record const &r) {
+	int tool = r.tool;
+	if (tool == -2)
+		tool = fan_id != 255 ? fan_id : -1;
+	else if (tool == -3)
+		tool = spindle_id != 255 ? spindle_id : -1;
+	if (tool < 0 || tool >= num_gpios) {
+		if (tool != -1)
+			debug("cannot set invalid gpio %d", tool);
+		return;
+	}
+	if (r.X) {
+		gpios[tool].state = 1;
+		SET(gpios[tool].pin);
+	}
+	else {
+		gpios[tool].state = 0;
+		RESET(gpios[tool].pin);
+	}
+	send_host(CMD_UPDATE_PIN, tool, gpios[tool].state);
+}
+
+static void run_settemp(Run_Record const &r) {
+	int tool = r.tool;
+	if (tool == -1)
+		tool = bed_id != 255 ? bed_id : -1;
+	rundebug("settemp %d %f", tool, r.X);
+	settemp(tool, r.X);
+	send_host(CMD_UPDATE_TEMP, tool, 0, r.X);
+}
+
+static bool run_file_seek(int first) {
+	// Restore the state of the last snapshot before record first, then replay the records up to first without
+	// moving, so fans, gpios, temperatures and the extruder position are as they would be at first.  If first follows
+	// PRE_LINE or PRE_ARC records, the run starts at those instead, because they are part of the move at first.
+	Run_Header const *header = reinterpret_cast <Run_Header const *>(run_file_map);
+	if (!run_file_complete) {
+		debug("Run file '%s' is not complete; cannot start at record %d", run_file_name, first);
+		return false;
+	}
+	int size = run_snapshot_size(header->num_temps);
+	int num = header->index_size;
+	if (num == 0) {
+		debug("Run file '%s' has no index; cannot start at record %d", run_file_name, first);
+		return false;
+	}
+	if (!run_file_extend(header->index_offset + off_t(num) * size))
+		return false;
+	header = reinterpret_cast <Run_Header const *>(run_file_map);
+	char const *index = reinterpret_cast <char const *>(run_file_map) + header->index_offset;
+#define SNAPSHOT(n) reinterpret_cast <Run_Snapshot const *>(index + (n) * size)
+	int k = min(first / RUN_INDEX_INTERVAL, num - 1);
+	while (k > 0 && int(SNAPSHOT(k)->record) >= first)
+		--k;
+	while (k + 1 < num && int(SNAPSHOT(k + 1)->record) < first)
+		++k;
+	Run_Snapshot const *s = SNAPSHOT(k);
+#undef SNAPSHOT
+	settings.run_file_current = s->record;
+	settings.run_time = s->time;
+	settings.run_dist = s->dist;
+	for (int t = 0; t <= int(header->num_temps); ++t) {
+		if (isnan(s->temp[t]))
+			continue;
+		int tool = t == 0 ? (bed_id != 255 ? bed_id : -1) : t - 1;
+		if (tool < 0 || tool >= num_temps)
+			continue;
+		settemp(tool, s->temp[t]);
+		send_host(CMD_UPDATE_TEMP, tool, 0, s->temp[t]);
+	}
+	// The extruder position of the last move is only set when it changes tool, or at the end.
+	int tool = s->tool;
+	double E = s->E;
+	int resume = first;
+	for (int n = s->record; n < first && n < run_file_num_records; ++n) {
+		Run_Record const &r = run_record(n);
+		if (!run_file_map)
+			return false;
+		if (r.type != RUN_PRE_LINE && r.type != RUN_PRE_ARC)
+			resume = first;
+		else if (resume == first)
+			resume = n;
+		switch (r.type) {
+			case RUN_SYSTEM:
+			case RUN_CONFIRM:
+				// Skip the string; the command or question was handled when the record was first run.
+				if (!run_string_valid(n, r))
+					return false;
+				n += run_string_records(r.tool);
+				break;
+			case RUN_LINE:
+			case RUN_ARC:
+				if (r.tool != tool && tool >= 0 && tool < spaces[1].num_axes && !isnan(E))
+					setpos(1, tool, E);
+				tool = r.tool;
+				if (!isnan(r.E))
+					E = r.E;
+				settings.run_time = r.time;
+				settings.run_dist = r.dist;
+				break;
+			case RUN_GPIO:
+				run_gpio(r);
+				break;
+			case RUN_SETTEMP:
+				run_settemp(r);
+				break;
+			case RUN_SETPOS:
+				if (r.tool == tool)
+					E = r.X;
+				else if (r.tool >= 0 && r.tool < spaces[1].num_axes)
+					setpos(1, r.tool, r.X);
+				break;
+			default:
+				// Other records don't change state that is kept after them.
+				break;
+		}
+	}
+	if (tool >= 0 && tool < spaces[1].num_axes && !isnan(E))
+		setpos(1, tool, E);
+	settings.run_file_current = resume;
+	debug("Starting run file at record %d", settings.run_file_current);
+	return true;
+}
 
 static double probe_adjust;
 
-void run_file(int name_len, char const *name, int probe_name_len, char const *probename, bool start, double sina, double cosa, int audio) {
+// Probe map interpolation.  Every cell of the grid has a polynomial in the fractions fx and fy within the cell:
+// z = sum c[i][j] * fx^i * fy^j.  The coefficients are computed when the probe file is mapped.
+struct ProbeCell {
+	double c[4][4];
+};
+static ProbeCell *probe_cells;
+static int probe_cx, probe_cy;	// Number of cells.
+static int probe_ix, probe_iy;	// Last used cell.
+
+static bool probe_setup() { // {{{
+	ProbeFile *&p = probe_file_map;
+	if (p->nx > PROBE_MAX_SIZE || p->ny > PROBE_MAX_SIZE || ((p->nx + 1) * (p->ny + 1)) * sizeof(double) + sizeof(ProbeFile) != size_t(probe_file_size)) {
+		debug("Invalid probe file '%s'", probe_file_name);
+		return false;
+	}
+	// A grid without cells in a direction is handled as one cell with the same samples on both sides.
+	probe_cx = max(int(p->nx), 1);
+	probe_cy = max(int(p->ny), 1);
+	probe_ix = 0;
+	probe_iy = 0;
+	probe_cells = reinterpret_cast <ProbeCell *>(malloc(probe_cx * probe_cy * sizeof(ProbeCell)));
+	if (!probe_cells) {
+		debug("Out of memory for probe map");
+		return false;
+	}
+	// Rows convert the samples at -1, 0, 1 and 2 to polynomial coefficients: Catmull-Rom for bicubic, or linear.
+	static double const bicubic[4][4] = {{0, 1, 0, 0}, {-.5, 0, .5, 0}, {1, -2.5, 2, -.5}, {-.5, 1.5, -1.5, .5}};
+	static double const bilinear[4][4] = {{0, 1, 0, 0}, {0, -1, 1, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}};
+	double const (*m)[4] = probe_bicubic ? bicubic : bilinear;
+	for (int iy = 0; iy < probe_cy; ++iy) {
+		for (int ix = 0; ix < probe_cx; ++ix) {
+			double s[4][4];
+			for (int i = 0; i < 4; ++i) {
+				int sx = min(max(ix - 1 + i, 0), int(p->nx));
+				for (int j = 0; j < 4; ++j) {
+					int sy = min(max(iy - 1 + j, 0), int(p->ny));
+					s[i][j] = p->sample[sy * (p->nx + 1) + sx];
+				}
+			}
+			// c = m s m^T
+			double t[4][4];
+			for (int a = 0; a < 4; ++a) {
+				for (int j = 0; j < 4; ++j) {
+					t[a][j] = 0;
+					for (int i = 0; i < 4; ++i)
+						t[a][j] += m[a][i] * s[i][j];
+				}
+			}
+			ProbeCell &cell = probe_cells[iy * probe_cx + ix];
+			for (int a = 0; a < 4; ++a) {
+				for (int b = 0; b < 4; ++b) {
+					cell.c[a][b] = 0;
+					for (int j = 0; j < 4; ++j)
+						cell.c[a][b] += t[a][j] * m[b][j];
+				}
+			}
+		}
+	}
+	return true;
+} // }}}
+
+void run_file(int name_len, char const *name, int probe_name_len, char const *probename, bool start, double sina, double cosa, int audio, int first_record) {
 	rundebug("run file %d %f %f", start, sina, cosa);
 	abort_run_file();
 	if (name_len == 0)
@@ -93,44 +500,55 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 		return;
 	}
 	run_file_size = stat.st_size;
-	run_file_map = reinterpret_cast<Run_Record *>(mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0));
+	if (audio < 0 && run_file_size < off_t(sizeof(Run_Header))) {
+		debug("Run file '%s' is too short", run_file_name);
+		close(fd);
+		if (probe_name_len > 0)
+			close(probe_fd);
+		return;
+	}
+	run_file_map = mmap(NULL, run_file_size, PROT_READ, MAP_SHARED, fd, 0);
 	close(fd);
+	if (run_file_map == MAP_FAILED) {
+		debug("Failed to map run file '%s': %s", run_file_name, strerror(errno));
+		run_file_map = NULL;
+		if (probe_name_len > 0)
+			close(probe_fd);
+		return;
+	}
 	if (probe_name_len > 0) {
-		probe_file_map = reinterpret_cast<ProbeFile *>(mmap(NULL, probe_file_size, PROT_READ, MAP_SHARED, probe_fd, 0));
+		void *map = mmap(NULL, probe_file_size, PROT_READ, MAP_SHARED, probe_fd, 0);
 		close(probe_fd);
-		if (((probe_file_map->nx + 1) * (probe_file_map->ny + 1)) * sizeof(double) + sizeof(ProbeFile) != probe_file_size) {
-			debug("Invalid probe file size %ld != %ld", probe_file_size, ((probe_file_map->nx + 1) * (probe_file_map->ny + 1)) * sizeof(double) + sizeof(ProbeFile));
-			munmap(probe_file_map, probe_file_size);
-			munmap(run_file_map, run_file_size);
-			probe_file_map = NULL;
-			run_file_map = NULL;
+		probe_file_map = map == MAP_FAILED ? NULL : reinterpret_cast<ProbeFile *>(map);
+		if (!probe_file_map || !probe_setup()) {
+			abort_run_file();
 			return;
 		}
 	}
 	else
 		probe_file_map = NULL;
 	if (audio < 0) {
-		// File format:
-		// records
-		// strings
-		// int32_t stringlengths[]
-		// int32_t numstrings
-		// double bbox[8]
-		run_file_num_strings = read_num(run_file_size - sizeof(double) * 8 - sizeof(int32_t));
-		strings = reinterpret_cast<String *>(malloc(run_file_num_strings * sizeof(String)));
-		off_t pos = run_file_size - sizeof(double) * 8 - sizeof(int32_t) - sizeof(int32_t) * run_file_num_strings;
-		off_t current = 0;
-		for (int i = 0; i < run_file_num_strings; ++i) {
-			strings[i].start = current;
-			strings[i].len = read_num(pos + sizeof(int32_t) * i);
-			current += strings[i].len;
+		// See runfile.h for the file format.  The file may still be growing.
+		Run_Header const *header = reinterpret_cast <Run_Header const *>(run_file_map);
+		if (memcmp(header->magic, RUN_MAGIC, sizeof(RUN_MAGIC)) != 0 || header->version != RUN_VERSION || header->encoding > RUN_ENCODING_COMPACT) {
+			debug("Run file '%s' has an invalid header", run_file_name);
+			abort_run_file();
+			return;
+		}
+		run_file_encoding = header->encoding;
+		num_blocks = 0;
+		blocks_end = sizeof(Run_Header);
+		blocks_records = 0;
+		current_block = -1;
+		if (!run_file_update() || (first_record > 0 && !run_file_seek(first_record))) {
+			abort_run_file();
+			return;
 		}
-		run_file_first_string = pos - current;
-		run_file_num_records = run_file_first_string / sizeof(Run_Record);
 	}
 	else {
 		audio_hwtime_step = 1000000. / *reinterpret_cast <double *>(run_file_map);
 		run_file_num_records = run_file_size - sizeof(double);
+		run_file_complete = true;
 	}
 	run_file_wait_temp = 0;
 	run_file_wait = start ? 0 : 1;
@@ -147,39 +565,41 @@ void run_file(int name_len, char const *name, int probe_name_len, char const *pr
 	run_preline.Y = NAN;
 	run_preline.Z = NAN;
 	run_preline.E = NAN;
+	run_last.X = NAN;
 	run_file_fill_queue();
 }
 
 void abort_run_file() {
 	run_file_finishing = false;
+	// A running system command is reaped when it exits, but nothing waits for it anymore.
+	run_file_system = 0;
 	if (!run_file_map)
 		return;
 	munmap(run_file_map, run_file_size);
 	run_file_map = NULL;
+	if (run_file_follow) {
+		run_file_follow = false;
+		run_file_timer.it_value.tv_sec = 0;
+		run_file_timer.it_value.tv_nsec = 0;
+		timerfd_settime(pollfds[POLL_RUN_TIMER].fd, 0, &run_file_timer, NULL);
+	}
 	if (probe_file_map) {
 		munmap(probe_file_map, probe_file_size);
 		probe_file_map = NULL;
 	}
-	free(strings);
-	strings = NULL;
+	free(probe_cells);
+	probe_cells = NULL;
+	free(blocks);
+	blocks = NULL;
+	blocks_size = 0;
+	num_blocks = 0;
+	free(block_records);
+	block_records = NULL;
+	block_records_size = 0;
+	current_block = -1;
 	arch_stop_audio();
 }
 
-enum {
-	RUN_SYSTEM,
-	RUN_PRE_LINE,
-	RUN_LINE,
-	RUN_PRE_ARC,
-	RUN_ARC,
-	RUN_GPIO,
-	RUN_SETTEMP,
-	RUN_WAITTEMP,
-	RUN_SETPOS,
-	RUN_WAIT,
-	RUN_CONFIRM,
-	RUN_PARK,
-};
-
 static double handle_probe(double ox, double oy, double z) {
 	ProbeFile *&p = probe_file_map;
 	if (!p)
@@ -188,42 +608,190 @@ static double handle_probe(double ox, double oy, double z) {
 		return NAN;
 	double x = ox * p->cosa + oy * p->sina;
 	double y = oy * p->cosa - ox * p->sina;
-	int ix, iy;
-	if (p->w == 0 || p->nx == 0) {
-		x = 0;
-		ix = 0;
+	x = p->w == 0 || p->nx == 0 ? 0 : min(max((x - p->x) / (p->w / p->nx), 0.), double(probe_cx));
+	y = p->h == 0 || p->ny == 0 ? 0 : min(max((y - p->y) / (p->h / p->ny), 0.), double(probe_cy));
+	// Consecutive points are usually in the same cell.
+	if (!(x >= probe_ix && x <= probe_ix + 1))
+		probe_ix = min(int(x), probe_cx - 1);
+	if (!(y >= probe_iy && y <= probe_iy + 1))
+		probe_iy = min(int(y), probe_cy - 1);
+	double fx = x - probe_ix;
+	double fy = y - probe_iy;
+	ProbeCell const &cell = probe_cells[probe_iy * probe_cx + probe_ix];
+	double ret = 0;
+	for (int i = 3; i >= 0; --i)
+		ret = ret * fx + ((cell.c[i][3] * fy + cell.c[i][2]) * fy + cell.c[i][1]) * fy + cell.c[i][0];
+	return z + ret + probe_adjust;
+}
+
+static pid_t run_system(char *cmd) {
+	// Start cmd with the shell, without waiting for it.  Its standard input and output must not use the host pipe.
+	debug("Running system command: %s", cmd);
+	char sh[] = "sh", c[] = "-c";
+	char *argv[] = {sh, c, cmd, NULL};
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, 2, 1);
+	// SIGCHLD is blocked for the signalfd; don't pass that on.
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t none;
+	sigemptyset(&none);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	pid_t pid;
+	int ret = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (ret != 0) {
+		debug("Unable to run system command: %s", strerror(ret));
+		return -1;
 	}
-	else {
-		x -= p->x;
-		x /= p->w / p->nx;
-		if (x < 0)
-			x = 0;
-		ix = floor(x);
-		if (x >= p->nx) {
-			x = p->nx;
-			ix = floor(x) - 1;
+	// Remember the child, so only commands from run files are reaped.
+	if (run_num_children >= run_children_size) {
+		pid_t *children = reinterpret_cast <pid_t *>(realloc(run_children, (run_children_size + 4) * sizeof(pid_t)));
+		if (!children) {
+			debug("Out of memory for system command; it will not be reaped");
+			return pid;
 		}
+		run_children = children;
+		run_children_size += 4;
 	}
-	if (p->h == 0 || p->ny == 0) {
-		y = 0;
-		iy = 0;
+	run_children[run_num_children++] = pid;
+	return pid;
+}
+
+void run_file_reap() {
+	struct signalfd_siginfo info;
+	while (read(pollfds[POLL_SIGNAL].fd, &info, sizeof(info)) == sizeof(info)) {
 	}
-	else {
-		y -= p->y;
-		y /= p->h / p->ny;
-		if (y < 0)
-			y = 0;
-		iy = floor(y);
-		if (y >= p->ny) {
-			y = p->ny;
-			iy = floor(y) - 1;
+	bool resume = false;
+	for (int i = 0; i < run_num_children;) {
+		pid_t pid = run_children[i];
+		int status;
+		pid_t ret = waitpid(pid, &status, WNOHANG);
+		if (ret == 0) {
+			// Still running.
+			++i;
+			continue;
+		}
+		if (ret < 0)
+			debug("Unable to wait for system command %d: %s", pid, strerror(errno));
+		else
+			debug("Done running system command %d, return = %d", pid, status);
+		run_children[i] = run_children[--run_num_children];
+		if (pid == run_file_system) {
+			run_file_system = 0;
+			resume = true;
 		}
 	}
-	double fx = x - ix;
-	double fy = y - iy;
-	double l = p->sample[iy * (p->nx + 1) + ix] * (1 - fy) + p->sample[(iy + 1) * (p->nx + 1) + ix] * fy;
-	double r = p->sample[iy * (p->nx + 1) + (ix + 1)] * (1 - fy) + p->sample[(iy + 1) * (p->nx + 1) + (ix + 1)] * fy;
-	return z + l * (1 - fx) + r * fx + probe_adjust;
+	if (resume)
+		run_file_fill_queue();
+}
+
+static int probe_split(double x0, double y0, double x1, double y1, double *split) { // {{{
+	// Store the fractions of the line where it crosses a probe grid line in split, in increasing order.
+	ProbeFile *&p = probe_file_map;
+	int n = 0;
+	for (int d = 0; d < 2; ++d) {
+		double size = d == 0 ? p->w : p->h;
+		unsigned long num = d == 0 ? p->nx : p->ny;
+		if (size == 0 || num == 0)
+			continue;
+		double origin = d == 0 ? p->x : p->y;
+		double u0 = ((d == 0 ? x0 * p->cosa + y0 * p->sina : y0 * p->cosa - x0 * p->sina) - origin) / (size / num);
+		double u1 = ((d == 0 ? x1 * p->cosa + y1 * p->sina : y1 * p->cosa - x1 * p->sina) - origin) / (size / num);
+		if (!(fabs(u1 - u0) > 1e-9))
+			continue;
+		// Only inner grid lines; outside the grid the compensation is constant in this direction.
+		double low = max(floor(min(u0, u1)) + 1, 1.);
+		double high = min(ceil(max(u0, u1)) - 1, double(num - 1));
+		for (double k = low; k <= high && n < RUN_PROBE_MAX_SPLIT; k += 1) {
+			double t = (k - u0) / (u1 - u0);
+			if (t <= 1e-9 || t >= 1 - 1e-9)
+				continue;
+			// Insert sorted, without duplicates where the line crosses a grid point.
+			int i = n;
+			while (i > 0 && split[i - 1] > t)
+				--i;
+			if ((i > 0 && t - split[i - 1] < 1e-9) || (i < n && split[i] - t < 1e-9))
+				continue;
+			for (int j = n; j > i; --j)
+				split[j] = split[j - 1];
+			split[i] = t;
+			n += 1;
+		}
+	}
+	return n;
+} // }}}
+
+static bool run_last_valid(Run_Record const &r) { // {{{
+	// Lines can only be split if their start is known and the queue ends with the previous move from the file.
+	if (!probe_file_map || spaces[0].num_axes < 3 || run_last.tool != r.tool || isnan(run_last.X) || isnan(run_last.Y) || isnan(run_last.Z) || isnan(run_last.E) || isnan(r.E))
+		return false;
+	if (settings.queue_start == settings.queue_end && !settings.queue_full)
+		return false;
+	MoveCommand &last = queue[(settings.queue_end + QUEUE_LENGTH - 1) % QUEUE_LENGTH];
+	return last.data[0] == run_last.X && last.data[1] == run_last.Y;
+} // }}}
+
+static void queue_move(Run_Record const &r, double x, double y, double z, double e, double part, double time, double dist, bool first) { // {{{
+	// Add (part of) a line or arc to the queue.  Only the first part moves the axes from a RUN_PRE_LINE.
+	MoveCommand &q = queue[settings.queue_end];
+	q.single = false;
+	q.probe = false;
+	q.arc = r.type == RUN_ARC;
+	q.f[0] = r.f / part;
+	q.f[1] = r.F / part;
+	int num0 = spaces[0].num_axes;
+	if (num0 > 0) {
+		q.data[0] = x;
+		if (num0 > 1) {
+			q.data[1] = y;
+			if (num0 > 2) {
+				q.data[2] = handle_probe(x, y, z);
+				if (num0 > 3) {
+					q.data[3] = first ? run_preline.X : NAN;
+					if (num0 > 4) {
+						q.data[4] = first ? run_preline.Y : NAN;
+						if (num0 > 5) {
+							q.data[5] = first ? run_preline.Z : NAN;
+						}
+					}
+				}
+			}
+		}
+	}
+	for (int i = 6; i < num0; ++i)
+		q.data[i] = NAN;
+	for (int i = 0; i < spaces[1].num_axes; ++i) {
+		q.data[num0 + i] = (i == r.tool ? e : first && i == run_preline.tool ? run_preline.E : NAN);
+		//debug("queue %d + %d = %f", num0, i, q.data[num0 + i]);
+	}
+	num0 += spaces[1].num_axes;
+	for (int s = 2; s < NUM_SPACES; ++s) {
+		for (int i = 0; i < spaces[s].num_axes; ++i)
+			q.data[num0 + i] = NAN;
+		num0 += spaces[s].num_axes;
+	}
+	q.time = time;
+	q.dist = dist;
+	q.cb = false;
+	settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
+} // }}}
+
+double run_file_margin() {
+	// Estimated time until the queue runs empty, the same way CMD_GETTIME computes the print time.
+	double t0 = history ? history[running_fragment].run_time : settings.run_time;
+	double d0 = history ? history[running_fragment].run_dist : settings.run_dist;
+	double t1 = settings.run_time, d1 = settings.run_dist;
+	if (settings.queue_end != settings.queue_start || settings.queue_full) {
+		MoveCommand &last = queue[(settings.queue_end + QUEUE_LENGTH - 1) % QUEUE_LENGTH];
+		t1 = last.time;
+		d1 = last.dist;
+	}
+	return (t1 - t0 + (d1 - d0) / max_v) / feedrate;
 }
 
 void run_file_fill_queue() {
@@ -257,25 +825,42 @@ void run_file_fill_queue() {
 	bool must_move = true;
 	while (must_move) {
 		must_move = false;
+		if (run_file_map && !run_file_complete && settings.run_file_current >= run_file_num_records)
+			run_file_update();
 		while (run_file_map	// There is a file to run.
-				&& (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH < 4	// There is space in the queue.
-				&& !settings.queue_full	// Really, there is space in the queue.
+				&& !settings.queue_full	// There is space in the queue.
+				&& (settings.queue_end + 1) % QUEUE_LENGTH != settings.queue_start	// Really, there is space in the queue.
+				&& ((settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH < RUN_FILE_MIN_QUEUE || run_file_margin() < run_file_horizon)	// The queue does not hold enough motion.
 				&& settings.run_file_current < run_file_num_records	// There are records to send.
 				&& !run_file_wait_temp	// We are not waiting for a temp alarm.
 				&& !run_file_wait	// We are not waiting for something else (pause or confirm).
+				&& !run_file_system	// We are not waiting for a system command.
 				&& !run_file_finishing) {	// We are not waiting for underflow (should be impossible anyway, if there are commands in the queue).
-			int t = run_file_map[settings.run_file_current].type;
+			int t = run_record(settings.run_file_current).type;
+			if (!run_file_map)
+				break;
 			if (t != RUN_LINE && t != RUN_PRE_LINE && t != RUN_PRE_ARC && t != RUN_ARC && (arch_running() || settings.queue_end != settings.queue_start || computing_move || sending_fragment || transmitting_fragment))
 				break;
-			Run_Record &r = run_file_map[settings.run_file_current];
+			Run_Record &r = run_record(settings.run_file_current);
+			int next = settings.run_file_current + 1;
+			bool stall = false;
 			rundebug("running %d: %d %d", settings.run_file_current, r.type, r.tool);
+			if ((r.type == RUN_SYSTEM || r.type == RUN_CONFIRM) && !run_string_valid(settings.run_file_current, r))
+				break;
 			switch (r.type) {
 				case RUN_SYSTEM:
 				{
-					char const *cmd = strndupa(&reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], strings[r.tool].len);
-					debug("Running system command: %ld %d %s", strings[r.tool].start, strings[r.tool].len, cmd);
-					int ret = system(cmd);
-					debug("Done running system command, return = %d", ret);
+					char *cmd = strndup(run_string(next, r.tool), r.tool);
+					next += run_string_records(r.tool);
+					if (!cmd) {
+						debug("Out of memory for system command");
+						break;
+					}
+					pid_t pid = run_system(cmd);
+					free(cmd);
+					// With X set, the command runs in the background.
+					if (pid > 0 && !r.X)
+						run_file_system = pid;
 					break;
 				}
 				case RUN_PRE_ARC:
@@ -304,89 +889,44 @@ void run_file_fill_queue() {
 				case RUN_LINE:
 				case RUN_ARC:
 				{
-					queue[settings.queue_end].single = false;
-					queue[settings.queue_end].probe = false;
-					queue[settings.queue_end].arc = r.type == RUN_ARC;
-					queue[settings.queue_end].f[0] = r.f;
-					queue[settings.queue_end].f[1] = r.F;
 					double x = r.X * run_file_cosa - r.Y * run_file_sina + run_file_refx;
 					double y = r.Y * run_file_cosa + r.X * run_file_sina + run_file_refy;
-					double z = r.Z;
-					//debug("line/arc %f %f %f", x, y, z);
-					int num0 = spaces[0].num_axes;
-					if (num0 > 0) {
-						queue[settings.queue_end].data[0] = x;
-						if (num0 > 1) {
-							queue[settings.queue_end].data[1] = y;
-							if (num0 > 2) {
-								queue[settings.queue_end].data[2] = handle_probe(x, y, z);
-								if (num0 > 3) {
-									queue[settings.queue_end].data[3] = run_preline.X;
-									if (num0 > 4) {
-										queue[settings.queue_end].data[4] = run_preline.Y;
-										if (num0 > 5) {
-											queue[settings.queue_end].data[5] = run_preline.Z;
-										}
-									}
-									run_preline.X = NAN;
-									run_preline.Y = NAN;
-									run_preline.Z = NAN;
-								}
-							}
-						}
+					//debug("line/arc %f %f %f", x, y, r.Z);
+					// Split lines where they cross the probe grid, so the bed shape is followed between the end points.
+					double split[RUN_PROBE_MAX_SPLIT + 1];
+					int pieces = 1;
+					if (r.type == RUN_LINE && run_last_valid(r))
+						pieces = probe_split(run_last.X, run_last.Y, x, y, split) + 1;
+					int used = settings.queue_full ? QUEUE_LENGTH : (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH;
+					if (used + pieces >= QUEUE_LENGTH) {
+						stall = true;
+						break;
 					}
-					for (int i = 6; i < num0; ++i)
-						queue[settings.queue_end].data[i] = NAN;
-					for (int i = 0; i < spaces[1].num_axes; ++i) {
-						queue[settings.queue_end].data[num0 + i] = (i == r.tool ? r.E : i == run_preline.tool ? run_preline.E : NAN);
-						//debug("queue %d + %d = %f", num0, i, queue[settings.queue_end].data[num0 + i]);
+					split[pieces - 1] = 1;
+					double done = 0;
+					for (int i = 0; i < pieces; ++i) {
+						double f = split[i];
+						if (i == pieces - 1)
+							queue_move(r, x, y, r.Z, r.E, f - done, r.time, r.dist, i == 0);
+						else
+							queue_move(r, run_last.X + (x - run_last.X) * f, run_last.Y + (y - run_last.Y) * f, run_last.Z + (r.Z - run_last.Z) * f, run_last.E + (r.E - run_last.E) * f, f - done, run_last.time + (r.time - run_last.time) * f, run_last.dist + (r.dist - run_last.dist) * f, i == 0);
+						done = f;
 					}
+					run_preline.X = NAN;
+					run_preline.Y = NAN;
+					run_preline.Z = NAN;
 					run_preline.E = NAN;
-					num0 += spaces[1].num_axes;
-					for (int s = 2; s < NUM_SPACES; ++s) {
-						for (int i = 0; i < spaces[s].num_axes; ++i)
-							queue[settings.queue_end].data[num0 + i] = NAN;
-						num0 += spaces[s].num_axes;
-					}
-					queue[settings.queue_end].time = r.time;
-					queue[settings.queue_end].dist = r.dist;
-					queue[settings.queue_end].cb = false;
-					settings.queue_end = (settings.queue_end + 1) % QUEUE_LENGTH;
+					run_last = r;
+					run_last.X = x;
+					run_last.Y = y;
 					break;
 				}
 				case RUN_GPIO:
-				{
-					int tool = r.tool;
-					if (tool == -2)
-						tool = fan_id != 255 ? fan_id : -1;
-					else if (tool == -3)
-						tool = spindle_id != 255 ? spindle_id : -1;
-					if (tool < 0 || tool >= num_gpios) {
-						if (tool != -1)
-							debug("cannot set invalid gpio %d", tool);
-						break;
-					}
-					if (r.X) {
-						gpios[tool].state = 1;
-						SET(gpios[tool].pin);
-					}
-					else {
-						gpios[tool].state = 0;
-						RESET(gpios[tool].pin);
-					}
-					send_host(CMD_UPDATE_PIN, tool, gpios[tool].state);
+					run_gpio(r);
 					break;
-				}
 				case RUN_SETTEMP:
-				{
-					int tool = r.tool;
-					if (tool == -1)
-						tool = bed_id != 255 ? bed_id : -1;
-					rundebug("settemp %d %f", tool, r.X);
-					settemp(tool, r.X);
-					send_host(CMD_UPDATE_TEMP, tool, 0, r.X);
+					run_settemp(r);
 					break;
-				}
 				case RUN_WAITTEMP:
 				{
 					int tool = r.tool;
@@ -423,24 +963,29 @@ void run_file_fill_queue() {
 						break;
 					}
 					setpos(1, r.tool, r.X);
+					if (r.tool == run_last.tool)
+						run_last.E = r.X;
 					break;
 				case RUN_WAIT:
 					if (r.X > 0) {
+						run_file_follow = false;
 						run_file_timer.it_value.tv_sec = r.X;
 						run_file_timer.it_value.tv_nsec = (r.X - run_file_timer.it_value.tv_sec) * 1e9;
 						run_file_wait += 1;
-						timerfd_settime(pollfds[0].fd, 0, &run_file_timer, NULL);
+						timerfd_settime(pollfds[POLL_RUN_TIMER].fd, 0, &run_file_timer, NULL);
 					}
 					break;
 				case RUN_CONFIRM:
 				{
-					int len = min(strings[r.tool].len, 250);
-					memcpy(datastore, &reinterpret_cast<char const *>(run_file_map)[run_file_first_string + strings[r.tool].start], len);
+					int len = min(int(r.tool), 250);
+					memcpy(datastore, run_string(next, len), len);
+					next += run_string_records(r.tool);
 					run_file_wait += 1;
 					send_host(CMD_CONFIRM, r.X ? 1 : 0, 0, 0, 0, len);
 					break;
 				}
 				case RUN_PARK:
+					run_last.X = NAN;
 					run_file_wait += 1;
 					send_host(CMD_PARKWAIT);
 					break;
@@ -448,7 +993,9 @@ void run_file_fill_queue() {
 					debug("Invalid record type %d in %s", r.type, run_file_name);
 					break;
 			}
-			settings.run_file_current += 1;
+			if (stall)
+				break;
+			settings.run_file_current = next;
 			if (!computing_move && (settings.queue_start != settings.queue_end || settings.queue_full))
 				must_move = true;
 		}
@@ -461,7 +1008,14 @@ void run_file_fill_queue() {
 		send_host(CMD_MOVECB, cbs);
 	buffer_refill();
 	rundebug("run queue done");
-	if (run_file_map && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_finishing) {
+	if (run_file_map && !run_file_complete && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_follow) {
+		// The producer is still writing the file; check again later.
+		run_file_follow = true;
+		run_file_timer.it_value.tv_sec = 0;
+		run_file_timer.it_value.tv_nsec = RUN_FILE_FOLLOW_NS;
+		timerfd_settime(pollfds[POLL_RUN_TIMER].fd, 0, &run_file_timer, NULL);
+	}
+	if (run_file_map && run_file_complete && settings.run_file_current >= run_file_num_records && !run_file_wait_temp && !run_file_wait && !run_file_system && !run_file_finishing) {
 		// Done.
 		//debug("done running file");
 		if (!computing_move && !sending_fragment && !arch_running()) {
@@ -0,0 +1,149 @@
+/* runfile.h - run file format for Franklin
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RUNFILE_H
+#define _RUNFILE_H
+
+#include <stdint.h>
+
+// This file is shared by the cdriver, which runs these files, and franklin-gcode, which writes them.
+
+// File format:
+// Run_Header
+// records
+// index: Run_Snapshot entries
+// A RUN_SYSTEM or RUN_CONFIRM record is followed by its string.  The tool field holds the length of the string,
+// which is padded with zeros to a whole number of records.
+//
+// The file is written front to back and can be run while it is being produced.  The producer updates num_records
+// after the records have been written, and sets complete when the file is finished.  The other header fields are
+// valid after that.
+//
+// The index holds the state at the start of a record, about every RUN_INDEX_INTERVAL records, so a run can be
+// started in the middle of the file.  The first entry is for record 0.  Snapshots are never taken for a record
+// which follows a RUN_PRE_LINE or RUN_PRE_ARC, or for string data.
+//
+// With RUN_ENCODING_COMPACT, the records are stored in blocks.  A block is a Run_Block, followed by its records.
+// It holds about RUN_BLOCK_RECORDS records and never separates a string from its record.  A record is a type byte
+// and three bytes of flags (little endian), followed by the fields which are present.  The fields are tool, X, Y, Z,
+// E, f, F, time, dist; bits 2i and 2i+1 of the flags hold the code for field i:
+//	RUN_SAME: it is equal to the previous value.
+//	RUN_PREDICT: the value from run_predict(): f for F, prev + 2 / (f + F) for time (as a line adds it), and
+//		prev + (prev - prevprev) for the other fields.
+//	RUN_FIXED: a zigzag LEB128 varint d; the value is double(llround(prev * RUN_FIXED_SCALE) + d) / RUN_FIXED_SCALE,
+//		or prev + d for tool.
+//	RUN_RAW: a double, or an int32 for tool.
+// Previous values are per field, over all record types, and start at 0 in every block.  A string follows its record
+// without padding, but it still counts as run_string_records() records.  The offset in a snapshot is the offset of
+// the block which holds the record.  Decoding is exact: the records are the same as in the plain encoding.
+#define RUN_MAGIC "FRNKRUN"
+#define RUN_VERSION 3
+#define RUN_INDEX_INTERVAL 1024
+#define RUN_BLOCK_RECORDS 256
+#define RUN_FIXED_SCALE 1e6
+#define RUN_FIXED_LIMIT 1e9	// Values must be smaller than this for RUN_FIXED.
+#define RUN_FIELDS 9
+
+enum RunEncoding {
+	RUN_ENCODING_PLAIN,
+	RUN_ENCODING_COMPACT,
+};
+
+enum RunCode {
+	RUN_SAME,
+	RUN_PREDICT,
+	RUN_FIXED,
+	RUN_RAW,
+};
+
+// Record types; these must match protocol.parsed in protocol.py.
+enum {
+	RUN_SYSTEM,
+	RUN_PRE_LINE,
+	RUN_LINE,
+	RUN_PRE_ARC,
+	RUN_ARC,
+	RUN_GPIO,
+	RUN_SETTEMP,
+	RUN_WAITTEMP,
+	RUN_SETPOS,
+	RUN_WAIT,
+	RUN_CONFIRM,
+	RUN_PARK,
+};
+
+struct Run_Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t complete;
+	uint32_t num_records;	// Number of records that have been written, including string padding.
+	uint32_t num_temps;	// Number of temperatures in a snapshot, not counting the bed.
+	double bbox[8];		// xmin, xmax, ymin, ymax, zmin, zmax, time, dist.
+	uint64_t index_offset;
+	uint32_t index_size;	// Number of snapshots.
+	uint32_t checksum;	// CRC-32 (as computed by zlib) of everything after the header.
+	uint32_t encoding;
+	uint32_t reserved;
+} __attribute__((__packed__));
+
+struct Run_Record {
+	uint8_t type;
+	int32_t tool;
+	double X, Y, Z, E, f, F;
+	double time, dist;
+} __attribute__((__packed__));
+
+struct Run_Block {
+	uint32_t size;		// Number of bytes following this header.
+	uint32_t num_records;	// Including string records.
+} __attribute__((__packed__));
+
+// Number of records which are used by a string of len bytes.
+static inline int run_string_records(int len) {
+	return (len + sizeof(Run_Record) - 1) / sizeof(Run_Record);
+}
+
+// Predicted value of field i for RUN_PREDICT; value must hold the fields before i.
+static inline double run_predict(int i, double const *value, double const (*field)[RUN_FIELDS]) {
+	if (i == 6)
+		return value[5];
+	if (i == 7)
+		return field[0][i] + 2 / (value[5] + value[6]);
+	return field[0][i] + (field[0][i] - field[1][i]);
+}
+
+struct Run_Snapshot {
+	uint32_t record;
+	uint64_t offset;	// Byte offset of the record in the file.
+	int32_t tool;		// Extruder of the last move.
+	double X, Y, Z, E;	// Position after the last move; E is for tool.
+	double time, dist;
+	double temp[0];		// Bed, then num_temps temperatures; NaN if they have not been set.
+} __attribute__((__packed__));
+
+static inline int run_snapshot_size(int num_temps) {
+	return sizeof(Run_Snapshot) + (num_temps + 1) * sizeof(double);
+}
+
+struct ProbeFile {
+	double x, y, w, h, sina, cosa;
+	unsigned long nx, ny;
+	double sample[0];
+} __attribute__((__packed__));
+
+#endif
@@ -44,14 +44,28 @@ struct Queuerecord { // {{{
 	Queuerecord *next;
 	int len;
 	char cmd;
+	bool pooled;	// Record is part of hostqueue_pool, not malloc'ed.
 	int32_t s, m, e;
 	double f;
+	char *data;
+}; // }}}
+
+// Records for host messages are taken from a pool, so the control loop doesn't need to allocate memory for them.
+// Only messages with a lot of data, or messages that are queued when the pool is exhausted, are allocated separately.
+#define HOSTQUEUE_POOL_SIZE 64
+#define HOSTQUEUE_POOL_DATA 32
+struct Poolrecord { // {{{
+	Queuerecord record;
+	char data[HOSTQUEUE_POOL_DATA];
 }; // }}}
 
 // Globals. {{{
 static bool sending_to_host = false;
 static Queuerecord *hostqueue_head = NULL;
 static Queuerecord *hostqueue_tail = NULL;
+static Poolrecord hostqueue_pool[HOSTQUEUE_POOL_SIZE];
+static Queuerecord *hostqueue_free = NULL;
+static bool hostqueue_pool_ready = false;
 static bool had_data = false;
 static bool had_stall = false;
 static bool doing_debug = false;
@@ -86,8 +100,8 @@ static void send_to_host() { // {{{
 #endif
 	{
 		debug("**** host send cmd %02x s %08x m %08x e %08x f %f data len %d", r->cmd, r->s, r->m, r->e, r->f, r->len);
-		for (uint8_t i = 0; i < r->len; ++i)
-			fprintf(stderr, " %02x", reinterpret_cast <unsigned char *>(r)[sizeof(Queuerecord) + i]);
+		for (int i = 0; i < r->len; ++i)
+			fprintf(stderr, " %02x", reinterpret_cast <unsigned char *>(r->data)[i]);
 		fprintf(stderr, "\n");
 	}
 #endif
@@ -101,11 +115,18 @@ static void send_to_host() { // {{{
 		serialdev[0]->write(reinterpret_cast <char *>(&r->e)[i]);
 	for (unsigned i = 0; i < sizeof(double); ++i)
 		serialdev[0]->write(reinterpret_cast <char *>(&r->f)[i]);
-	for (unsigned i = 0; i < r->len; ++i)
-		serialdev[0]->write(reinterpret_cast <char *>(r)[sizeof(Queuerecord) + i]);
-	if (r->cmd == CMD_LIMIT)
+	for (int i = 0; i < r->len; ++i)
+		serialdev[0]->write(r->data[i]);
+	if (r->cmd == CMD_LIMIT) {
 		stopping = 1;
-	free(r);
+		probe_grid_limit(r->s);
+	}
+	if (r->pooled) {
+		r->next = hostqueue_free;
+		hostqueue_free = r;
+	}
+	else
+		free(r);
 } // }}}
 
 #ifdef SERIAL
@@ -528,9 +549,9 @@ void serial(uint8_t channel) { // {{{
 // Set checksum bytes.
 bool prepare_packet(char *the_packet, int size) { // {{{
 	//debug("prepare %d %d %d", size, ff_out, out_busy);
-	if (size >= COMMAND_SIZE)
+	if (size >= MAX_PACKET_SIZE)
 	{
-		debug("packet is too large: %d > %d", size, COMMAND_SIZE);
+		debug("packet is too large: %d > %d", size, MAX_PACKET_SIZE);
 		return false;
 	}
 	if (preparing) {
@@ -540,7 +561,7 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 	// Wait for room in the queue.  This is required to avoid a stall being received in between prepare and send.
 	preparing = true;
 	while (out_busy >= 3) {
-		poll(&pollfds[2], 1, -1);
+		poll(&pollfds[POLL_ARCH], 1, -1);
 		serial(1);
 	}
 	preparing = false;	// Not yet, but there are no further interruptions.
@@ -565,7 +586,7 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 		the_packet[2] = 0;
 	else if (size == 4)
 		the_packet[5] = 0;
-	for (uint8_t t = 0; t < (size + 2) / 3; ++t)
+	for (int t = 0; t < (size + 2) / 3; ++t)
 	{
 		uint8_t sum = t & 7;
 		for (uint8_t bit = 0; bit < 5; ++bit)
@@ -588,7 +609,7 @@ bool prepare_packet(char *the_packet, int size) { // {{{
 #ifdef DEBUG_SERIAL
 	fprintf(stderr, "prepare %p:", the_packet);
 #endif
-	for (uint8_t i = 0; i < pending_len[ff_out]; ++i) {
+	for (int i = 0; i < pending_len[ff_out]; ++i) {
 		pending_packet[ff_out][i] = the_packet[i];
 #ifdef DEBUG_SERIAL
 		fprintf(stderr, " %02x", int(uint8_t(pending_packet[ff_out][i])));
@@ -606,11 +627,11 @@ void send_packet() { // {{{
 	int which = (ff_out - 1) & 3;
 #ifdef DEBUG_DATA
 	fprintf(stderr, "send (%d): ", out_busy);
-	for (uint8_t i = 0; i < pending_len[which]; ++i)
+	for (int i = 0; i < pending_len[which]; ++i)
 		fprintf(stderr, " %02x", int(uint8_t(pending_packet[which][i])));
 	fprintf(stderr, "\n");
 #endif
-	for (uint8_t t = 0; t < pending_len[which]; ++t)
+	for (int t = 0; t < pending_len[which]; ++t)
 		serialdev[1]->write(pending_packet[which][t]);
 	out_busy += 1;
 	out_time = utime();
@@ -634,8 +655,32 @@ void write_nack() { // {{{
 
 void send_host(char cmd, int s, int m, double f, int e, int len) { // {{{
 	//debug("queueing for host cmd %x", cmd);
-	// Use malloc, not mem_alloc, because there are multiple pointers to the same memory and mem_alloc cannot handle that.
-	Queuerecord *record = reinterpret_cast <Queuerecord *>(malloc(sizeof(Queuerecord) + len));
+	// Merge move callbacks into a record that is still waiting, so a slow host gets one message instead of many.
+	// Only the tail may be used; merging into an earlier record would change the order of events.
+	if (cmd == CMD_MOVECB && len == 0 && hostqueue_tail && hostqueue_tail->cmd == CMD_MOVECB) {
+		hostqueue_tail->s += s;
+		return;
+	}
+	if (!hostqueue_pool_ready) {
+		for (int i = 0; i < HOSTQUEUE_POOL_SIZE; ++i) {
+			hostqueue_pool[i].record.next = hostqueue_free;
+			hostqueue_pool[i].record.pooled = true;
+			hostqueue_pool[i].record.data = hostqueue_pool[i].data;
+			hostqueue_free = &hostqueue_pool[i].record;
+		}
+		hostqueue_pool_ready = true;
+	}
+	Queuerecord *record;
+	if (len <= HOSTQUEUE_POOL_DATA && hostqueue_free) {
+		record = hostqueue_free;
+		hostqueue_free = record->next;
+	}
+	else {
+		// Use malloc, not mem_alloc, because there are multiple pointers to the same memory and mem_alloc cannot handle that.
+		record = reinterpret_cast <Queuerecord *>(malloc(sizeof(Queuerecord) + len));
+		record->pooled = false;
+		record->data = reinterpret_cast <char *>(record) + sizeof(Queuerecord);
+	}
 	if (hostqueue_head)
 		hostqueue_tail->next = record;
 	else
@@ -648,8 +693,8 @@ void send_host(char cmd, int s, int m, double f, int e, int len) { // {{{
 	record->cmd = cmd;
 	record->len = len;
 	record->next = NULL;
-	for (unsigned i = 0; i < len; ++i)
-		reinterpret_cast <char *>(record)[sizeof(Queuerecord) + i] = datastore[i];
+	for (int i = 0; i < len; ++i)
+		record->data[i] = datastore[i];
 	if (!sending_to_host)
 		send_to_host();
 } // }}}
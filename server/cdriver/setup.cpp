@@ -17,6 +17,8 @@
  */
 
 #include "cdriver.h"
+#include <signal.h>
+#include <sys/signalfd.h>
 
 static unsigned char host_command[HOST_COMMAND_SIZE];
 #ifdef SERIAL
@@ -46,9 +48,23 @@ void setup(char const *port, char const *run_id)
 	debug_buffer_ptr = 0;
 #endif
 	debug("Starting");
-	pollfds[0].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	pollfds[0].events = POLLIN | POLLPRI;
-	pollfds[0].revents = 0;
+	status_setup();
+	ring_setup();
+	telemetry_setup();
+	pollfds[POLL_RUN_TIMER].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	pollfds[POLL_RUN_TIMER].events = POLLIN | POLLPRI;
+	pollfds[POLL_RUN_TIMER].revents = 0;
+	// System commands from run files are reaped through a signalfd.
+	sigset_t sigchld;
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld, NULL);
+	pollfds[POLL_SIGNAL].fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+	pollfds[POLL_SIGNAL].events = POLLIN | POLLPRI;
+	pollfds[POLL_SIGNAL].revents = 0;
+	pollfds[POLL_PID].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	pollfds[POLL_PID].events = POLLIN | POLLPRI;
+	pollfds[POLL_PID].revents = 0;
 	command_end[0] = 0;
 	motors_busy = false;
 	current_extruder = 0;
@@ -77,6 +93,8 @@ void setup(char const *port, char const *run_id)
 	feedrate = 1;
 	max_deviation = 0;
 	max_v = INFINITY;
+	run_file_horizon = .5;
+	probe_bicubic = false;
 	targetx = 0;
 	targety = 0;
 	zoffset = 0;
@@ -392,6 +392,11 @@ static void check_distance(int sp, int mt, Motor *mtr, double distance, double d
 			debug("overflow %d from cp %f dist %f steps/mm %f dt %f s %d max %d", steps, mtr->settings.current_pos, distance, mtr->steps_per_unit, dt, s, max);
 			steps = max * s;
 		}
+#ifdef ARCH_MAX_STEPS
+		// The hardware cannot do more steps in one sample.
+		if (abs(steps) > ARCH_MAX_STEPS)
+			steps = ARCH_MAX_STEPS * s;
+#endif
 	}
 	if (abs(steps) < abs(targetsteps)) {
 		distance = (arch_round_pos(sp, mt, mtr->settings.current_pos) + steps + s * .5 - mtr->settings.current_pos) / mtr->steps_per_unit;
@@ -0,0 +1,107 @@
+/* status.cpp - shared memory status page for Franklin
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cdriver.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+
+// The page is named after the pid, so the driver can find it without any communication.
+// The driver maps it and unlinks it after the first reply, or when it exits; the page is only visible to the process which started this cdriver.
+
+static void status_begin() { // {{{
+	// Sequence is odd while writing.  Readers retry if it is odd or changed while they read.
+	__atomic_store_n(&status_page->sequence, status_page->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+} // }}}
+
+static void status_end() { // {{{
+	__atomic_store_n(&status_page->sequence, status_page->sequence + 1, __ATOMIC_RELEASE);
+} // }}}
+
+void status_setup() { // {{{
+	status_page = NULL;
+	char name[32];
+	snprintf(name, sizeof(name), "/franklin-status-%d", getpid());
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		debug("unable to create status page; continuing without it");
+		return;
+	}
+	if (ftruncate(fd, sizeof(StatusPage)) < 0) {
+		debug("unable to set size of status page; continuing without it");
+		close(fd);
+		shm_unlink(name);
+		return;
+	}
+	void *map = mmap(NULL, sizeof(StatusPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		debug("unable to map status page; continuing without it");
+		shm_unlink(name);
+		return;
+	}
+	status_page = reinterpret_cast <StatusPage *>(map);
+	status_page->sequence = 0;
+	status_begin();
+	status_page->version = STATUS_VERSION;
+	for (int t = 0; t < STATUS_MAX_TEMPS; ++t)
+		status_page->temp[t] = NAN;
+	status_end();
+	status_update();
+} // }}}
+
+void status_update() { // {{{
+	if (!status_page)
+		return;
+	status_begin();
+	status_page->running_fragment = running_fragment;
+	status_page->current_fragment = current_fragment;
+	status_page->queue_length = settings.queue_full ? QUEUE_LENGTH : (settings.queue_end - settings.queue_start + QUEUE_LENGTH) % QUEUE_LENGTH;
+	status_page->num_temps = num_temps;
+	status_page->hwtime = settings.hwtime / 1e6;
+	status_page->time = history ? (history[running_fragment].run_time + history[running_fragment].run_dist / max_v) / feedrate + settings.hwtime / 1e6 : NAN;
+	status_page->run_margin = run_file_map && run_file_audio < 0 ? run_file_margin() : NAN;
+	for (int s = 0; s < NUM_SPACES; ++s) {
+		Space &sp = spaces[s];
+		status_page->num_axes[s] = min(int(sp.num_axes), STATUS_MAX_AXES);
+		status_page->num_motors[s] = min(int(sp.num_motors), STATUS_MAX_AXES);
+		for (int a = 0; a < status_page->num_axes[s]; ++a) {
+			// This is what CMD_GETPOS returns, except that the position is not reset when it is unknown.
+			double value = motors_busy ? sp.axis[a]->settings.current : NAN;
+			if (s == 0) {
+				for (int ts = 0; ts < NUM_SPACES; ++ts)
+					value = space_types[spaces[ts].type].unchange0(&spaces[ts], a, value);
+				if (a == 2)
+					value -= zoffset;
+			}
+			status_page->axis[s][a] = value;
+		}
+		for (int m = 0; m < status_page->num_motors[s]; ++m)
+			status_page->motor[s][m] = sp.motor[m]->settings.current_pos / sp.motor[m]->steps_per_unit;
+	}
+	status_end();
+} // }}}
+
+void status_temp(int which, double value) { // {{{
+	if (!status_page || which < 0 || which >= STATUS_MAX_TEMPS)
+		return;
+	status_begin();
+	status_page->temp[which] = value;
+	status_end();
+} // }}}
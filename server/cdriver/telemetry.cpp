@@ -0,0 +1,107 @@
+/* telemetry.cpp - shared memory temperature history for Franklin
+ * vim: set foldmethod=marker :
+ * Copyright 2014-2016 Michigan Technological University
+ * Author: Bas Wijnen <wijnen@debian.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cdriver.h"
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+// Every temperature reading is stored here, so the driver can read the history without using the serial protocol.
+// The page is named and shared like the status page.  Every sensor has its own sequence, so a reader only needs to
+// retry for the sensor that it is reading.
+
+// Records that are being combined for the next tier.  The sums are divided when the record is stored.
+static TelemetryRecord telemetry_pending[STATUS_MAX_TEMPS][TELEMETRY_TIERS];
+static int telemetry_num_pending[STATUS_MAX_TEMPS][TELEMETRY_TIERS];
+
+void telemetry_setup() { // {{{
+	telemetry_page = NULL;
+	char name[32];
+	snprintf(name, sizeof(name), "/franklin-telemetry-%d", getpid());
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		debug("unable to create telemetry page; continuing without it");
+		return;
+	}
+	if (ftruncate(fd, sizeof(TelemetryPage)) < 0) {
+		debug("unable to set size of telemetry page; continuing without it");
+		close(fd);
+		shm_unlink(name);
+		return;
+	}
+	void *map = mmap(NULL, sizeof(TelemetryPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		debug("unable to map telemetry page; continuing without it");
+		shm_unlink(name);
+		return;
+	}
+	// The new page is filled with zeros, which is a valid empty history.
+	telemetry_page = reinterpret_cast <TelemetryPage *>(map);
+	telemetry_page->length = TELEMETRY_LENGTH;
+	telemetry_page->tiers = TELEMETRY_TIERS;
+	telemetry_page->factor = TELEMETRY_FACTOR;
+	__atomic_store_n(&telemetry_page->version, TELEMETRY_VERSION, __ATOMIC_RELEASE);
+} // }}}
+
+static void telemetry_store(TelemetryTemp &t, int which, int tier, TelemetryRecord const &record) { // {{{
+	t.record[tier][t.count[tier] % TELEMETRY_LENGTH] = record;
+	__atomic_store_n(&t.count[tier], t.count[tier] + 1, __ATOMIC_RELAXED);
+	if (tier + 1 >= TELEMETRY_TIERS)
+		return;
+	TelemetryRecord &p = telemetry_pending[which][tier + 1];
+	int &n = telemetry_num_pending[which][tier + 1];
+	if (n == 0)
+		p = record;
+	else {
+		p.adc += record.adc;
+		p.min = min(p.min, record.min);
+		p.max = max(p.max, record.max);
+		p.mean += record.mean;
+		p.duty += record.duty;
+	}
+	if (++n < TELEMETRY_FACTOR)
+		return;
+	p.adc /= n;
+	p.mean /= n;
+	p.duty /= n;
+	n = 0;
+	telemetry_store(t, which, tier + 1, p);
+} // }}}
+
+void telemetry_temp(int which, int32_t adc, double value, double duty) { // {{{
+	if (!telemetry_page || which < 0 || which >= STATUS_MAX_TEMPS)
+		return;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	TelemetryRecord record;
+	record.time = tv.tv_sec + tv.tv_usec / 1e6;
+	record.adc = adc;
+	record.min = value;
+	record.max = value;
+	record.mean = value;
+	record.duty = duty;
+	TelemetryTemp &t = telemetry_page->temp[which];
+	// Sequence is odd while writing, as for the status page.
+	__atomic_store_n(&t.sequence, t.sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	telemetry_store(t, which, 0, record);
+	telemetry_page->num_temps = num_temps;
+	__atomic_store_n(&t.sequence, t.sequence + 1, __ATOMIC_RELEASE);
+} // }}}
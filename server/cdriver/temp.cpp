@@ -17,15 +17,19 @@
  */
 
 #include "cdriver.h"
+#include <sys/timerfd.h>
 
 void Temp::load(int32_t &addr, int id)
 {
+	double old[5] = {R0, R1, logRc, Tc, beta};
 	R0 = read_float(addr);
 	R1 = read_float(addr);
 	logRc = read_float(addr);
 	Tc = read_float(addr);
 	beta = read_float(addr);
 	K = exp(logRc - beta / Tc);
+	if (!adc_table || R0 != old[0] || R1 != old[1] || logRc != old[2] || Tc != old[3] || beta != old[4])
+		build_table();
 	//debug("K %f R0 %f R1 %f logRc %f Tc %f beta %f", K, R0, R1, logRc, Tc, beta);
 	/*
 	core_C = read_float(addr);
@@ -53,6 +57,19 @@ void Temp::load(int32_t &addr, int id)
 	}
 	last_change_time = millis();
 	hold_time = read_float(addr);
+	bool had_pid = pid[0] > 0;
+	for (int i = 0; i < 3; ++i)
+		pid[i] = read_float(addr);
+	if (pid[0] > 0) {
+		if (!had_pid) {
+			pid_integral = 0;
+			pid_last = NAN;
+		}
+	}
+	else if (had_pid)
+		arch_set_duty(power_pin[0], 1);
+	adctarget[0] = toadc(pid[0] > 0 ? target[0] + TEMP_PID_BAND : target[0], MAXINT);
+	temp_control_update();
 	if (old_pin != thermistor_pin.write() && old_valid)
 		arch_setup_temp(~0, old_pin_pin, false);
 	if (thermistor_pin.valid()) {
@@ -89,9 +106,31 @@ void Temp::save(int32_t &addr)
 	write_float(addr, limit[1][0]);
 	write_float(addr, limit[1][1]);
 	write_float(addr, hold_time);
+	for (int i = 0; i < 3; ++i)
+		write_float(addr, pid[i]);
+}
+
+void Temp::build_table() {
+	::free(adc_table);
+	adc_table = NULL;
+	if (isnan(beta))
+		return;
+	adc_table = reinterpret_cast <double *>(malloc((1 << ADCBITS) * sizeof(double)));
+	if (!adc_table) {
+		debug("unable to allocate thermistor table; computing temperatures instead");
+		return;
+	}
+	for (int32_t adc = 0; adc < 1 << ADCBITS; ++adc)
+		adc_table[adc] = compute(adc);
 }
 
 double Temp::fromadc(int32_t adc) {
+	if (adc_table && adc >= 0 && adc < 1 << ADCBITS)
+		return adc_table[adc];
+	return compute(adc);
+}
+
+double Temp::compute(int32_t adc) {
 	if (adc >= MAXINT)
 		return NAN;
 	if (isnan(beta)) {
@@ -125,7 +164,17 @@ int32_t Temp::toadc(double T, int32_t default_) {
 		return -1;
 	double Rs = K * exp(beta * 1. / T);
 	//debug("K %f Rs %f R0 %f logRc %f Tc %f beta %f", K, Rs, R0, logRc, Tc, beta);
-	return ((1 << ADCBITS) - 1) * Rs / (Rs + R0);
+	if (!adc_table)
+		return ((1 << ADCBITS) - 1) * Rs / (Rs + R0);
+	// Invert the formula in compute() for an estimate, then use the table to make it exact:
+	// the result is the highest ADC value which is at least T, or -1 if there is none.
+	double estimate = (1 << ADCBITS) / (R0 / Rs + 1 + R0 / R1);
+	int32_t adc = isnan(estimate) ? -1 : estimate >= (1 << ADCBITS) - 1 ? (1 << ADCBITS) - 1 : estimate < 0 ? -1 : int32_t(estimate);
+	while (adc + 1 < 1 << ADCBITS && adc_table[adc + 1] >= T)
+		++adc;
+	while (adc >= 0 && !(adc_table[adc] >= T))
+		--adc;
+	return adc;
 }
 
 void Temp::init() {
@@ -160,12 +209,20 @@ void Temp::init() {
 	last_temp_time = utime();
 	time_on = 0;
 	K = NAN;
+	adc_table = NULL;
 	hold_time = 0;
+	adclast = MAXINT;
+	for (int i = 0; i < 3; ++i)
+		pid[i] = NAN;
+	pid_integral = 0;
+	pid_last = NAN;
 }
 
 void Temp::free() {
 	if (thermistor_pin.valid())
 		arch_setup_temp(~0, thermistor_pin.pin, false);
+	::free(adc_table);
+	adc_table = NULL;
 	power_pin[0].read(0);
 	power_pin[1].read(0);
 	thermistor_pin.read(0);
@@ -203,9 +260,22 @@ void Temp::copy(Temp &dst) {
 	dst.last_temp_time = last_temp_time;
 	dst.time_on = time_on;
 	dst.K = K;
+	// The table is moved, because the old object is deleted without calling free().
+	dst.adc_table = adc_table;
+	adc_table = NULL;
+	dst.adclast = adclast;
+	for (int i = 0; i < 3; ++i)
+		dst.pid[i] = pid[i];
+	dst.pid_integral = pid_integral;
+	dst.pid_last = pid_last;
 }
 
 void handle_temp(int id, int temp) { // {{{
+	temps[id].adclast = temp;
+	status_temp(id, temps[id].fromadc(temp));
+	// The heater is switched on below adctarget; its power is then the duty of the pin.
+	double duty = temps[id].power_pin[0].valid() && temps[id].adctarget[0] >= 0 && temps[id].adctarget[0] < temp ? arch_get_duty(temps[id].power_pin[0]) : 0;
+	telemetry_temp(id, temp, temps[id].fromadc(temp), duty);
 	if (store_adc)
 		fprintf(store_adc, "%d %d %f %d\n", millis(), id, temps[id].fromadc(temp), temp);
 	if (requested_temp < num_temps && temps[requested_temp].thermistor_pin.pin == temps[id].thermistor_pin.pin) {
@@ -270,3 +340,46 @@ void handle_temp(int id, int temp) { // {{{
 	}
 	*/
 } // }}}
+
+void temp_control_update() { // {{{
+	// Run the control timer only if a heater needs it.
+	bool active = false;
+	for (int t = 0; t < num_temps; ++t) {
+		if (temps[t].pid[0] > 0 && !isnan(temps[t].target[0]))
+			active = true;
+	}
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = 0;
+	spec.it_interval.tv_nsec = active ? TEMP_CONTROL_NS : 0;
+	spec.it_value = spec.it_interval;
+	timerfd_settime(pollfds[POLL_PID].fd, 0, &spec, NULL);
+} // }}}
+
+void temp_control() { // {{{
+	// PID control of the heater duty.  The hardware still switches the heater on and off at its target, which is
+	// TEMP_PID_BAND above the real target; this controls the power while it is on.
+	uint64_t expirations;
+	if (read(pollfds[POLL_PID].fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	double dt = expirations * (TEMP_CONTROL_NS / 1e9);
+	for (int t = 0; t < num_temps; ++t) {
+		Temp &tp = temps[t];
+		if (!(tp.pid[0] > 0) || !tp.power_pin[0].valid() || isnan(tp.target[0]) || isinf(tp.target[0]))
+			continue;
+		double T = tp.fromadc(tp.adclast);
+		if (isnan(T) || isinf(T))
+			continue;
+		double error = tp.target[0] - T;
+		// The derivative is of the measurement, so a new target does not cause a kick.
+		double derivative = isnan(tp.pid_last) ? 0 : (T - tp.pid_last) / dt;
+		tp.pid_last = T;
+		double p = tp.pid[0] * error - (isnan(tp.pid[2]) ? 0 : tp.pid[2] * derivative);
+		double i = tp.pid_integral + (isnan(tp.pid[1]) ? 0 : tp.pid[1] * error * dt);
+		// Anti-windup: don't integrate further into saturation.
+		double out = p + i;
+		if (!(out > 1 && error > 0) && !(out < 0 && error < 0))
+			tp.pid_integral = i < 0 ? 0 : i > 1 ? 1 : i;
+		out = p + tp.pid_integral;
+		arch_set_duty(tp.power_pin[0], out < 0 ? 0 : out > 1 ? 1 : out);
+	}
+} // }}}
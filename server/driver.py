@@ -25,6 +25,43 @@ show_own_debug = False
 C0 = 273.15	# Conversion between K and °C
 WAIT = object()	# Sentinel for blocking functions.
 NUM_SPACES = 3
+# Layout of struct StatusPage in cdriver.h.
+STATUS_VERSION = 2
+STATUS_MAX_AXES = 8
+STATUS_MAX_TEMPS = 8
+STATUS_FORMAT = '=IIiiiidd%di%di%dd%dd%ddd' % (NUM_SPACES, NUM_SPACES, NUM_SPACES * STATUS_MAX_AXES, NUM_SPACES * STATUS_MAX_AXES, STATUS_MAX_TEMPS)
+# Number of times a shared page is read before giving up if the cdriver keeps writing it (or died while writing it).
+SHM_RETRIES = 1000
+# Layout of struct CommandRing in cdriver.h.
+RING_VERSION = 1
+RING_SLOTS = 64
+RING_SLOT_SIZE = 512
+RING_HEADER = 16
+RING_WAITING = 1 << 32
+# Layout of struct TelemetryPage in cdriver.h.
+TELEMETRY_VERSION = 1
+TELEMETRY_LENGTH = 512
+TELEMETRY_TIERS = 4
+TELEMETRY_FACTOR = 10
+TELEMETRY_HEADER = '=IIIIII'
+TELEMETRY_RECORD = '=dddddd'
+TELEMETRY_TEMP_HEADER = '=II%dQ' % TELEMETRY_TIERS
+# Size of one sensor: TELEMETRY_TEMP_HEADER, then TELEMETRY_LENGTH records of every tier.  (struct is not imported yet here.)
+TELEMETRY_TEMP_SIZE = 4 + 4 + 8 * TELEMETRY_TIERS + TELEMETRY_TIERS * TELEMETRY_LENGTH * 6 * 8
+# Computes the CRC-32 of a run file after its header.  This runs in its own process, so large files don't block the driver.
+RUN_CHECKSUM_SCRIPT = '''import sys, zlib
+crc = 0
+with open(sys.argv[1], 'rb') as f:
+	f.seek(int(sys.argv[2]))
+	while True:
+		data = f.read(1 << 20)
+		if len(data) == 0:
+			break
+		crc = zlib.crc32(data, crc)
+print(crc)
+'''
+# Maximum length of a packet to the cdriver (HOST_COMMAND_SIZE in cdriver.h).
+HOST_COMMAND_SIZE = 0x4000
 # Space types
 TYPE_CARTESIAN = 0
 TYPE_DELTA = 1
@@ -55,8 +92,12 @@ import subprocess
 import traceback
 import protocol
 import mmap
+import zlib
 import random
 import errno
+import atexit
+import ctypes
+import ctypes.util
 # }}}
 
 config = fhs.init(packagename = 'franklin', config = { # {{{
@@ -83,6 +124,23 @@ def dprint(x, data): # {{{
 		log('%s: %s' % (x, ' '.join(['%02x' % c for c in data])))
 # }}}
 
+# Memory barrier for reading the shared pages.  {{{
+# The cdriver writes them with release ordering; without an acquire fence on
+# the reading side, a weakly ordered cpu (like the BBB's) can return a torn
+# read that still sees matching sequence numbers.
+try:
+	_atomic_thread_fence = ctypes.CDLL(ctypes.util.find_library('atomic')).atomic_thread_fence
+	_atomic_thread_fence.argtypes = (ctypes.c_int,)
+	_atomic_thread_fence.restype = None
+except (OSError, AttributeError, TypeError):
+	_atomic_thread_fence = None
+	log('libatomic is not available; reading shared pages without a memory barrier')
+
+def shm_fence():
+	if _atomic_thread_fence is not None:
+		_atomic_thread_fence(5)	# __ATOMIC_SEQ_CST
+# }}}
+
 # Decorator for functions which block.
 def delayed(f): # {{{
 	def ret(self, *a, **ka):
@@ -98,9 +156,25 @@ def delayed(f): # {{{
 class Driver: # {{{
 	def __init__(self, port, run_id):
 		#log(repr(config))
-		self.driver = subprocess.Popen((config['cdriver'], port, run_id), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True)
+		# Moves are sent through a ring in shared memory if possible; the eventfd is used to announce them.
+		env = dict(os.environ)
+		if hasattr(os, 'eventfd'):
+			self.doorbell = os.eventfd(0, os.EFD_CLOEXEC | os.EFD_NONBLOCK)
+			env['FRANKLIN_DOORBELL'] = '%d' % self.doorbell
+			fds = (self.doorbell,)
+		else:
+			self.doorbell = None
+			fds = ()
+		self.driver = subprocess.Popen((config['cdriver'], port, run_id), stdin = subprocess.PIPE, stdout = subprocess.PIPE, close_fds = True, pass_fds = fds, env = env)
 		fcntl.fcntl(self.driver.stdout.fileno(), fcntl.F_SETFL, os.O_NONBLOCK)
+		# Don't leave the shared pages behind if this process exits before they are mapped.
+		atexit.register(self.unlink_pages)
 		self.buffer = b''
+		self.status_map = None
+		self.telemetry_map = None
+		self.ring_map = None
+		self.ring_head = 0
+		self.ring_pending = 0
 	def available(self):
 		return len(self.buffer) > 0
 	def write(self, data):
@@ -133,6 +207,117 @@ class Driver: # {{{
 		sys.exit(0)
 	def fileno(self):
 		return self.driver.stdout.fileno()
+	def page_name(self, page):
+		return '/dev/shm/franklin-%s-%d' % (page, self.driver.pid)
+	def map_page(self, page, size, access):
+		'''Map a shared page of the cdriver and unlink it, so it does not outlive the cdriver.
+		Returns None if the page is not available.'''
+		name = self.page_name(page)
+		try:
+			with open(name, 'rb' if access == mmap.ACCESS_READ else 'r+b') as f:
+				ret = mmap.mmap(f.fileno(), size, access = access)
+		except (IOError, OSError, ValueError):
+			ret = None
+		try:
+			os.unlink(name)
+		except OSError:
+			pass
+		return ret
+	def map_pages(self):
+		'''Map the shared pages.  This must be called after the first reply from the cdriver, because it creates them during setup.'''
+		self.status_map = self.map_page('status', struct.calcsize(STATUS_FORMAT), mmap.ACCESS_READ)
+		self.telemetry_map = self.map_page('telemetry', struct.calcsize(TELEMETRY_HEADER) + STATUS_MAX_TEMPS * TELEMETRY_TEMP_SIZE, mmap.ACCESS_READ)
+		if self.ring_active():
+			self.ring_map = self.map_page('ring', RING_HEADER + RING_SLOTS * RING_SLOT_SIZE, mmap.ACCESS_WRITE)
+			if self.ring_map is None:
+				log('command ring is not available; sending moves as packets')
+				self.doorbell = None
+			elif struct.unpack_from('=III', self.ring_map) != (RING_VERSION, RING_SLOTS, RING_SLOT_SIZE):
+				log('command ring has unexpected layout; sending moves as packets')
+				self.ring_map = None
+				self.doorbell = None
+	def unlink_pages(self):
+		'''Remove the pages which were not mapped, if the cdriver created them.'''
+		for page in ('status', 'ring', 'telemetry'):
+			try:
+				os.unlink(self.page_name(page))
+			except OSError:
+				pass
+	def status(self):
+		'''Read the status page which is published by the cdriver.
+		Returns None if the page is not available.'''
+		if self.status_map is None:
+			return None
+		for i in range(SHM_RETRIES):
+			# Retry while the page is being written, or if it was changed while reading it.
+			seq = struct.unpack_from('=I', self.status_map)[0]
+			if seq & 1:
+				continue
+			shm_fence()
+			data = struct.unpack_from(STATUS_FORMAT, self.status_map)
+			shm_fence()
+			if seq == struct.unpack_from('=I', self.status_map)[0]:
+				return data
+		return None
+	def telemetry(self, which):
+		'''Read the temperature history of one sensor from the telemetry page.
+		Returns a list of records for every tier, oldest first, or None if the page is not available.
+		A record is (time, adc, min, max, mean, duty).'''
+		header_size = struct.calcsize(TELEMETRY_HEADER)
+		if self.telemetry_map is None:
+			return None
+		version, num_temps, length, tiers, factor, reserved = struct.unpack_from(TELEMETRY_HEADER, self.telemetry_map)
+		if (version, length, tiers, factor) != (TELEMETRY_VERSION, TELEMETRY_LENGTH, TELEMETRY_TIERS, TELEMETRY_FACTOR) or not 0 <= which < STATUS_MAX_TEMPS:
+			return None
+		pos = header_size + which * TELEMETRY_TEMP_SIZE
+		for i in range(SHM_RETRIES):
+			# Copy the sensor in one go, then check that it was not changed while copying.
+			seq = struct.unpack_from('=I', self.telemetry_map, pos)[0]
+			if seq & 1:
+				continue
+			shm_fence()
+			data = self.telemetry_map[pos:pos + TELEMETRY_TEMP_SIZE]
+			shm_fence()
+			if seq == struct.unpack_from('=I', self.telemetry_map, pos)[0]:
+				break
+		else:
+			return None
+		counts = struct.unpack_from(TELEMETRY_TEMP_HEADER, data)[2:]
+		record_size = struct.calcsize(TELEMETRY_RECORD)
+		ret = []
+		for tier in range(TELEMETRY_TIERS):
+			base = struct.calcsize(TELEMETRY_TEMP_HEADER) + tier * TELEMETRY_LENGTH * record_size
+			num = min(counts[tier], TELEMETRY_LENGTH)
+			ret.append([struct.unpack_from(TELEMETRY_RECORD, data, base + ((counts[tier] - num + i) % TELEMETRY_LENGTH) * record_size) for i in range(num)])
+		return ret
+	def ring_push(self, data):
+		'''Put a move in the command ring.
+		Returns None if the ring cannot be used for it and it must be
+		sent as a packet, False if it must wait until the ring is
+		empty, True if it was added.'''
+		if not self.ring_active() or self.ring_map is None:
+			return None
+		used = (self.ring_head - struct.unpack_from('=I', self.ring_map, 12)[0]) & 0xffffffff
+		if len(data) > RING_SLOT_SIZE:
+			# Too long for the ring; it can be sent as a packet when the ring is empty.
+			return None if used == 0 else False
+		if used >= RING_SLOTS:
+			return False
+		pos = RING_HEADER + (self.ring_head % RING_SLOTS) * RING_SLOT_SIZE
+		self.ring_map[pos:pos + len(data)] = data
+		self.ring_head = (self.ring_head + 1) & 0xffffffff
+		self.ring_pending += 1
+		return True
+	def ring_active(self):
+		return self.doorbell is not None
+	def ring_doorbell(self, waiting = False):
+		'''Announce new moves in the command ring to the cdriver.
+		If waiting is True, it will send CONTINUE when the ring is empty.'''
+		value = self.ring_pending + (RING_WAITING if waiting else 0)
+		if self.doorbell is None or value == 0:
+			return
+		os.eventfd_write(self.doorbell, value)
+		self.ring_pending = 0
 # }}}
 
 # Reading and writing pins to and from ini files. {{{
@@ -186,6 +371,7 @@ class Printer: # {{{
 		self.job_output = ''
 		self.jobs_active = []
 		self.jobs_angle = 0
+		self.jobs_first_record = 0
 		self.probemap = None
 		self.job_current = 0
 		self.job_id = None
@@ -201,6 +387,7 @@ class Printer: # {{{
 		self.home_target = None
 		self.home_cb = [False, self._do_home]
 		self.probe_cb = [False, None]
+		self.probe_grid_file = None
 		self.probe_speed = 3.
 		self.gcode_file = False
 		self.gcode_map = None
@@ -210,6 +397,8 @@ class Printer: # {{{
 		self.queue = []
 		self.queue_pos = 0
 		self.queue_info = None
+		self.held_moves = []
+		self.line_batch = []
 		self.confirm_waits = set()
 		self.gpio_waits = {}
 		self.total_time = [float('nan'), float('nan')]
@@ -253,6 +442,8 @@ class Printer: # {{{
 		self.current_extruder = 0
 		# Get the printer state.
 		self._read_globals(False)
+		# The cdriver has replied, so its shared pages exist now.
+		self.printer.map_pages()
 		for i, s in enumerate(self.spaces):
 			s.read(self._read('SPACE', i))
 		for i, t in enumerate(self.temps):
@@ -301,6 +492,9 @@ class Printer: # {{{
 		# Fill job queue.
 		self.jobqueue = {}
 		self.audioqueue = {}
+		self.compiling = {}	# Background g-code compilers, by job name.
+		self.checking = {}	# Background checksum checks, by job name: (process, checksum, file key, angle, abort).
+		self.valid_files = {}	# File keys of run files which are known to be valid, by job name.
 		spool = fhs.read_spool(self.uuid, dir = True, opened = False)
 		if spool is not None:
 			gcode = os.path.join(spool, 'gcode')
@@ -314,8 +508,15 @@ class Printer: # {{{
 					try:
 						#log('opening %s' % filename)
 						with open(os.path.join(gcode, filename), 'rb') as f:
-							f.seek(-8 * 8, os.SEEK_END)
-							self.jobqueue[name] = struct.unpack('=' + 'd' * 8, f.read())
+							header = struct.unpack(protocol.run_header, f.read(struct.calcsize(protocol.run_header)))
+							if header[0].rstrip(b'\0') != protocol.run_magic or header[1] != protocol.run_version or not header[2]:
+								log('skipping incomplete or old style gcode file %s' % filename)
+								continue
+							# The index is at the end, so a truncated file has the wrong size.  The checksum is checked when the file is run.
+							if os.fstat(f.fileno()).st_size != header[13] + header[14] * struct.calcsize(protocol.run_snapshot % (header[4] + 1)):
+								log('skipping truncated gcode file %s' % filename)
+								continue
+						self.jobqueue[name] = header[5:13]
 					except:
 						traceback.print_exc()
 						log('failed to open gcode file %s' % os.path.join(gcode, filename))
@@ -532,6 +733,9 @@ class Printer: # {{{
 			elif cmd == protocol.rcommand['LIMIT']:
 				if s < len(self.spaces) and m < len(self.spaces[s].motor):
 					self.limits[s][m] = f
+				if self.probe_grid_file is not None:
+					# The cdriver handles limits while it probes a grid; it sends PROBE_DONE when it stops.
+					continue
 				#log('limit; %d waits' % e)
 				self._trigger_movewaits(self.movewait, False)
 				continue
@@ -584,7 +788,17 @@ class Printer: # {{{
 				call_queue.append((self.park(cb = cb, abort = False)[1], (None,)))
 				continue
 			elif cmd == protocol.rcommand['FILE_DONE']:
-				call_queue.append((self._print_done, (True, 'completed')))
+				if s == 1:
+					call_queue.append((self._print_done, (False, 'run file is damaged')))
+				else:
+					call_queue.append((self._print_done, (True, 'completed')))
+				continue
+			elif cmd == protocol.rcommand['PROBE_DONE']:
+				if s == 2:
+					log('probe did not hit anything; probe map aborted')
+				if self.probe_cb in self.movecb:
+					self.movecb.remove(self.probe_cb)
+					call_queue.append((self.probe_cb[1], [True if s == 1 else None]))
 				continue
 			elif cmd == protocol.rcommand['PINNAME']:
 				self.pin_names[s] = data
@@ -691,7 +905,7 @@ class Printer: # {{{
 		self.queue_length, self.num_pins, num_temps, num_gpios = struct.unpack('=BBBB', data[:4])
 		if self.pin_names is None:
 			self.pin_names = [''] * self.num_pins
-		self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.timeout, self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc = struct.unpack('=HHHHHhhhdddBddd?', data[4:])
+		self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, self.timeout, self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.run_horizon, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc, self.probe_bicubic = struct.unpack('=HHHHHhhhddddBddd??', data[4:])
 		while len(self.temps) < num_temps:
 			self.temps.append(self.Temp(len(self.temps)))
 			if update:
@@ -713,7 +927,7 @@ class Printer: # {{{
 			ng = len(self.gpios)
 		dt = nt - len(self.temps)
 		dg = ng - len(self.gpios)
-		data = struct.pack('=BBHHHHHhhhdddBddd?', nt, ng, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, int(self.timeout), self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc)
+		data = struct.pack('=BBHHHHHhhhddddBddd??', nt, ng, self.led_pin, self.stop_pin, self.probe_pin, self.spiss_pin, int(self.timeout), self.bed_id, self.fan_id, self.spindle_id, self.feedrate, self.max_deviation, self.max_v, self.run_horizon, self.current_extruder, self.targetx, self.targety, self.zoffset, self.store_adc, self.probe_bicubic)
 		self._send_packet(struct.pack('=B', protocol.command['WRITE_GLOBALS']) + data)
 		self._read_globals(update = True)
 		if update:
@@ -805,7 +1019,7 @@ class Printer: # {{{
 		self.gcode_fd = -1
 	# }}}
 	def _print_done(self, complete, reason): # {{{
-		self._send_packet(struct.pack('=BBddBB', protocol.command['RUN_FILE'], 0, 0, 0, 0xff, 0))
+		self._send_packet(struct.pack('=BBddBBL', protocol.command['RUN_FILE'], 0, 0, 0, 0xff, 0, 0))
 		if self.gcode_map is not None:
 			log(reason)
 			self._gcode_close()
@@ -845,6 +1059,7 @@ class Printer: # {{{
 				self._send(id, 'error', 'aborted')
 		self.queue = []
 		self.queue_pos = 0
+		self.held_moves = []
 		if self.home_phase is not None:
 			#log('killing homer')
 			self.home_phase = None
@@ -895,12 +1110,19 @@ class Printer: # {{{
 		while name == '' or name in self.jobqueue:
 			name = '%s-%d' % (origname, i)
 			i += 1
-		bbox, errors = self._gcode_parse(f, name)
+		ret = self._gcode_compile(f, name)
+		if ret is None:
+			ret = self._gcode_parse(f, name)
+		bbox, errors = ret
 		for e in errors:
 			log(e)
 		if bbox is None:
 			return errors
-		self.jobqueue[os.path.splitext(name)[0]] = bbox
+		name = os.path.splitext(name)[0]
+		self.jobqueue[name] = bbox
+		if name not in self.compiling:
+			# The file was just written, so its checksum doesn't need to be checked.
+			self.valid_files[name] = self._run_file_key(name)
 		self._broadcast(None, 'queue', [(q, self.jobqueue[q]) for q in self.jobqueue])
 		return errors
 	# }}}
@@ -943,6 +1165,10 @@ class Printer: # {{{
 		if self.paused and not self.resuming and len(self.queue) == 0:
 			#log('queue is empty')
 			return
+		while len(self.held_moves) > 0 and not self.wait:
+			if not self._send_move(self.held_moves[0]):
+				break
+			self.held_moves.pop(0)
 		while not self.wait and (self.queue_pos < len(self.queue) or self.resuming):
 			#log('queue not empty %s' % repr((self.queue_pos, len(self.queue), self.resuming, self.wait)))
 			if self.queue_pos >= len(self.queue):
@@ -1055,11 +1281,60 @@ class Printer: # {{{
 			self.movewait += 1
 			#log('movewait +1 -> %d' % self.movewait)
 			#log('queueing %s' % repr((axes, f0, f1, self.flushing)))
-			self._send_packet(p + bytes(targets) + args, move = True)
+			if not self._send_move(p + bytes(targets) + args):
+				# Send it when the cdriver has room again.
+				self.held_moves.append(p + bytes(targets) + args)
 			if self.flushing is None:
 				self.flushing = False
+		self._flush_lines()
+		self.printer.ring_doorbell()
 		#log('queue done %s' % repr((self.queue_pos, len(self.queue), self.resuming, self.wait)))
 	# }}}
+	def _send_move(self, data): # {{{
+		'''Send a move, through the command ring if possible.
+		Without the ring, moves are collected and sent as one
+		CMD_LINES packet by _flush_lines.
+		Returns False if the move could not be sent; in that case
+		self.wait is set and the move must be sent again after CONTINUE.
+		'''
+		ret = self.printer.ring_push(data)
+		if ret is None:
+			if self.printer.ring_active():
+				# Too long for the ring, which is empty; send it now to keep the order.
+				self._send_packet(data, move = True)
+				return True
+			if 3 + sum(len(x) for x in self.line_batch) + len(data) > HOST_COMMAND_SIZE:
+				self._flush_lines()
+				if self.wait:
+					return False
+			self.line_batch.append(data)
+		elif not ret:
+			self.printer.ring_doorbell(True)
+			self.wait = True
+			return False
+		return True
+	# }}}
+	def _flush_lines(self): # {{{
+		'''Send the moves that were collected by _send_move.
+		Moves which the cdriver does not accept are held until CONTINUE.
+		'''
+		batch = self.line_batch
+		self.line_batch = []
+		if len(batch) == 0:
+			return
+		if len(batch) == 1:
+			self._send_packet(batch[0], move = True)
+			return
+		self._send_packet(bytes((protocol.command['LINES'],)) + b''.join(batch))
+		cmd, s, m, f, e, data = self._get_reply()
+		if cmd != protocol.rcommand['ACCEPTED']:
+			log('invalid reply to lines command')
+			return
+		if s < len(batch):
+			self.held_moves[:0] = batch[s:]
+		if m or s < len(batch):
+			self.wait = True
+	# }}}
 	def _do_home(self, done = None): # {{{
 		#log('do_home: %s %s' % (self.home_phase, done))
 		# 0: Prepare for next order.
@@ -1419,6 +1694,43 @@ class Printer: # {{{
 			# Retract
 			self.line([{2: z}])
 	# }}}
+	def _probe_grid(self, id, angle, good = True): # {{{
+		'''Probe the whole map in the cdriver; this requires a valid probe pin.'''
+		p = self.probemap
+		if good is None:
+			# Aborted by the host or failed in the cdriver.
+			self.probe_grid_file = None
+			self._do_probe(id, 0, 0, 0, angle, good = None)
+			return
+		if self.probe_grid_file is None:
+			if not self.position_valid:
+				self.home(cb = lambda: self._probe_grid(id, angle), abort = False)[1](None)
+				return
+			self.probing = True
+			self.probe_grid_file = fhs.write_spool(os.path.join(self.uuid, 'probe', 'grid' + os.extsep + 'bin'), text = False, opened = False)
+			self.probe_cb[1] = lambda good: self._probe_grid(id, angle, good)
+			self.movecb.append(self.probe_cb)
+			self._send_packet(struct.pack('=BdddddddddLLL', protocol.command['PROBE_GRID'], p[0][0], p[0][1], p[0][2], p[0][3], self.gcode_angle[0], self.gcode_angle[1], self.probe_speed, self.probe_safe_dist, self.spaces[0].axis[2]['min'], p[1][0], p[1][1], self.num_probes) + self.probe_grid_file.encode('utf8'))
+			return
+		if not good:
+			# This callback was not for the grid; keep waiting for PROBE_DONE.
+			self.movecb.append(self.probe_cb)
+			return
+		# Done; the samples are in the file.
+		with open(self.probe_grid_file, 'rb') as f:
+			data = f.read()
+		self.probe_grid_file = None
+		header = struct.calcsize('@ddddddLL')
+		n = (p[1][0] + 1) * (p[1][1] + 1)
+		if len(data) != header + n * struct.calcsize('@d'):
+			log('Invalid probe file written by cdriver')
+			self._do_probe(id, 0, 0, 0, angle, good = None)
+			return
+		samples = struct.unpack('@%dd' % n, data[header:])
+		for y in range(p[1][1] + 1):
+			p[2][y] = list(samples[y * (p[1][0] + 1):(y + 1) * (p[1][0] + 1)])
+		self._do_probe(id, 0, p[1][1] + 1, 0, angle)
+	# }}}
 	def _next_job(self): # {{{
 		# Set all extruders to 0.
 		#log('next job list: %s, current: %d' % (repr(self.jobs_active), self.job_current))
@@ -1442,9 +1754,64 @@ class Printer: # {{{
 			cb()
 		self.gcode_id = None
 	# }}}
+	def _run_file_key(self, src): # {{{
+		'''Return the size and modification time of a run file, or None if it cannot be read.'''
+		filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', src + os.extsep + 'bin'), text = False, opened = False)
+		try:
+			stat = os.stat(filename)
+		except (TypeError, OSError):
+			return None
+		return stat.st_size, stat.st_mtime_ns
+	# }}}
+	def _run_file_valid(self, src, angle, abort): # {{{
+		'''Check the checksum of a run file before it is run.
+		Files which are still being compiled don't have one yet, and files which were written or checked
+		since they last changed are not checked again.  Otherwise the check runs in the background and
+		False is returned; _run_file_checked starts the job when it is done.'''
+		if src in self.compiling:
+			return True
+		key = self._run_file_key(src)
+		if key is not None and self.valid_files.get(src) == key:
+			return True
+		if src in self.checking:
+			process = self.checking.pop(src)[0]
+			process.kill()
+			process.communicate()
+		filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', src + os.extsep + 'bin'), text = False, opened = False)
+		try:
+			with open(filename, 'rb') as f:
+				header = struct.unpack(protocol.run_header, f.read(struct.calcsize(protocol.run_header)))
+			process = subprocess.Popen((sys.executable, '-c', RUN_CHECKSUM_SCRIPT, filename, str(struct.calcsize(protocol.run_header))), stdout = subprocess.PIPE, close_fds = True)
+		except (TypeError, IOError, OSError, struct.error):
+			log('unable to read gcode file %s' % filename)
+			self._print_done(False, 'run file is damaged')
+			return False
+		self.checking[src] = (process, header[15], key, angle, abort)
+		return False
+	# }}}
+	def _run_file_checked(self, src): # {{{
+		'''Handle the result of a background checksum check, and start the job if it is still current.'''
+		process, crc, key, angle, abort = self.checking.pop(src)
+		output = process.communicate()[0]
+		try:
+			valid = process.returncode == 0 and int(output) == crc
+		except ValueError:
+			valid = False
+		if valid:
+			self.valid_files[src] = key
+		if not 0 <= self.job_current < len(self.jobs_active) or self.jobs_active[self.job_current] != src:
+			return
+		if not valid:
+			log('gcode file %s has an invalid checksum' % src)
+			self._print_done(False, 'run file is damaged')
+			return
+		self._gcode_run(src, angle, abort)
+	# }}}
 	def _gcode_run(self, src, angle = 0, abort = True): # {{{
 		if self.parking:
 			return
+		if not self._run_file_valid(src, angle, abort):
+			return
 		angle = math.radians(angle)
 		self.gcode_angle = math.sin(angle), math.cos(angle)
 		if self.bed_id < len(self.temps):
@@ -1466,6 +1833,8 @@ class Printer: # {{{
 				self.set_axis_pos(1, e, 0)
 		filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', src + os.extsep + 'bin'), text = False, opened = False)
 		self.total_time = self.jobqueue[src][-2:]
+		first_record = self.jobs_first_record
+		self.jobs_first_record = 0
 		if self.probemap is not None:
 			self.gcode_file = True
 			self._globals_update()
@@ -1484,12 +1853,80 @@ class Printer: # {{{
 				for y in range(self.probemap[1][1] + 1):
 					for x in range(self.probemap[1][0] + 1):
 						probemap_file.write(struct.pack('@d', self.probemap[2][y][x]))
-			self._send_packet(struct.pack('=BBddBB', protocol.command['RUN_FILE'], 1 if self.confirmer is None else 0, self.gcode_angle[0], self.gcode_angle[1], 0xff, len(encoded_probemap_filename)) + encoded_filename + encoded_probemap_filename)
+			self._send_packet(struct.pack('=BBddBBL', protocol.command['RUN_FILE'], 1 if self.confirmer is None else 0, self.gcode_angle[0], self.gcode_angle[1], 0xff, len(encoded_probemap_filename), first_record) + encoded_filename + encoded_probemap_filename)
 		else:
 			# Let cdriver do the work.
 			self.gcode_file = True
 			self._globals_update()
-			self._send_packet(struct.pack('=BBddBB', protocol.command['RUN_FILE'], 1 if self.confirmer is None else 0, self.gcode_angle[0], self.gcode_angle[1], 0xff, 0) + filename.encode('utf8'))
+			self._send_packet(struct.pack('=BBddBBL', protocol.command['RUN_FILE'], 1 if self.confirmer is None else 0, self.gcode_angle[0], self.gcode_angle[1], 0xff, 0, first_record) + filename.encode('utf8'))
+	# }}}
+	def _arc_tolerance(self): # {{{
+		'''Maximum distance between a fitted arc and the line segments it replaces.'''
+		return self.max_deviation if self.max_deviation > 0 else .1
+	# }}}
+	def _gcode_compile(self, src, name): # {{{
+		'''Parse g-code with franklin-gcode, which is installed next to the cdriver.
+		The result is the same as from _gcode_parse, but the run file uses the compact encoding.
+		None is returned if the compiler cannot be used.
+		If compiling takes long, it continues in the background and a provisional bounding box is returned.
+		The job can be printed while it is being compiled.'''
+		compiler = os.path.join(os.path.dirname(os.path.realpath(config['cdriver'])), 'franklin-gcode')
+		srcname = getattr(src, 'name', None)
+		if not isinstance(srcname, str) or not os.path.exists(srcname) or not os.access(compiler, os.X_OK):
+			return None
+		num_extruders = len(self.spaces[1].axis) if len(self.spaces) > 1 else -1
+		park = ''.join('1' if len(self.spaces[0].axis) > a and not math.isnan(self.spaces[0].axis[a]['park']) else '0' for a in range(6))
+		dst = fhs.write_spool(os.path.join(self.uuid, 'gcode', os.path.splitext(name)[0] + os.path.extsep + 'bin'), text = False, opened = False)
+		self._broadcast(None, 'blocked', 'parsing g-code')
+		try:
+			# Pass the input as a file descriptor, so it doesn't matter if the caller removes it.
+			process = subprocess.Popen((compiler, '-c', '-d', repr(self._arc_tolerance()), str(len(self.temps)), str(num_extruders), park, self.allow_system, '/dev/fd/%d' % src.fileno(), dst), stdout = subprocess.PIPE, close_fds = True, pass_fds = (src.fileno(),))
+			try:
+				output = process.communicate(timeout = 1)[0]
+			except subprocess.TimeoutExpired:
+				self.compiling[os.path.splitext(name)[0]] = process
+				return [0.] * 8, []
+			if process.returncode != 0:
+				raise ValueError('compiler returned %d' % process.returncode)
+			result = json.loads(output.decode('utf-8', 'replace'))
+		except (OSError, ValueError):
+			log('native g-code compiler failed; using slow parser')
+			traceback.print_exc()
+			return None
+		finally:
+			self._broadcast(None, 'blocked', None)
+		return result['bbox'], result['errors']
+	# }}}
+	def _gcode_compile_done(self, name): # {{{
+		'''Handle the result of a compiler that was running in the background.'''
+		process = self.compiling.pop(name)
+		output = process.communicate()[0]
+		printing = self.gcode_file and 0 <= self.job_current < len(self.jobs_active) and self.jobs_active[self.job_current] == name
+		try:
+			if process.returncode != 0:
+				raise ValueError('compiler returned %d' % process.returncode)
+			result = json.loads(output.decode('utf-8', 'replace'))
+		except ValueError:
+			traceback.print_exc()
+			log('compiling g-code for %s failed' % name)
+			if printing:
+				self._print_done(False, 'compiling g-code failed')
+			if name in self.jobqueue:
+				self.queue_remove(name)
+			return
+		for e in result['errors']:
+			log(e)
+		if name not in self.jobqueue:
+			return
+		if result['bbox'] is None:
+			if not printing:
+				self.queue_remove(name)
+			return
+		self.jobqueue[name] = result['bbox']
+		self.valid_files[name] = self._run_file_key(name)
+		if printing:
+			self.total_time = self.jobqueue[name][-2:]
+		self._broadcast(None, 'queue', [(q, self.jobqueue[q]) for q in self.jobqueue])
 	# }}}
 	def _gcode_parse(self, src, name): # {{{
 		assert len(self.spaces) > 0
@@ -1508,6 +1945,7 @@ class Printer: # {{{
 		time_dist = [0., 0.]
 		pending = []
 		arc = []	# center, r, diff, angle_start, angle_diff
+		epsilon = self._arc_tolerance()
 		tool_changed = False
 		def add_timedist(type, nums):
 			if type == protocol.parsed['LINE']:
@@ -1525,6 +1963,37 @@ class Printer: # {{{
 				time_dist[0] += nums[1]
 			return nums + time_dist
 		with fhs.write_spool(os.path.join(self.uuid, 'gcode', os.path.splitext(name)[0] + os.path.extsep + 'bin'), text = False) as dst:
+			dst.write(struct.pack(protocol.run_header, protocol.run_magic, protocol.run_version, 0, 0, len(self.temps), *([0.] * 8 + [0, 0, 0, protocol.run_encoding_plain, 0])))
+			# Output state, and the state after the written records for the index; see runfile.h.
+			out = {'records': 0, 'offset': struct.calcsize(protocol.run_header), 'crc': 0, 'last_type': None, 'next_snapshot': 0, 'tool': 0, 'pos': [float('nan')] * 3, 'e': {}, 'temp': [float('nan')] * (len(self.temps) + 1)}
+			index = []
+			def output(data):
+				dst.write(data)
+				out['crc'] = zlib.crc32(data, out['crc'])
+				out['offset'] += len(data)
+			def write_record(type, nums):
+				if out['records'] >= out['next_snapshot'] and out['last_type'] not in (protocol.parsed['PRE_LINE'], protocol.parsed['PRE_ARC']):
+					index.append(struct.pack(protocol.run_snapshot % len(out['temp']), out['records'], out['offset'], out['tool'], *(out['pos'] + [out['e'].get(out['tool'], 0.)] + time_dist + out['temp'])))
+					out['next_snapshot'] = (out['records'] // protocol.run_index_interval + 1) * protocol.run_index_interval
+				if type in (protocol.parsed['SYSTEM'], protocol.parsed['CONFIRM']):
+					# Strings are stored inline.
+					string = strings[nums[0]].encode('utf-8')
+					size = struct.calcsize(protocol.run_record)
+					output(struct.pack(protocol.run_record, type, len(string), *add_timedist(type, nums)[1:]))
+					output(string + b'\0' * (-len(string) % size))
+					out['records'] += 1 + len(string) // size + (1 if len(string) % size else 0)
+				else:
+					output(struct.pack(protocol.run_record, type, *add_timedist(type, nums)))
+					out['records'] += 1
+				out['last_type'] = type
+				tool = nums[0]
+				if type in (protocol.parsed['LINE'], protocol.parsed['ARC']):
+					out['tool'] = tool
+					out['pos'] = nums[1:4]
+				if type in (protocol.parsed['LINE'], protocol.parsed['ARC'], protocol.parsed['SETPOS']) and tool >= 0:
+					out['e'][tool] = nums[1] if type == protocol.parsed['SETPOS'] else nums[4]
+				if type == protocol.parsed['SETTEMP'] and -1 <= tool < len(self.temps):
+					out['temp'][tool + 1] = nums[1]
 			def add_record(type, nums = None, force = False):
 				if nums is None:
 					nums = []
@@ -1574,15 +2043,14 @@ class Printer: # {{{
 						diff = sum([(p2 - p1) ** 2 for p1, p2 in zip(mid, cmid)])
 						log('center returns %s' % repr(((xc, yc, z0), r, angles, diff)))
 						return ((xc, yc, z0), r, angles, diff)
-					epsilon = .1	# TODO: check if this should be configurable
-					aepsilon = math.radians(10)	# TODO: check if this should be configurable
 					if len(pending) == 3:
 						# If the points are not on a circle with equal angles, or the angle is too large, push pending[1] through to output.
 						# Otherwise, record settings.
 						arc_ctr, arc_r, angles, arc_diff = center(pending[0][1:4], pending[1][1:4], pending[2][1:4])
-						if arc_diff > epsilon or abs(angles[1] - angles[0] - angles[2] + angles[1]) > aepsilon:
+						# An error in the angle moves the point along the circle by the radius times that error; allow the same deviation as for the chords.
+						if arc_diff > epsilon ** 2 or abs(angles[1] - angles[0] - angles[2] + angles[1]) * arc_r > epsilon:
 							log('not arc: %s' % repr((arc_ctr, arc_r, angles, arc_diff)))
-							dst.write(struct.pack('=Bl' + 'd' * 8, protocol.parsed['LINE'], *add_timedist(type, pending[1])))
+							write_record(protocol.parsed['LINE'], pending[1])
 							pending.pop(0)
 							return
 						arc[:] = [arc_ctr, arc_r, arc_diff, angles[0], (angles[2] - angles[0]) / 2]
@@ -1596,8 +2064,7 @@ class Printer: # {{{
 					return
 				else:
 					flush_pending()
-				#log(repr((type, nums, add_timedist(type, nums))))
-				dst.write(struct.pack('=Bl' + 'd' * 8, type, *add_timedist(type, nums)))
+				write_record(type, nums)
 			def flush_pending():
 				if len(pending) >= 3:
 					flush_arc()
@@ -1651,10 +2118,13 @@ class Printer: # {{{
 					line = line[:p].strip()
 				if comment.upper().startswith('MSG,'):
 					message = comment[4:].strip()
-				elif comment.startswith('SYSTEM:'):
-					if not re.match(self.allow_system, comment[7:]):
-						errors.append('Warning: system command %s is forbidden and will not be run' % comment[7:])
-					add_record(protocol.parsed['SYSTEM'], [add_string(comment[7:])])
+				elif comment.startswith('SYSTEM:') or comment.startswith('SYSTEM&:'):
+					# With SYSTEM&:, the print continues while the command runs.
+					background = comment.startswith('SYSTEM&:')
+					command = comment[8 if background else 7:]
+					if not re.match(self.allow_system, command):
+						errors.append('Warning: system command %s is forbidden and will not be run' % command)
+					add_record(protocol.parsed['SYSTEM'], [add_string(command), 1. if background else 0.])
 					continue
 				if line == '':
 					continue
@@ -1927,15 +2397,6 @@ class Printer: # {{{
 						errors.append('%d:invalid gcode command %s' % (lineno, repr((cmd, args))))
 					message = None
 			flush_pending()
-			stringmap = []
-			size = 0
-			for s in strings:
-				us = s.encode('utf-8')
-				stringmap.append(len(us))
-				dst.write(us)
-				size += len(us)
-			for s in stringmap:
-				dst.write(struct.pack('=L', s))
 			ret = bbox
 			if any(x is None for x in bbox[:4]):
 				bbox = bbox_last
@@ -1947,7 +2408,10 @@ class Printer: # {{{
 				for t, b in enumerate(bbox):
 					if b is None:
 						bbox[t] = 0;
-			dst.write(struct.pack('=L' + 'd' * 8, len(strings), *(bbox + time_dist)))
+			index_offset = out['offset']
+			output(b''.join(index))
+			dst.seek(0)
+			dst.write(struct.pack(protocol.run_header, protocol.run_magic, protocol.run_version, 1, out['records'], len(self.temps), *(bbox + time_dist + [index_offset, len(index), out['crc'], protocol.run_encoding_plain, 0])))
 		self._broadcast(None, 'blocked', None)
 		return ret and ret + time_dist, errors
 	# }}}
@@ -2144,7 +2608,7 @@ class Printer: # {{{
 			self.id = id
 			self.value = float('nan')
 		def read(self, data):
-			self.R0, self.R1, logRc, Tc, self.beta, self.heater_pin, self.fan_pin, self.thermistor_pin, fan_temp, self.fan_duty, heater_limit_l, heater_limit_h, fan_limit_l, fan_limit_h, self.hold_time = struct.unpack('=dddddHHHddddddd', data)
+			self.R0, self.R1, logRc, Tc, self.beta, self.heater_pin, self.fan_pin, self.thermistor_pin, fan_temp, self.fan_duty, heater_limit_l, heater_limit_h, fan_limit_l, fan_limit_h, self.hold_time, self.heater_p, self.heater_i, self.heater_d = struct.unpack('=dddddHHHdddddddddd', data)
 			try:
 				self.Rc = math.exp(logRc)
 			except:
@@ -2161,14 +2625,14 @@ class Printer: # {{{
 				logRc = math.log(self.Rc)
 			except:
 				logRc = float('nan')
-			return struct.pack('=dddddHHHddddddd', self.R0, self.R1, logRc, self.Tc + C0, self.beta, self.heater_pin, self.fan_pin ^ 0x200, self.thermistor_pin, self.fan_temp + C0, self.fan_duty, self.heater_limit_l + C0, self.heater_limit_h + C0, self.fan_limit_l + C0, self.fan_limit_h + C0, self.hold_time)
+			return struct.pack('=dddddHHHdddddddddd', self.R0, self.R1, logRc, self.Tc + C0, self.beta, self.heater_pin, self.fan_pin ^ 0x200, self.thermistor_pin, self.fan_temp + C0, self.fan_duty, self.heater_limit_l + C0, self.heater_limit_h + C0, self.fan_limit_l + C0, self.fan_limit_h + C0, self.hold_time, self.heater_p, self.heater_i, self.heater_d)
 		def export(self):
-			return [self.name, self.R0, self.R1, self.Rc, self.Tc, self.beta, self.heater_pin, self.fan_pin, self.thermistor_pin, self.fan_temp, self.fan_duty, self.heater_limit_l, self.heater_limit_h, self.fan_limit_l, self.fan_limit_h, self.hold_time, self.value]
+			return [self.name, self.R0, self.R1, self.Rc, self.Tc, self.beta, self.heater_pin, self.fan_pin, self.thermistor_pin, self.fan_temp, self.fan_duty, self.heater_limit_l, self.heater_limit_h, self.fan_limit_l, self.fan_limit_h, self.hold_time, self.value, self.heater_p, self.heater_i, self.heater_d]
 		def export_settings(self):
 			ret = '[temp %d]\r\n' % self.id
 			ret += 'name = %s\r\n' % self.name
 			ret += ''.join(['%s = %s\r\n' % (x, write_pin(getattr(self, x))) for x in ('heater_pin', 'fan_pin', 'thermistor_pin')])
-			ret += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('fan_temp', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time')])
+			ret += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('fan_temp', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time', 'heater_p', 'heater_i', 'heater_d')])
 			return ret
 	# }}}
 	class Gpio: # {{{
@@ -2235,7 +2699,10 @@ class Printer: # {{{
 		angle = math.radians(angle)
 		self.gcode_angle = math.sin(angle), math.cos(angle)
 		self.probe_speed = speed
-		self._do_probe(id, 0, 0, self.get_axis_pos(0, 2), angle)
+		if self._pin_valid(self.probe_pin):
+			self._probe_grid(id, angle)
+		else:
+			self._do_probe(id, 0, 0, self.get_axis_pos(0, 2), angle)
 	# }}}
 	def line(self, moves = (), f0 = None, f1 = None, v0 = None, v1 = None, relative = False, probe = False, single = False, force = False): # {{{
 		'''Move the tool in a straight line.
@@ -2262,6 +2729,32 @@ class Printer: # {{{
 		self.line(moves, f0, f1, v0, v1, relative, probe, single)
 		self.wait_for_cb()[1](id)
 	# }}}
+	def lines(self, lines, force = False): # {{{
+		'''Move the tool along a sequence of straight lines.
+		Each element of lines is a dict with keyword arguments for line().
+		All lines are queued before any of them is sent, so they are sent
+		in as few packets as possible.
+		'''
+		if not force and self.home_phase is not None and not self.paused:
+			log('ignoring lines during home')
+			return
+		for ln in lines:
+			self.queue.append((ln.get('moves', ()), ln.get('f0'), ln.get('f1'), ln.get('v0'), ln.get('v1'), ln.get('probe', False), ln.get('single', False), ln.get('relative', False)))
+		if not self.wait:
+			self._do_queue()
+	# }}}
+	@delayed
+	def lines_cb(self, id, lines): # {{{
+		'''Move the tool along a sequence of straight lines; return when done.
+		'''
+		if self.home_phase is not None and not self.paused:
+			log('ignoring linescb during home')
+			if id is not None:
+				self._send(id, 'return', None)
+			return
+		self.lines(lines)
+		self.wait_for_cb()[1](id)
+	# }}}
 	def move_target(self, dx, dy): # {{{
 		'''Move the target position.
 		Using this function avoids a round trip to the driver.
@@ -2415,6 +2908,9 @@ class Printer: # {{{
 			if cmd != protocol.rcommand['QUEUE']:
 				log('invalid reply to queued command')
 				return
+			# Held moves were counted as sent, but they never reached the cdriver.
+			s += len(self.held_moves)
+			self.held_moves = []
 			self.movewait = 0
 			self.wait = False
 		self.paused = pausing
@@ -2544,7 +3040,7 @@ class Printer: # {{{
 		self.audio_id = id
 		self.sleep(False)
 		filename = fhs.read_spool(os.path.join(self.uuid, 'audio', name + os.extsep + 'bin'), opened = False)
-		self._send_packet(struct.pack('=BBddBB', protocol.command['RUN_FILE'], 1, 0, 0, motor, 0) + filename.encode('utf8'))
+		self._send_packet(struct.pack('=BBddBBL', protocol.command['RUN_FILE'], 1, 0, 0, motor, 0, 0) + filename.encode('utf8'))
 	# }}}
 	def benjamin_audio_add_file(self, filename, name): # {{{
 		with open(filename, 'rb') as f:
@@ -2630,8 +3126,8 @@ class Printer: # {{{
 		message += 'unit_name=%s\r\n' % self.unit_name
 		message += 'spi_setup=%s\r\n' % self._mangle_spi()
 		message += ''.join(['%s = %s\r\n' % (x, write_pin(getattr(self, x))) for x in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin')])
-		message += ''.join(['%s = %d\r\n' % (x, getattr(self, x)) for x in ('bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout')])
-		message += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('probe_dist', 'probe_safe_dist', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v')])
+		message += ''.join(['%s = %d\r\n' % (x, getattr(self, x)) for x in ('bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout', 'probe_bicubic')])
+		message += ''.join(['%s = %f\r\n' % (x, getattr(self, x)) for x in ('probe_dist', 'probe_safe_dist', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v', 'run_horizon')])
 		for i, s in enumerate(self.spaces):
 			message += s.export_settings()
 		for i, t in enumerate(self.temps):
@@ -2662,9 +3158,9 @@ class Printer: # {{{
 		globals_changed = True
 		changed = {'space': set(), 'temp': set(), 'gpio': set(), 'axis': set(), 'motor': set(), 'extruder': set(), 'delta': set(), 'follower': set()}
 		keys = {
-				'general': {'num_temps', 'num_gpios', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v'},
+				'general': {'num_temps', 'num_gpios', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'temp_scale_min', 'temp_scale_max', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v', 'run_horizon', 'probe_bicubic'},
 				'space': {'type', 'num_axes', 'delta_angle', 'polar_max_r'},
-				'temp': {'name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time'},
+				'temp': {'name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time', 'heater_p', 'heater_i', 'heater_d'},
 				'gpio': {'name', 'pin', 'state', 'reset', 'duty'},
 				'axis': {'name', 'park', 'park_order', 'min', 'max', 'home_pos2'},
 				'motor': {'step_pin', 'dir_pin', 'enable_pin', 'limit_min_pin', 'limit_max_pin', 'steps_per_unit', 'home_pos', 'limit_v', 'limit_a', 'home_order'},
@@ -2901,6 +3397,15 @@ class Printer: # {{{
 		else:
 			filename = fhs.read_spool(os.path.join(self.uuid, 'gcode', name + os.extsep + 'bin'), opened = False)
 			del self.jobqueue[name]
+			self.valid_files.pop(name, None)
+			if name in self.compiling:
+				process = self.compiling.pop(name)
+				process.kill()
+				process.communicate()
+			if name in self.checking:
+				process = self.checking.pop(name)[0]
+				process.kill()
+				process.communicate()
 			self._broadcast(None, 'queue', [(q, self.jobqueue[q]) for q in self.jobqueue])
 		try:
 			os.unlink(filename)
@@ -2908,8 +3413,12 @@ class Printer: # {{{
 			log('unable to unlink %s' % filename)
 	# }}}
 	@delayed
-	def queue_print(self, id, names, angle = 0, probemap = None): # {{{
+	def queue_print(self, id, names, angle = 0, probemap = None, first_record = 0): # {{{
 		'''Run one or more new jobs.
+		If first_record is given, the first job starts at that record.  Temperatures, gpios and the
+		extruder position are restored from the last index snapshot before it and the records in
+		between; the machine must be moved to a safe position before resuming, because the first move
+		goes straight to its target.
 		'''
 		if len(self.jobs_active) > 0 and not self.paused:
 			log('ignoring print request while print is in progress: %s' % repr(self.jobs_active) + str(self.paused))
@@ -2920,6 +3429,7 @@ class Printer: # {{{
 		#log('set active jobs to %s' % names)
 		self.jobs_active = names
 		self.jobs_angle = angle
+		self.jobs_first_record = first_record
 		self.probemap = probemap
 		self.job_current = -1	# next_job will make it start at 0.
 		self.job_id = id
@@ -3001,16 +3511,68 @@ class Printer: # {{{
 	def get_globals(self): # {{{
 		#log('getting globals')
 		ret = {'num_temps': len(self.temps), 'num_gpios': len(self.gpios)}
-		for key in ('uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'paused', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v'):
+		for key in ('uuid', 'queue_length', 'num_pins', 'led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'probe_dist', 'probe_safe_dist', 'bed_id', 'fan_id', 'spindle_id', 'unit_name', 'timeout', 'feedrate', 'targetx', 'targety', 'zoffset', 'store_adc', 'temp_scale_min', 'temp_scale_max', 'paused', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'spi_setup', 'max_deviation', 'max_v', 'run_horizon', 'probe_bicubic'):
 			ret[key] = getattr(self, key)
 		return ret
 	# }}}
+	def get_status(self): # {{{
+		'''Return current position, temperature and queue state.
+		run_margin is the time until the queue runs empty while a file is running, in seconds.
+		Temperatures are in °C.
+		This is read from the status page, without a round trip to the cdriver.
+		Returns None if the status page is not available.
+		'''
+		data = self.printer.status()
+		if data is None or data[1] != STATUS_VERSION:
+			return None
+		seq, version, running, current, queue, num_temps, hwtime, t = data[:8]
+		num_axes = data[8:8 + NUM_SPACES]
+		num_motors = data[8 + NUM_SPACES:8 + 2 * NUM_SPACES]
+		p = 8 + 2 * NUM_SPACES
+		axes = data[p:p + NUM_SPACES * STATUS_MAX_AXES]
+		p += NUM_SPACES * STATUS_MAX_AXES
+		motors = data[p:p + NUM_SPACES * STATUS_MAX_AXES]
+		p += NUM_SPACES * STATUS_MAX_AXES
+		temps = data[p:p + min(num_temps, STATUS_MAX_TEMPS)]
+		p += STATUS_MAX_TEMPS
+		run_margin = data[p]
+		return {
+				'running_fragment': running,
+				'current_fragment': current,
+				'queue_length': queue,
+				'hwtime': hwtime,
+				'time': t,
+				'axis': [list(axes[s * STATUS_MAX_AXES:s * STATUS_MAX_AXES + num_axes[s]]) for s in range(NUM_SPACES)],
+				'motor': [list(motors[s * STATUS_MAX_AXES:s * STATUS_MAX_AXES + num_motors[s]]) for s in range(NUM_SPACES)],
+				'temp': [t - C0 for t in temps],
+				'run_margin': run_margin}
+	# }}}
+	def get_temp_history(self, channel, tier = None): # {{{
+		'''Return the recorded history of a temperature sensor.
+		Tier 0 holds every reading; every next tier combines TELEMETRY_FACTOR records of the previous one.
+		The result is a list of tiers, or only the requested tier.  Every tier is a list of records, oldest first.
+		A record is [time, adc, min, max, mean, duty], with time in seconds since the epoch and temperatures in °C.
+		This is read from the telemetry page, without a round trip to the cdriver.
+		Returns None if the history is not available.
+		'''
+		channel = int(channel)
+		if not 0 <= channel < len(self.temps):
+			return None
+		data = self.printer.telemetry(channel)
+		if data is None:
+			return None
+		offset = C0 if not math.isnan(self.temps[channel].beta) else 0
+		ret = [[[t, adc, tmin - offset, tmax - offset, tmean - offset, duty] for t, adc, tmin, tmax, tmean, duty in records] for records in data]
+		return ret if tier is None else ret[int(tier)]
+	# }}}
 	def expert_set_globals(self, update = True, **ka): # {{{
 		#log('setting variables with %s' % repr(ka))
 		nt = ka.pop('num_temps') if 'num_temps' in ka else None
 		ng = ka.pop('num_gpios') if 'num_gpios' in ka else None
 		if 'store_adc' in ka:
 			self.store_adc = bool(ka.pop('store_adc'))
+		if 'probe_bicubic' in ka:
+			self.probe_bicubic = bool(ka.pop('probe_bicubic'))
 		if 'unit_name' in ka:
 			self.unit_name = ka.pop('unit_name')
 		if 'spi_setup' in ka:
@@ -3020,7 +3582,7 @@ class Printer: # {{{
 		for key in ('led_pin', 'stop_pin', 'probe_pin', 'spiss_pin', 'bed_id', 'fan_id', 'spindle_id', 'park_after_print', 'sleep_after_print', 'cool_after_print', 'timeout'):
 			if key in ka:
 				setattr(self, key, int(ka.pop(key)))
-		for key in ('probe_dist', 'probe_safe_dist', 'feedrate', 'targetx', 'targety', 'zoffset', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v'):
+		for key in ('probe_dist', 'probe_safe_dist', 'feedrate', 'targetx', 'targety', 'zoffset', 'temp_scale_min', 'temp_scale_max', 'max_deviation', 'max_v', 'run_horizon'):
 			if key in ka:
 				setattr(self, key, float(ka.pop(key)))
 		self._write_globals(nt, ng, update = update)
@@ -3213,13 +3775,13 @@ class Printer: # {{{
 	# Temp {{{
 	def get_temp(self, temp): # {{{
 		ret = {}
-		for key in ('name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time'):
+		for key in ('name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time', 'heater_p', 'heater_i', 'heater_d'):
 			ret[key] = getattr(self.temps[temp], key)
 		return ret
 	# }}}
 	def expert_set_temp(self, temp, update = True, **ka): # {{{
 		ret = {}
-		for key in ('name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time'):
+		for key in ('name', 'R0', 'R1', 'Rc', 'Tc', 'beta', 'heater_pin', 'fan_pin', 'thermistor_pin', 'fan_temp', 'fan_duty', 'heater_limit_l', 'heater_limit_h', 'fan_limit_l', 'fan_limit_h', 'hold_time', 'heater_p', 'heater_i', 'heater_d'):
 			if key in ka:
 				setattr(self.temps[temp], key, ka.pop(key))
 		self._send_packet(struct.pack('=BB', protocol.command['WRITE_TEMP'], temp) + self.temps[temp].write())
@@ -3295,9 +3857,15 @@ while True: # {{{
 		printer._printer_input()
 	if len(call_queue) > 0:
 		continue	# Handle this first.
-	fds = [sys.stdin, printer.printer]
+	fds = [sys.stdin, printer.printer] + [p.stdout for p in printer.compiling.values()] + [c[0].stdout for c in printer.checking.values()]
 	#log('waiting; movewait = %d' % printer.movewait)
 	found = select.select(fds, [], fds, None)
+	for name, p in tuple(printer.compiling.items()):
+		if p.stdout in found[0] or p.stdout in found[2]:
+			printer._gcode_compile_done(name)
+	for name, c in tuple(printer.checking.items()):
+		if c[0].stdout in found[0] or c[0].stdout in found[2]:
+			printer._run_file_checked(name)
 	if sys.stdin in found[0] or sys.stdin in found[2]:
 		#log('command')
 		printer._command_input()
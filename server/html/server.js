@@ -367,6 +367,9 @@ function _setup_updater() {
 			printers[port].temps[index].fan_limit_h = values[14];
 			printers[port].temps[index].hold_time = values[15];
 			printers[port].temps[index].value = values[16];
+			printers[port].temps[index].heater_p = values[17];
+			printers[port].temps[index].heater_i = values[18];
+			printers[port].temps[index].heater_d = values[19];
 			trigger_update(port, 'temp_update', index);
 		},
 		gpio_update: function(port, index, values) {
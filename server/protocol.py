@@ -71,6 +71,8 @@ command = {
 	'GETTIME': 0x1f,
 	'SPI': 0x20,
 	'ADJUSTPROBE': 0x21,
+	'LINES': 0x22,
+	'PROBE_GRID': 0x23,
 	}
 
 rcommand = {
@@ -96,6 +98,8 @@ rcommand = {
 	'FILE_DONE': 0x53,
 	'PARKWAIT': 0x54,
 	'PINNAME': 0x55,
+	'ACCEPTED': 0x56,
+	'PROBE_DONE': 0x57,
 	}
 
 parsed = {
@@ -113,6 +117,16 @@ parsed = {
 	'PARK': 11,
 }
 
+# Run file layout; this must match runfile.h.
+run_magic = b'FRNKRUN'
+run_version = 3
+run_header = '=8sLLLL8dQLLLL'	# magic, version, complete, num_records, num_temps, bbox + time + dist, index_offset, index_size, checksum, encoding, reserved
+run_encoding_plain = 0
+run_encoding_compact = 1
+run_record = '=Bl8d'
+run_snapshot = '=LQl6d%dd'	# record, offset, tool, X, Y, Z, E, time, dist, bed + num_temps temperatures
+run_index_interval = 1024
+
 mask = [[0xc0, 0xc3, 0xff, 0x09],
 	[0x38, 0x3a, 0x7e, 0x13],
 	[0x26, 0xb5, 0xb9, 0x23],